@@ -0,0 +1,9 @@
+#include <linux/compiler.h>
+
+/* READ_ONCE() and WRITE_ONCE() appeared with linux-3.19,
+ * before that there was only ACCESS_ONCE() */
+int foo(int *p)
+{
+	WRITE_ONCE(*p, 1);
+	return READ_ONCE(*p);
+}
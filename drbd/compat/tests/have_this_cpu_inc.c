@@ -0,0 +1,7 @@
+#include <linux/percpu.h>
+
+/* this_cpu_inc() and friends appeared with linux-2.6.33 */
+void foo(unsigned long __percpu *counter)
+{
+	this_cpu_inc(*counter);
+}
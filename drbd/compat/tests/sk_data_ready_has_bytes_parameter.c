@@ -0,0 +1,7 @@
+#include <net/sock.h>
+
+/* linux-3.15 dropped the bytes parameter of sk_data_ready() */
+void foo(struct sock *sk)
+{
+	sk->sk_data_ready(sk, 0);
+}
@@ -251,6 +251,76 @@ find_active_resync_extent(struct drbd_device *device, unsigned int enr)
 	return NULL;
 }
 
+/* Caller holds al_lock. */
+static void al_trace_record(struct drbd_device *device, u32 what)
+{
+	struct drbd_al_trace *t = &device->al_trace;
+
+	if (!t->size)
+		return;
+	t->entries[t->pos] = what;
+	if (++t->pos == t->size)
+		t->pos = 0;
+	t->cnt++;
+}
+
+/* Count an activity log reference to extent @enr in the coarse heatmap.
+ * If @enr is beyond the currently covered range, halve the resolution
+ * until it fits; this way we never need to know the device size.
+ * Caller holds al_lock. */
+static void al_stats_account(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_stats *s = &device->al_stats;
+	unsigned int i;
+
+	while ((enr >> s->heat_shift) >= DRBD_AL_HEAT_BUCKETS) {
+		for (i = 0; i < DRBD_AL_HEAT_BUCKETS / 2; i++)
+			s->heat[i] = s->heat[2*i] + s->heat[2*i + 1];
+		memset(&s->heat[DRBD_AL_HEAT_BUCKETS / 2], 0,
+		       sizeof(s->heat) / 2);
+		s->heat_shift++;
+	}
+	s->heat[enr >> s->heat_shift]++;
+	al_trace_record(device, enr);
+}
+
+/* An activity log reference to @enr that was not granted: @enr is not in
+ * the active set, and it cannot be changed right now.  Caller holds al_lock. */
+static void al_stats_account_miss(struct drbd_device *device, unsigned int enr)
+{
+	al_trace_record(device, (enr & DRBD_AL_TRACE_ENR_MASK) |
+			(device->act_log->flags & LC_STARVING ?
+			 DRBD_AL_TRACE_STARVING : DRBD_AL_TRACE_MISS));
+}
+
+/* Remember the current act_log counters in the history ring,
+ * at most once per second.  Caller holds al_lock. */
+static void al_stats_sample(struct drbd_device *device)
+{
+	struct drbd_al_stats *s = &device->al_stats;
+	struct lru_cache *al = device->act_log;
+	struct drbd_al_sample *last, *h;
+
+	if (s->history_cnt) {
+		last = &s->history[(s->history_pos + DRBD_AL_HISTORY - 1) % DRBD_AL_HISTORY];
+		if (time_before(jiffies, last->jif + HZ))
+			return;
+	}
+
+	h = &s->history[s->history_pos];
+	h->jif = jiffies;
+	h->hits = lc_hits(al);
+	h->misses = al->misses;
+	h->starving = al->starving;
+	h->changed = al->changed;
+	h->evicted = al->evicted;
+	h->transactions = device->al_writ_cnt;
+
+	s->history_pos = (s->history_pos + 1) % DRBD_AL_HISTORY;
+	if (s->history_cnt < DRBD_AL_HISTORY)
+		s->history_cnt++;
+}
+
 static
 struct lc_element *_al_get(struct drbd_device *device, unsigned int enr, bool nonblock)
 {
@@ -271,10 +341,51 @@ struct lc_element *_al_get(struct drbd_device *device, unsigned int enr, bool no
 		al_ext = lc_try_get(device->act_log, enr);
 	else
 		al_ext = lc_get(device->act_log, enr);
+	if (al_ext)
+		al_stats_account(device, enr);
+	else
+		al_stats_account_miss(device, enr);
 	spin_unlock_irq(&device->al_lock);
 	return al_ext;
 }
 
+/* Lockless variant of _al_get(device, enr, true), for extents that are
+ * already referenced.  Not used while tracing, as the trace wants to see
+ * every reference. */
+static bool _al_get_rcu(struct drbd_device *device, unsigned int enr)
+{
+	struct lc_element *al_ext;
+	struct bm_extent *bm_ext;
+
+	if (device->al_trace.size)
+		return false;
+
+	rcu_read_lock();
+	al_ext = lc_try_get_rcu(READ_ONCE(device->act_log), enr, &device->al_lock);
+	rcu_read_unlock();
+	if (!al_ext)
+		return false;
+
+	/* lc_try_get_rcu() implied a full memory barrier.  Pairs with the
+	 * smp_mb() in _is_in_al() and drbd_try_rs_begin_io(): either resync
+	 * sees our reference, or we see it is about to lock some extent. */
+	if (likely(!READ_ONCE(device->resync_locked)))
+		return true;
+
+	spin_lock_irq(&device->al_lock);
+	bm_ext = find_active_resync_extent(device, enr);
+	if (!bm_ext) {
+		spin_unlock_irq(&device->al_lock);
+		return true;
+	}
+	lc_put(device->act_log, al_ext);
+	set_bit(BME_PRIORITY, &bm_ext->flags);
+	spin_unlock_irq(&device->al_lock);
+	/* resync may be waiting for exactly this reference to go away */
+	wake_up(&device->al_wait);
+	return false;
+}
+
 bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i)
 {
 	/* for bios crossing activity log extent boundaries,
@@ -289,7 +400,7 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 	if (first != last)
 		return false;
 
-	return _al_get(device, first, true);
+	return _al_get_rcu(device, first) || _al_get(device, first, true);
 }
 
 bool drbd_al_begin_io_prepare(struct drbd_device *device, struct drbd_interval *i)
@@ -502,6 +613,8 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 				we need an "lc_cancel" here;
 			*/
 			lc_committed(device->act_log);
+			al_stats_sample(device);
+			al_trace_record(device, DRBD_AL_TRACE_COMMIT);
 			spin_unlock_irq(&device->al_lock);
 		}
 		lc_unlock(device->act_log);
@@ -549,6 +662,8 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		 * or requests to "cold" extents could be starved. */
 		if (!al->pending_changes)
 			__set_bit(__LC_STARVING, &device->act_log->flags);
+		for (enr = first; enr <= last; enr++)
+			al_stats_account_miss(device, enr);
 		return -ENOBUFS;
 	}
 
@@ -574,6 +689,8 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		al_ext = lc_get_cumulative(device->act_log, enr);
 		if (!al_ext)
 			drbd_info(device, "LOGIC BUG for enr=%u\n", enr);
+		else
+			al_stats_account(device, enr);
 	}
 	return 0;
 }
@@ -608,7 +725,7 @@ static int _try_lc_del(struct drbd_device *device, struct lc_element *al_ext)
 	int rv;
 
 	spin_lock_irq(&device->al_lock);
-	rv = (al_ext->refcnt == 0);
+	rv = (atomic_read(&al_ext->refcnt) == 0);
 	if (likely(rv))
 		lc_del(device->act_log, al_ext);
 	spin_unlock_irq(&device->al_lock);
@@ -957,7 +1074,7 @@ struct bm_extent *_bme_get(struct drbd_device *device, unsigned int enr)
 			lc_committed(device->resync);
 			wakeup = 1;
 		}
-		if (bm_ext->lce.refcnt == 1)
+		if (atomic_read(&bm_ext->lce.refcnt) == 1)
 			device->resync_locked++;
 		set_bit(BME_NO_WRITES, &bm_ext->flags);
 	}
@@ -980,6 +1097,8 @@ static int _is_in_al(struct drbd_device *device, unsigned int enr)
 {
 	int rv;
 
+	/* resync_locked was increased, pairs with _al_get_rcu() */
+	smp_mb();
 	spin_lock_irq(&device->al_lock);
 	rv = lc_is_used(device->act_log, enr);
 	spin_unlock_irq(&device->al_lock);
@@ -1108,8 +1227,8 @@ int drbd_try_rs_begin_io(struct drbd_device *device, sector_t sector)
 			 * but then could not set BME_LOCKED,
 			 * so we tried again.
 			 * drop the extra reference. */
-			bm_ext->lce.refcnt--;
-			D_ASSERT(device, bm_ext->lce.refcnt > 0);
+			atomic_dec(&bm_ext->lce.refcnt);
+			D_ASSERT(device, atomic_read(&bm_ext->lce.refcnt) > 0);
 		}
 		goto check_al;
 	} else {
@@ -1135,11 +1254,13 @@ int drbd_try_rs_begin_io(struct drbd_device *device, sector_t sector)
 			D_ASSERT(device, test_bit(BME_LOCKED, &bm_ext->flags) == 0);
 		}
 		set_bit(BME_NO_WRITES, &bm_ext->flags);
-		D_ASSERT(device, bm_ext->lce.refcnt == 1);
+		D_ASSERT(device, atomic_read(&bm_ext->lce.refcnt) == 1);
 		device->resync_locked++;
 		goto check_al;
 	}
 check_al:
+	/* pairs with _al_get_rcu() */
+	smp_mb();
 	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
 		if (lc_is_used(device->act_log, al_enr+i))
 			goto try_again;
@@ -1186,7 +1307,7 @@ void drbd_rs_complete_io(struct drbd_device *device, sector_t sector)
 		return;
 	}
 
-	if (bm_ext->lce.refcnt == 0) {
+	if (atomic_read(&bm_ext->lce.refcnt) == 0) {
 		spin_unlock_irqrestore(&device->al_lock, flags);
 		drbd_err(device, "drbd_rs_complete_io(,%llu [=%u]) called, "
 		    "but refcnt is 0!?\n",
@@ -1253,9 +1374,9 @@ int drbd_rs_del_all(struct drbd_device *device)
 				device->resync_wenr = LC_FREE;
 				lc_put(device->resync, &bm_ext->lce);
 			}
-			if (bm_ext->lce.refcnt != 0) {
+			if (atomic_read(&bm_ext->lce.refcnt) != 0) {
 				drbd_info(device, "Retrying drbd_rs_del_all() later. "
-				     "refcnt=%d\n", bm_ext->lce.refcnt);
+				     "refcnt=%d\n", atomic_read(&bm_ext->lce.refcnt));
 				put_ldev(device);
 				spin_unlock_irq(&device->al_lock);
 				return -EAGAIN;
@@ -123,6 +123,13 @@ struct drbd_bitmap {
 	/* debugging aid, in case we are still racy somewhere */
 	char          *bm_why;
 	struct task_struct *bm_task;
+
+	/* identifies the last bitmap exchange both peers completed,
+	 * 0 if we cannot tell which bits changed since then,
+	 * see drbd_bm_xchg_commit() */
+	u64 bm_xchg_token;
+	/* we sent our bitmap, waiting for the peer to confirm */
+	bool bm_xchg_pending;
 };
 
 #define bm_print_lock_info(m) __bm_print_lock_info(m, __func__)
@@ -204,6 +211,11 @@ void drbd_bm_unlock(struct drbd_device *device)
 /* pages marked with this "HINT" will be considered for writeout
  * on activity log transactions */
 #define BM_PAGE_HINT_WRITEOUT	27
+/* bits have been set since we last sent the bitmap to the peer */
+#define BM_PAGE_XCHG_DIRTY	26
+/* bits have been set since the last bitmap exchange the peer confirmed,
+ * and we sent them, but the peer did not confirm that exchange (yet) */
+#define BM_PAGE_XCHG_SENT	25
 
 /* store_page_idx uses non-atomic assignment. It is only used directly after
  * allocating the page.  All other bm_set_page_* and bm_clear_page_* need to
@@ -251,6 +263,7 @@ static void bm_set_page_unchanged(struct page *page)
 static void bm_set_page_need_writeout(struct page *page)
 {
 	set_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
+	set_bit(BM_PAGE_XCHG_DIRTY, &page_private(page));
 }
 
 void drbd_bm_reset_al_hints(struct drbd_device *device)
@@ -671,6 +684,9 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 	if (capacity == b->bm_dev_capacity)
 		goto out;
 
+	spin_lock_irq(&b->bm_lock);
+	b->bm_xchg_token = 0;
+	spin_unlock_irq(&b->bm_lock);
 
 	if (capacity == 0) {
 		spin_lock_irq(&b->bm_lock);
@@ -835,7 +851,7 @@ void drbd_bm_merge_lel(struct drbd_device *device, size_t offset, size_t number,
 {
 	struct drbd_bitmap *b = device->bitmap;
 	unsigned long *p_addr, *bm;
-	unsigned long word, bits;
+	unsigned long word;
 	unsigned int idx;
 	size_t end, do_now;
 
@@ -857,11 +873,15 @@ void drbd_bm_merge_lel(struct drbd_device *device, size_t offset, size_t number,
 		p_addr = bm_map_pidx(b, idx);
 		bm = p_addr + MLPP(offset);
 		offset += do_now;
+		/* Only count the bits that are new.  The received bitmap is
+		 * typically sparse, skip words without anything to merge. */
 		while (do_now--) {
-			bits = hweight_long(*bm);
-			word = *bm | *buffer++;
-			*bm++ = word;
-			b->bm_set += hweight_long(word) - bits;
+			word = *buffer++ & ~*bm;
+			if (word) {
+				*bm |= word;
+				b->bm_set += hweight_long(word);
+			}
+			bm++;
 		}
 		bm_unmap(p_addr);
 		bm_set_page_need_writeout(b->bm_pages[idx]);
@@ -928,6 +948,7 @@ void drbd_bm_set_all(struct drbd_device *device)
 	bm_memset(b, 0, 0xff, b->bm_words);
 	(void)bm_clear_surplus(b);
 	b->bm_set = b->bm_bits;
+	b->bm_xchg_token = 0;
 	spin_unlock_irq(&b->bm_lock);
 }
 
@@ -943,6 +964,7 @@ void drbd_bm_clear_all(struct drbd_device *device)
 	spin_lock_irq(&b->bm_lock);
 	bm_memset(b, 0, 0, b->bm_words);
 	b->bm_set = 0;
+	b->bm_xchg_token = 0;
 	spin_unlock_irq(&b->bm_lock);
 }
 
@@ -1213,6 +1235,13 @@ static int bm_rw(struct drbd_device *device, const unsigned int flags, unsigned
  */
 int drbd_bm_read(struct drbd_device *device) __must_hold(local)
 {
+	struct drbd_bitmap *b = device->bitmap;
+
+	/* we do not know what happened to the bitmap while we were away */
+	spin_lock_irq(&b->bm_lock);
+	b->bm_xchg_token = 0;
+	spin_unlock_irq(&b->bm_lock);
+
 	return bm_rw(device, BM_AIO_READ, 0);
 }
 
@@ -1375,6 +1404,47 @@ unsigned long _drbd_bm_find_next_zero(struct drbd_device *device, unsigned long
 	return __bm_find_next(device, bm_fo, 1, KM_USER1);
 }
 
+/* Like _drbd_bm_find_next(_zero), but pretend that all pages without
+ * BM_PAGE_XCHG_SENT are clear.  Used to send only the changes since the
+ * last confirmed bitmap exchange, see drbd_bm_xchg_prepare(). */
+unsigned long _drbd_bm_find_next_xchg(struct drbd_device *device, unsigned long bm_fo,
+		const int find_zero_bit)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long found;
+
+#define page_sent(bitnr) \
+	test_bit(BM_PAGE_XCHG_SENT, &page_private(b->bm_pages[bm_bit_to_page_idx(b, bitnr)]))
+
+	while (bm_fo < b->bm_bits) {
+		if (!page_sent(bm_fo)) {
+			/* counts as all clear */
+			if (find_zero_bit)
+				return bm_fo;
+			bm_fo = (bm_fo & ~BITS_PER_PAGE_MASK) + BITS_PER_PAGE;
+			continue;
+		}
+		found = __bm_find_next(device, bm_fo, find_zero_bit, KM_USER1);
+		if (!find_zero_bit) {
+			if (found >= b->bm_bits || page_sent(found))
+				return found;
+			/* skip that page in the next iteration */
+			bm_fo = found;
+			continue;
+		}
+		/* All bits from bm_fo up to found are set.  The first page in
+		 * between that was not sent counts as clear. */
+		found = min(found, b->bm_bits);
+		for (bm_fo = (bm_fo & ~BITS_PER_PAGE_MASK) + BITS_PER_PAGE;
+		     bm_fo < found; bm_fo += BITS_PER_PAGE)
+			if (!page_sent(bm_fo))
+				return bm_fo;
+		return found < b->bm_bits ? found : DRBD_END_OF_BITMAP;
+	}
+#undef page_sent
+	return DRBD_END_OF_BITMAP;
+}
+
 /* returns number of bits actually changed.
  * for val != 0, we change 0 -> 1, return code positive
  * for val == 0, we change 1 -> 0, return code negative
@@ -1469,24 +1539,24 @@ int drbd_bm_clear_bits(struct drbd_device *device, const unsigned long s, const
 static inline void bm_set_full_words_within_one_page(struct drbd_bitmap *b,
 		int page_nr, int first_word, int last_word)
 {
-	int i;
-	int bits;
-	int changed = 0;
+	int nbits = (last_word - first_word) * BITS_PER_LONG;
+	int changed;
 	unsigned long *paddr = drbd_kmap_atomic(b->bm_pages[page_nr], KM_IRQ1);
 
-	/* I think it is more cache line friendly to hweight_long then set to ~0UL,
-	 * than to first bitmap_weight() all words, then bitmap_fill() all words */
-	for (i = first_word; i < last_word; i++) {
-		bits = hweight_long(paddr[i]);
-		paddr[i] = ~0UL;
-		changed += BITS_PER_LONG - bits;
-	}
+	/* At most one page, which stays in cache between the two passes.
+	 * bitmap_weight() and memset() use the architecture's optimized
+	 * popcount and block store, which beats hweight_long() and a store
+	 * per word. */
+	changed = nbits - bitmap_weight(paddr + first_word, nbits);
+	if (changed)
+		memset(paddr + first_word, 0xff, nbits / 8);
 	drbd_kunmap_atomic(paddr, KM_IRQ1);
 	if (changed) {
 		/* We only need lazy writeout, the information is still in the
 		 * remote bitmap as well, and is reconstructed during the next
 		 * bitmap exchange, if lost locally due to a crash. */
 		bm_set_page_lazy_writeout(b->bm_pages[page_nr]);
+		set_bit(BM_PAGE_XCHG_DIRTY, &page_private(b->bm_pages[page_nr]));
 		b->bm_set += changed;
 	}
 }
@@ -1606,15 +1676,54 @@ int drbd_bm_test_bit(struct drbd_device *device, const unsigned long bitnr)
 	return i;
 }
 
+/* number of set bits in [first, last] of one mapped bitmap page,
+ * both in bits relative to the start of that page */
+static int bm_page_weight(const unsigned long *p_addr,
+		unsigned long first, unsigned long last)
+{
+	unsigned long first_word = first >> LN2_BPL;
+	unsigned long last_word = last >> LN2_BPL;
+	unsigned long first_mask = cpu_to_lel(~0UL << (first & BITS_PER_LONG_MASK));
+	unsigned long last_mask = cpu_to_lel(~0UL >> (BITS_PER_LONG_MASK - (last & BITS_PER_LONG_MASK)));
+	int c;
+
+	if (first_word == last_word)
+		return hweight_long(p_addr[first_word] & first_mask & last_mask);
+
+	c = hweight_long(p_addr[first_word] & first_mask);
+	c += bitmap_weight(p_addr + first_word + 1,
+			(last_word - first_word - 1) * BITS_PER_LONG);
+	c += hweight_long(p_addr[last_word] & last_mask);
+	return c;
+}
+
+#ifdef DRBD_DEBUG_BM_COUNT
+/* Build with -DDRBD_DEBUG_BM_COUNT to have every bm_page_weight()
+ * checked against testing one bit at a time, as it used to be done. */
+static void bm_page_weight_check(struct drbd_device *device, unsigned long *p_addr,
+		unsigned long first, unsigned long last, int c)
+{
+	unsigned long bitnr;
+	int slow = 0;
+
+	for (bitnr = first; bitnr <= last; bitnr++)
+		slow += (0 != test_bit_le(bitnr, p_addr));
+	if (slow != c)
+		drbd_err(device, "bm_page_weight(%lu, %lu) = %d, bit by bit: %d\n",
+			 first, last, c, slow);
+}
+#else
+#define bm_page_weight_check(device, p_addr, first, last, c) do { } while (0)
+#endif
+
 /* returns number of bits set in the range [s, e] */
 int drbd_bm_count_bits(struct drbd_device *device, const unsigned long s, const unsigned long e)
 {
 	unsigned long flags;
 	struct drbd_bitmap *b = device->bitmap;
-	unsigned long *p_addr = NULL;
-	unsigned long bitnr;
-	unsigned int page_nr = -1U;
-	int c = 0;
+	unsigned long *p_addr;
+	unsigned long bitnr, first, last, end = e;
+	int c = 0, w;
 
 	/* If this is called without a bitmap, that is a bug.  But just to be
 	 * robust in case we screwed up elsewhere, in that case pretend there
@@ -1628,21 +1737,20 @@ int drbd_bm_count_bits(struct drbd_device *device, const unsigned long s, const
 	spin_lock_irqsave(&b->bm_lock, flags);
 	if (BM_DONT_TEST & b->bm_flags)
 		bm_print_lock_info(device);
-	for (bitnr = s; bitnr <= e; bitnr++) {
-		unsigned int idx = bm_bit_to_page_idx(b, bitnr);
-		if (page_nr != idx) {
-			page_nr = idx;
-			if (p_addr)
-				bm_unmap(p_addr);
-			p_addr = bm_map_pidx(b, idx);
-		}
-		if (expect(bitnr < b->bm_bits))
-			c += (0 != test_bit_le(bitnr - (page_nr << (PAGE_SHIFT+3)), p_addr));
-		else
-			drbd_err(device, "bitnr=%lu bm_bits=%lu\n", bitnr, b->bm_bits);
+	if (!expect(end < b->bm_bits)) {
+		drbd_err(device, "bitnr=%lu bm_bits=%lu\n", end, b->bm_bits);
+		end = b->bm_bits - 1;
 	}
-	if (p_addr)
+	/* page wise, full words with bitmap_weight() */
+	for (bitnr = s; bitnr <= end; bitnr += last - first + 1) {
+		first = bitnr & BITS_PER_PAGE_MASK;
+		last = min_t(unsigned long, first + (end - bitnr), BITS_PER_PAGE_MASK);
+		p_addr = bm_map_pidx(b, bm_bit_to_page_idx(b, bitnr));
+		w = bm_page_weight(p_addr, first, last);
+		bm_page_weight_check(device, p_addr, first, last, w);
+		c += w;
 		bm_unmap(p_addr);
+	}
 	spin_unlock_irqrestore(&b->bm_lock, flags);
 	return c;
 }
@@ -1696,3 +1804,104 @@ int drbd_bm_e_weight(struct drbd_device *device, unsigned long enr)
 #endif
 	return count;
 }
+
+/* see the bm_xchg_token member of struct drbd_bitmap */
+u64 drbd_bm_xchg_token(struct drbd_device *device)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	u64 token;
+
+	if (!b || !b->bm_pages)
+		return 0;
+	spin_lock_irq(&b->bm_lock);
+	token = b->bm_xchg_token;
+	spin_unlock_irq(&b->bm_lock);
+	return token;
+}
+
+/* A new connection: whatever we sent before did not get confirmed. */
+void drbd_bm_xchg_cancel(struct drbd_device *device)
+{
+	struct drbd_bitmap *b = device->bitmap;
+
+	spin_lock_irq(&b->bm_lock);
+	b->bm_xchg_pending = false;
+	spin_unlock_irq(&b->bm_lock);
+}
+
+/**
+ * drbd_bm_xchg_prepare() - Mark the pages to be sent to the peer
+ * @device:	DRBD device.
+ * @peer_token:	The peer's token of the last confirmed exchange.
+ *
+ * Moves BM_PAGE_XCHG_DIRTY to BM_PAGE_XCHG_SENT.  If both peers agree on
+ * the last exchange, only pages with BM_PAGE_XCHG_SENT need to be sent,
+ * the peer already knows all other bits.
+ *
+ * Returns the number of such pages if that is the case, -1 otherwise.
+ * The bitmap must be locked with drbd_bm_lock().
+ */
+long drbd_bm_xchg_prepare(struct drbd_device *device, u64 peer_token)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long *flags;
+	long count = 0;
+	unsigned int i;
+
+	if (!expect(b))
+		return -1;
+	if (!expect(b->bm_pages))
+		return -1;
+
+	spin_lock_irq(&b->bm_lock);
+	b->bm_xchg_pending = false;
+	for (i = 0; i < b->bm_number_of_pages; i++) {
+		flags = &page_private(b->bm_pages[i]);
+		if (test_and_clear_bit(BM_PAGE_XCHG_DIRTY, flags))
+			set_bit(BM_PAGE_XCHG_SENT, flags);
+		count += test_bit(BM_PAGE_XCHG_SENT, flags);
+	}
+	if (!b->bm_xchg_token || b->bm_xchg_token != peer_token)
+		count = -1;
+	spin_unlock_irq(&b->bm_lock);
+	return count;
+}
+
+/* We sent the whole bitmap, respectively all changes. */
+void drbd_bm_xchg_sent(struct drbd_device *device)
+{
+	struct drbd_bitmap *b = device->bitmap;
+
+	spin_lock_irq(&b->bm_lock);
+	b->bm_xchg_pending = true;
+	spin_unlock_irq(&b->bm_lock);
+}
+
+/**
+ * drbd_bm_xchg_commit() - Both peers completed the bitmap exchange
+ * @device:	DRBD device.
+ * @token:	Identifies this exchange, the same value on both peers.
+ *
+ * The sync source calls this right before it sends the sync UUID, the sync
+ * target when it receives it; @token is that UUID.  The sync source got the
+ * target's bitmap, which is sent only after it received the source's, and
+ * the sync UUID is sent only after all that.  From now on, the peer knows
+ * about all bits we had set when we sent it the bitmap.
+ */
+void drbd_bm_xchg_commit(struct drbd_device *device, u64 token)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int i;
+
+	if (!b || !b->bm_pages)
+		return;
+
+	spin_lock_irq(&b->bm_lock);
+	if (b->bm_xchg_pending) {
+		for (i = 0; i < b->bm_number_of_pages; i++)
+			clear_bit(BM_PAGE_XCHG_SENT, &page_private(b->bm_pages[i]));
+		b->bm_xchg_token = token;
+		b->bm_xchg_pending = false;
+	}
+	spin_unlock_irq(&b->bm_lock);
+}
@@ -6,6 +6,7 @@
 #include <linux/stat.h>
 #include <linux/jiffies.h>
 #include <linux/list.h>
+#include <linux/vmalloc.h>
 
 #include "drbd_int.h"
 #include "drbd_req.h"
@@ -362,6 +363,7 @@ static int in_flight_summary_show(struct seq_file *m, void *pos)
 {
 	struct drbd_resource *resource = m->private;
 	struct drbd_connection *connection;
+	struct drbd_transport_ops *transport;
 	unsigned long jif = jiffies;
 
 	connection = first_connection(resource);
@@ -384,15 +386,9 @@ static int in_flight_summary_show(struct seq_file *m, void *pos)
 	seq_puts(m, "socket buffer stats\n");
 	/* for each connection ... once we have more than one */
 	rcu_read_lock();
-	if (connection->data.socket) {
-		/* open coded SIOCINQ, the "relevant" part */
-		struct tcp_sock *tp = tcp_sk(connection->data.socket->sk);
-		int answ = tp->rcv_nxt - tp->copied_seq;
-		seq_printf(m, "unread receive buffer: %u Byte\n", answ);
-		/* open coded SIOCOUTQ, the "relevant" part */
-		answ = tp->write_seq - tp->snd_una;
-		seq_printf(m, "unacked send buffer: %u Byte\n", answ);
-	}
+	transport = rcu_dereference(connection->transport);
+	if (connection->data.stream && transport->debugfs_show)
+		transport->debugfs_show(connection, m);
 	rcu_read_unlock();
 	seq_putc(m, '\n');
 
@@ -580,6 +576,7 @@ static int callback_history_show(struct seq_file *m, void *ignored)
 
 	seq_puts(m, "n\tage\tcallsite\tfn\n");
 	seq_print_timing_details(m, "worker", connection->w_cb_nr, connection->w_timing_details, jif);
+	seq_print_timing_details(m, "sender", connection->s_cb_nr, connection->s_timing_details, jif);
 	seq_print_timing_details(m, "receiver", connection->r_cb_nr, connection->r_timing_details, jif);
 	return 0;
 }
@@ -653,6 +650,90 @@ static const struct file_operations connection_oldest_requests_fops = {
 	.release	= connection_oldest_requests_release,
 };
 
+static int connection_integrity_stats_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "sample_every\t%u\n", drbd_integrity_sample_every(connection));
+	seq_printf(m, "sent\t%lu\n", connection->integrity_sent);
+	seq_printf(m, "skipped\t%lu\n", connection->integrity_skipped);
+	seq_printf(m, "checked\t%lu\n", connection->integrity_checked);
+	seq_printf(m, "failed\t%lu\n", connection->integrity_failed);
+	return 0;
+}
+
+static int connection_integrity_stats_open(struct inode *inode, struct file *file)
+{
+	struct drbd_connection *connection = inode->i_private;
+	return drbd_single_open(file, connection_integrity_stats_show, connection,
+				&connection->kref, drbd_destroy_connection);
+}
+
+static int connection_integrity_stats_release(struct inode *inode, struct file *file)
+{
+	struct drbd_connection *connection = inode->i_private;
+	kref_put(&connection->kref, drbd_destroy_connection);
+	return single_release(inode, file);
+}
+
+static const struct file_operations connection_integrity_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= connection_integrity_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= connection_integrity_stats_release,
+};
+
+static void seq_print_transport_stats(struct seq_file *m, const char *name,
+				      struct drbd_transport_stats *st)
+{
+	/* the time includes waiting for the peer, or for buffer space */
+	seq_printf(m, "%s\tsend\t%llu calls\t%llu bytes\t%llu usec\n", name,
+		   st->send_calls, st->send_bytes, div_u64(st->send_ns, NSEC_PER_USEC));
+	seq_printf(m, "%s\trecv\t%llu calls\t%llu bytes\t%llu usec\n", name,
+		   st->recv_calls, st->recv_bytes, div_u64(st->recv_ns, NSEC_PER_USEC));
+}
+
+static int connection_transport_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	rcu_read_lock();
+	seq_printf(m, "transport\t%s\n", rcu_dereference(connection->transport)->name);
+	rcu_read_unlock();
+	seq_print_transport_stats(m, "data", &connection->data.stats);
+	seq_print_transport_stats(m, "meta", &connection->meta.stats);
+	return 0;
+}
+
+static int connection_transport_open(struct inode *inode, struct file *file)
+{
+	struct drbd_connection *connection = inode->i_private;
+	return drbd_single_open(file, connection_transport_show, connection,
+				&connection->kref, drbd_destroy_connection);
+}
+
+static int connection_transport_release(struct inode *inode, struct file *file)
+{
+	struct drbd_connection *connection = inode->i_private;
+	kref_put(&connection->kref, drbd_destroy_connection);
+	return single_release(inode, file);
+}
+
+static const struct file_operations connection_transport_fops = {
+	.owner		= THIS_MODULE,
+	.open		= connection_transport_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= connection_transport_release,
+};
+
 void drbd_debugfs_connection_add(struct drbd_connection *connection)
 {
 	struct dentry *conns_dir = connection->resource->debugfs_res_connections;
@@ -681,6 +762,20 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	if (IS_ERR_OR_NULL(dentry))
 		goto fail;
 	connection->debugfs_conn_oldest_requests = dentry;
+
+	dentry = debugfs_create_file("integrity_stats", S_IRUSR|S_IRGRP,
+			connection->debugfs_conn, connection,
+			&connection_integrity_stats_fops);
+	if (IS_ERR_OR_NULL(dentry))
+		goto fail;
+	connection->debugfs_conn_integrity_stats = dentry;
+
+	dentry = debugfs_create_file("transport", S_IRUSR|S_IRGRP,
+			connection->debugfs_conn, connection,
+			&connection_transport_fops);
+	if (IS_ERR_OR_NULL(dentry))
+		goto fail;
+	connection->debugfs_conn_transport = dentry;
 	return;
 
 fail:
@@ -692,6 +787,8 @@ void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 {
 	drbd_debugfs_remove(&connection->debugfs_conn_callback_history);
 	drbd_debugfs_remove(&connection->debugfs_conn_oldest_requests);
+	drbd_debugfs_remove(&connection->debugfs_conn_integrity_stats);
+	drbd_debugfs_remove(&connection->debugfs_conn_transport);
 	drbd_debugfs_remove(&connection->debugfs_conn);
 }
 
@@ -736,6 +833,137 @@ static int device_act_log_extents_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static void seq_print_al_interval(struct seq_file *m,
+		const struct drbd_al_sample *a, const struct drbd_al_sample *b,
+		unsigned long now)
+{
+	unsigned long hits = b->hits - a->hits;
+	unsigned long misses = b->misses - a->misses;
+	unsigned long total = hits + misses;
+
+	seq_printf(m, "%u\t%u\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%u\n",
+		jiffies_to_msecs(now - b->jif),
+		jiffies_to_msecs(b->jif - a->jif),
+		hits, misses,
+		total ? hits * 1000 / total : 1000,
+		b->changed - a->changed,
+		b->evicted - a->evicted,
+		b->starving - a->starving,
+		b->transactions - a->transactions);
+}
+
+static int device_act_log_stats_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_al_stats *s;
+	struct drbd_al_sample now;
+	struct lru_cache *al;
+	unsigned long jif = jiffies;
+	unsigned int used, nr_elements, i, n;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	if (!get_ldev_if_state(device, D_FAILED)) {
+		kfree(s);
+		return 0;
+	}
+	spin_lock_irq(&device->al_lock);
+	al = device->act_log;
+	*s = device->al_stats;
+	used = al->used;
+	nr_elements = al->nr_elements;
+	now.jif = jif;
+	now.hits = lc_hits(al);
+	now.misses = al->misses;
+	now.starving = al->starving;
+	now.changed = al->changed;
+	now.evicted = al->evicted;
+	now.transactions = device->al_writ_cnt;
+	spin_unlock_irq(&device->al_lock);
+	put_ldev(device);
+
+	seq_printf(m, "used: %u/%u\n", used, nr_elements);
+	seq_printf(m, "hits: %lu\nmisses: %lu\nstarving: %lu\nchanged: %lu\nevicted: %lu\ntransactions: %u\n",
+		now.hits, now.misses, now.starving, now.changed, now.evicted,
+		now.transactions);
+
+	/* newest first; the first line covers "since the last sample" */
+	seq_puts(m, "\nage_ms\tinterval_ms\thits\tmisses\thit_permille\tchanged\tevicted\tstarving\ttransactions\n");
+	if (s->history_cnt) {
+		i = (s->history_pos + DRBD_AL_HISTORY - 1) % DRBD_AL_HISTORY;
+		seq_print_al_interval(m, &s->history[i], &now, jif);
+		for (n = 1; n < s->history_cnt; n++) {
+			unsigned int prev = (i + DRBD_AL_HISTORY - 1) % DRBD_AL_HISTORY;
+			seq_print_al_interval(m, &s->history[prev], &s->history[i], jif);
+			i = prev;
+		}
+	}
+
+	/* only buckets that have been referenced at all */
+	seq_printf(m, "\nextents_per_bucket: %u\n", 1U << s->heat_shift);
+	seq_puts(m, "first_extent\taccesses\n");
+	for (i = 0; i < DRBD_AL_HEAT_BUCKETS; i++) {
+		if (!s->heat[i])
+			continue;
+		seq_printf(m, "%u\t%u\n", i << s->heat_shift, s->heat[i]);
+	}
+
+	kfree(s);
+	return 0;
+}
+
+/* One referenced extent number per line, oldest first; "M <enr>" or
+ * "S <enr>" for references that were not granted (not in the active set,
+ * or the activity log was starving), "T" marks a committed activity log
+ * transaction.  tests/lru_cache_bench -f replays this. */
+static int device_act_log_trace_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_al_trace *t = &device->al_trace;
+	unsigned int size = t->size, pos, n, i;
+	u64 cnt;
+	u32 *e;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 1);
+
+	if (!size) {
+		seq_puts(m, "disabled, see module parameter al_trace_entries\n");
+		return 0;
+	}
+
+	e = vmalloc(size * sizeof(u32));
+	if (!e)
+		return -ENOMEM;
+
+	spin_lock_irq(&device->al_lock);
+	memcpy(e, t->entries, size * sizeof(u32));
+	pos = t->pos;
+	cnt = t->cnt;
+	spin_unlock_irq(&device->al_lock);
+
+	n = cnt < size ? (unsigned int)cnt : size;
+	seq_printf(m, "recorded: %llu\nshown: %u\n\n", (unsigned long long)cnt, n);
+	for (i = (pos + size - n) % size; n--; i = (i + 1) % size) {
+		if (e[i] == DRBD_AL_TRACE_COMMIT)
+			seq_puts(m, "T\n");
+		else if (e[i] & DRBD_AL_TRACE_MISS)
+			seq_printf(m, "M %u\n", e[i] & DRBD_AL_TRACE_ENR_MASK);
+		else if (e[i] & DRBD_AL_TRACE_STARVING)
+			seq_printf(m, "S %u\n", e[i] & DRBD_AL_TRACE_ENR_MASK);
+		else
+			seq_printf(m, "%u\n", e[i]);
+	}
+
+	vfree(e);
+	return 0;
+}
+
 static int device_oldest_requests_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -813,6 +1041,8 @@ static const struct file_operations device_ ## name ## _fops = {		\
 
 drbd_debugfs_device_attr(oldest_requests)
 drbd_debugfs_device_attr(act_log_extents)
+drbd_debugfs_device_attr(act_log_stats)
+drbd_debugfs_device_attr(act_log_trace)
 drbd_debugfs_device_attr(resync_extents)
 drbd_debugfs_device_attr(data_gen_id)
 drbd_debugfs_device_attr(ed_gen_id)
@@ -861,6 +1091,8 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 
 	DCF(oldest_requests);
 	DCF(act_log_extents);
+	DCF(act_log_stats);
+	DCF(act_log_trace);
 	DCF(resync_extents);
 	DCF(data_gen_id);
 	DCF(ed_gen_id);
@@ -877,6 +1109,8 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_minor);
 	drbd_debugfs_remove(&device->debugfs_vol_oldest_requests);
 	drbd_debugfs_remove(&device->debugfs_vol_act_log_extents);
+	drbd_debugfs_remove(&device->debugfs_vol_act_log_stats);
+	drbd_debugfs_remove(&device->debugfs_vol_act_log_trace);
 	drbd_debugfs_remove(&device->debugfs_vol_resync_extents);
 	drbd_debugfs_remove(&device->debugfs_vol_data_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
@@ -41,6 +41,7 @@
 #include <linux/backing-dev.h>
 #include <linux/genhd.h>
 #include <linux/idr.h>
+#include <linux/srcu.h>
 #include <net/tcp.h>
 #include <linux/lru_cache.h>
 #include <linux/prefetch.h>
@@ -52,6 +53,7 @@
 #include "drbd_strings.h"
 #include "drbd_state.h"
 #include "drbd_protocol.h"
+#include "drbd_transport.h"
 
 #ifdef __CHECKER__
 # define __protected_by(x)       __attribute__((require_context(x,1,999,"rdwr")))
@@ -92,6 +94,7 @@ enum {
 extern unsigned int minor_count;
 extern bool disable_sendpage;
 extern bool allow_oos;
+extern unsigned int al_trace_entries;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int enable_faults;
@@ -299,6 +302,18 @@ struct bm_xfer_ctx {
 	/* statistics; index: (h->command == P_BITMAP) */
 	unsigned packets[2];
 	unsigned bytes[2];
+	/* of those in [0], how many used RLE_Rice_Bits */
+	unsigned rice_packets;
+	unsigned rice_bytes;
+
+	/* sender only: initial Golomb-Rice parameter for the next packet,
+	 * [0] clear, [1] set runs, and a page to encode it into, if the
+	 * peer understands DRBD_FF_BM_RICE */
+	unsigned int rice_k[2];
+	struct p_compressed_bm *rice_buf;
+	/* sender only: send changes since last exchange, see
+	 * drbd_bm_xchg_prepare() */
+	bool delta;
 };
 
 extern void INFO_bm_xfer_stats(struct drbd_device *device,
@@ -333,6 +348,15 @@ enum drbd_thread_state {
 	RESTARTING
 };
 
+/* Which of the per thread cpu masks in res_opts applies */
+enum drbd_thread_type {
+	DRBD_THREAD_RECEIVER,
+	DRBD_THREAD_ACK_RECEIVER,
+	DRBD_THREAD_WORKER,
+	DRBD_THREAD_SENDER,
+	DRBD_THREAD_TYPES
+};
+
 struct drbd_thread {
 	spinlock_t t_lock;
 	struct task_struct *task;
@@ -342,6 +366,7 @@ struct drbd_thread {
 	struct drbd_resource *resource;
 	struct drbd_connection *connection;
 	int reset_cpu_mask;
+	enum drbd_thread_type type;
 	const char *name;
 };
 
@@ -367,6 +392,9 @@ struct drbd_device_work {
 
 #include "drbd_interval.h"
 
+#define DRBD_REQ_HASH_BITS 10
+#define DRBD_REQ_HASH_SIZE (1 << DRBD_REQ_HASH_BITS)
+
 extern int drbd_wait_misc(struct drbd_device *, struct drbd_interval *);
 extern bool idr_is_empty(struct idr *idr);
 
@@ -397,13 +425,26 @@ struct drbd_request {
 
 	struct list_head tl_requests; /* ring list in the transfer log */
 	struct bio *master_bio;       /* master bio pointer */
+	/* more discards, contiguous to master_bio and merged into this
+	 * request, chained by bi_next.  See drbd_merge_discard(). */
+	struct bio *merged_bios;
 
 	/* see struct drbd_device */
 	struct list_head req_pending_master_completion;
 	struct list_head req_pending_local;
 
+	/* on device->req_hash while in read_ or write_requests */
+	struct hlist_node req_hash;
+
+	/* data-integrity digest of a write, calculated by the submitter,
+	 * and the integrity_gen of the tfm it used.  See drbd_req_csum(). */
+	void *digest;
+	unsigned int digest_gen;
+
 	/* for generic IO accounting */
 	unsigned long start_jif;
+	/* for the latency histogram, see struct drbd_perf_counters */
+	ktime_t start_kt;
 
 	/* for DRBD internal statistics */
 
@@ -629,6 +670,7 @@ enum {
 	RS_START,		/* tell worker to start resync/OV */
 	RS_PROGRESS,		/* tell worker that resync made significant progress */
 	RS_DONE,		/* tell worker that resync is done */
+	STATS_BCAST,		/* tell worker to broadcast performance statistics */
 };
 
 struct drbd_bitmap; /* opaque for drbd_device */
@@ -669,11 +711,24 @@ struct drbd_work_queue {
 
 struct drbd_socket {
 	struct mutex mutex;
-	struct socket    *socket;
+	void *stream;	/* owned by the transport, see drbd_transport.h */
 	/* this way we get our
 	 * send/receive buffers off the stack */
 	void *sbuf;
 	void *rbuf;
+	struct drbd_transport_stats stats;
+};
+
+/* P_WRITE_ACK and P_RECV_ACK queued for one P_ACK_BATCH, protected by
+ * connection->meta.mutex.  Only collected while some drbd_ack_batch_begin()
+ * is open, and flushed before anything else is sent on the meta socket. */
+#define DRBD_ACK_BATCH_MAX 64
+struct drbd_ack_batch {
+	int open;
+	int vnr;
+	enum drbd_packet cmd;
+	unsigned int n;
+	struct p_block_ack acks[DRBD_ACK_BATCH_MAX];
 };
 
 struct drbd_md {
@@ -706,6 +761,63 @@ struct drbd_backing_dev {
 	sector_t known_size; /* last known size of that backing device */
 };
 
+/* application request statistics for the periodic DRBD_PERF_STATISTICS
+ * broadcast.  Protected by resource->req_lock, reset on each broadcast.
+ * Latency histogram bucket n counts requests that completed within
+ * [2^(n-1), 2^n) microseconds; the last bucket catches everything slower. */
+#define DRBD_LAT_HIST_BUCKETS 24
+struct drbd_perf_counters {
+	/* index: [0] read, [1] write */
+	u64 ios[2];
+	u64 bytes[2];
+	u32 lat_hist[2][DRBD_LAT_HIST_BUCKETS];
+};
+
+/* activity log statistics, exported via debugfs "act_log_stats".
+ * Protected by device->al_lock.
+ * history[] is a ring of snapshots of the act_log counters, taken at most once
+ * per second when an activity log transaction is committed.  heat[] counts
+ * activity log lookups that had to take al_lock (not the lockless hits on
+ * extents already in use) per region of the device; each bucket covers
+ * 2^heat_shift consecutive extents. */
+#define DRBD_AL_HISTORY 64
+#define DRBD_AL_HEAT_BUCKETS 128
+struct drbd_al_sample {
+	unsigned long jif;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long starving;
+	unsigned long changed;
+	unsigned long evicted;
+	unsigned int transactions;
+};
+
+struct drbd_al_stats {
+	struct drbd_al_sample history[DRBD_AL_HISTORY];
+	unsigned int history_pos;	/* next slot to be written */
+	unsigned int history_cnt;
+	unsigned int heat_shift;
+	u32 heat[DRBD_AL_HEAT_BUCKETS];
+};
+
+/* Optional record of activity log references, for offline replay against
+ * lru_cache (tests/lru_cache_bench).  Sized by the al_trace_entries module
+ * parameter, protected by device->al_lock.  Entries are extent numbers in
+ * reference order, flagged with DRBD_AL_TRACE_MISS or DRBD_AL_TRACE_STARVING
+ * if the reference was not granted; DRBD_AL_TRACE_COMMIT marks a committed
+ * activity log transaction. */
+#define DRBD_AL_TRACE_COMMIT (~0U)
+#define DRBD_AL_TRACE_MISS (1U << 31)
+#define DRBD_AL_TRACE_STARVING (1U << 30)
+#define DRBD_AL_TRACE_ENR_MASK (DRBD_AL_TRACE_STARVING - 1)
+#define DRBD_AL_TRACE_MAX (1U << 20)
+struct drbd_al_trace {
+	u32 *entries;
+	unsigned int size;
+	unsigned int pos;	/* next slot to be written */
+	u64 cnt;		/* total entries recorded */
+};
+
 struct drbd_md_io {
 	struct page *page;
 	unsigned long start_jif;	/* last call to drbd_md_get_buffer */
@@ -751,6 +863,7 @@ enum {
 				 * and potentially deadlock on, this drbd worker.
 				 */
 	DISCONNECT_SENT,
+	SESSION_RESUMING,	/* handshake with the peer of the held session */
 
 	DEVICE_WORK_PENDING,	/* tell worker that some device has pending work */
 };
@@ -777,14 +890,21 @@ struct drbd_resource {
 	unsigned susp:1;		/* IO suspended by user */
 	unsigned susp_nod:1;		/* IO suspended because no data */
 	unsigned susp_fen:1;		/* IO suspended because fence peer handler runs */
+	unsigned susp_res:1;		/* IO suspended while the session may resume */
 
 	enum write_ordering_e write_ordering;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30) && !defined(cpumask_bits)
 	cpumask_t cpu_mask[1];
+	cpumask_t thread_cpu_mask[DRBD_THREAD_TYPES][1];
 #else
 	cpumask_var_t cpu_mask;
+	/* overrides cpu_mask for one type of thread, unless empty */
+	cpumask_var_t thread_cpu_mask[DRBD_THREAD_TYPES];
 #endif
+	/* NUMA node of the backing devices, or else of the network interface;
+	 * threads are placed and requests allocated there */
+	int numa_node;
 };
 
 struct drbd_thread_timing_details
@@ -803,6 +923,8 @@ struct drbd_connection {
 	struct dentry *debugfs_conn;
 	struct dentry *debugfs_conn_callback_history;
 	struct dentry *debugfs_conn_oldest_requests;
+	struct dentry *debugfs_conn_integrity_stats;
+	struct dentry *debugfs_conn_transport;
 #endif
 	struct kref kref;
 	struct idr peer_devices;	/* volume number to peer device mapping */
@@ -819,23 +941,43 @@ struct drbd_connection {
 	struct sockaddr_storage peer_addr;
 	int peer_addr_len;
 
+	struct drbd_transport_ops *transport;	/* chosen in conn_connect(), holds a reference,
+						 * replaced with rcu_assign_pointer() for debugfs */
 	struct drbd_socket data;	/* data/barrier/cstate/parameter packets */
 	struct drbd_socket meta;	/* ping/ack (metadata) packets */
+	struct drbd_ack_batch ack_batch;
 	int agreed_pro_version;		/* actually used protocol version */
 	u32 agreed_features;
 	unsigned long last_received;	/* in jiffies, either socket */
 	unsigned int ko_count;
 
+	/* session resume, see conn_session_lost() */
+	u64 my_session;
+	u64 peer_session;
+	unsigned long resume_deadline;	/* in jiffies, while resource->susp_res */
+	struct timer_list resume_timer;
+	struct drbd_work resume_work;
+
 	struct list_head transfer_log;	/* all requests not yet fully processed */
 
 	struct crypto_shash *cram_hmac_tfm;
-	struct crypto_ahash *integrity_tfm;  /* checksums we compute, updates protected by connection->data->mutex */
+	struct crypto_ahash *integrity_tfm;  /* checksums we compute, updates protected by connection->data->mutex,
+					      * and freed only after an integrity_srcu grace period */
+	struct srcu_struct integrity_srcu; /* submitters hashing with integrity_tfm, see drbd_req_csum() */
+	unsigned int integrity_gen;	/* changes with integrity_tfm, see conn_set_integrity_tfm() */
 	struct crypto_ahash *peer_integrity_tfm;  /* checksums we verify, only accessed from receiver thread  */
 	struct crypto_ahash *csums_tfm;
 	struct crypto_ahash *verify_tfm;
 	void *int_dig_in;
 	void *int_dig_vv;
 
+	/* data-integrity-alg sampling, see drbd_integrity_sample() */
+	unsigned int integrity_seq;		/* protected by data.mutex */
+	unsigned long integrity_sent;		/* data packets we sent with digest */
+	unsigned long integrity_skipped;	/* ... and without */
+	unsigned long integrity_checked;	/* digests we verified, receiver thread only */
+	unsigned long integrity_failed;
+
 	/* receiver side */
 	struct drbd_epoch *current_epoch;
 	spinlock_t epoch_lock;
@@ -848,6 +990,7 @@ struct drbd_connection {
 	struct blk_plug receiver_plug;
 	struct drbd_thread receiver;
 	struct drbd_thread worker;
+	struct drbd_thread sender;
 	struct drbd_thread ack_receiver;
 	struct workqueue_struct *ack_sender;
 
@@ -859,12 +1002,16 @@ struct drbd_connection {
 	struct drbd_request *req_not_net_done;
 
 	/* sender side */
-	struct drbd_work_queue sender_work;
+	struct drbd_work_queue sender_work;	/* processed by the worker */
+	/* requests to be sent, and unplug hints, processed by the sender */
+	struct drbd_work_queue data_work;
 
 #define DRBD_THREAD_DETAILS_HIST	16
 	unsigned int w_cb_nr; /* keeps counting up */
+	unsigned int s_cb_nr; /* keeps counting up */
 	unsigned int r_cb_nr; /* keeps counting up */
 	struct drbd_thread_timing_details w_timing_details[DRBD_THREAD_DETAILS_HIST];
+	struct drbd_thread_timing_details s_timing_details[DRBD_THREAD_DETAILS_HIST];
 	struct drbd_thread_timing_details r_timing_details[DRBD_THREAD_DETAILS_HIST];
 
 	struct {
@@ -895,6 +1042,47 @@ static inline bool has_net_conf(struct drbd_connection *connection)
 	return has_net_conf;
 }
 
+/* Publish a new integrity_tfm.  The generation changes after the tfm, so a
+ * digest tagged with the new generation was calculated with the new tfm,
+ * see drbd_req_csum(). */
+static inline void conn_set_integrity_tfm(struct drbd_connection *connection,
+					  struct crypto_ahash *tfm)
+{
+	rcu_assign_pointer(connection->integrity_tfm, tfm);
+	smp_wmb();
+	connection->integrity_gen++;
+}
+
+/* With DRBD_FF_INTEGRITY_SAMPLE, only every nth data packet carries a digest */
+static inline unsigned int drbd_integrity_sample_every(struct drbd_connection *connection)
+{
+	struct net_conf *nc;
+	unsigned int every = 1;
+
+	if (!(connection->agreed_features & DRBD_FF_INTEGRITY_SAMPLE))
+		return 1;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (nc)
+		every = nc->integrity_sample;
+	rcu_read_unlock();
+
+	return max(every, 1U);
+}
+
+/* size of the digest the peer put in front of the payload of this
+ * P_DATA, P_WSAME, P_DATA_REPLY or P_RS_DATA_REPLY */
+static inline int drbd_peer_digest_size(struct drbd_connection *connection, struct p_data *p)
+{
+	if (!connection->peer_integrity_tfm)
+		return 0;
+	if (connection->agreed_features & DRBD_FF_INTEGRITY_SAMPLE &&
+	    !(be32_to_cpu(p->dp_flags) & DP_DIGEST))
+		return 0;
+	return crypto_ahash_digestsize(connection->peer_integrity_tfm);
+}
+
 void __update_timing_details(
 		struct drbd_thread_timing_details *tdp,
 		unsigned int *cb_nr,
@@ -903,6 +1091,8 @@ void __update_timing_details(
 
 #define update_worker_timing_details(c, cb) \
 	__update_timing_details(c->w_timing_details, &c->w_cb_nr, cb, __func__ , __LINE__ )
+#define update_sender_timing_details(c, cb) \
+	__update_timing_details(c->s_timing_details, &c->s_cb_nr, cb, __func__ , __LINE__ )
 #define update_receiver_timing_details(c, cb) \
 	__update_timing_details(c->r_timing_details, &c->r_cb_nr, cb, __func__ , __LINE__ )
 
@@ -938,6 +1128,8 @@ struct drbd_device {
 	struct dentry *debugfs_vol;
 	struct dentry *debugfs_vol_oldest_requests;
 	struct dentry *debugfs_vol_act_log_extents;
+	struct dentry *debugfs_vol_act_log_stats;
+	struct dentry *debugfs_vol_act_log_trace;
 	struct dentry *debugfs_vol_resync_extents;
 	struct dentry *debugfs_vol_data_gen_id;
 	struct dentry *debugfs_vol_ed_gen_id;
@@ -966,6 +1158,7 @@ struct drbd_device {
 	struct timer_list md_sync_timer;
 	struct timer_list start_resync_timer;
 	struct timer_list request_timer;
+	struct timer_list stats_timer;
 #ifdef DRBD_DEBUG_MD_SYNC
 	struct {
 		unsigned int line;
@@ -985,6 +1178,13 @@ struct drbd_device {
 	unsigned int writ_cnt;
 	unsigned int al_writ_cnt;
 	unsigned int bm_writ_cnt;
+	struct drbd_perf_counters perf;
+	/* reference values of the previous statistics broadcast */
+	unsigned long perf_last_jif;
+	unsigned long perf_al_hits;
+	unsigned long perf_al_misses;
+	unsigned long perf_al_evicted;
+	unsigned int perf_al_writ_cnt;
 	atomic_t ap_bio_cnt;	 /* Requests we need to complete */
 	atomic_t ap_actlog_cnt;  /* Requests waiting for activity log */
 	atomic_t ap_pending_cnt; /* AP data packets on the wire, ack expected */
@@ -996,6 +1196,10 @@ struct drbd_device {
 	/* Interval tree of pending local write requests */
 	struct rb_root read_requests;
 	struct rb_root write_requests;
+	/* The same requests, hashed by address, which is the block_id we
+	 * send to the peer.  Lets us verify block_ids in ack packets
+	 * without walking the trees.  Protected by req_lock. */
+	struct hlist_head req_hash[DRBD_REQ_HASH_SIZE];
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1047,6 +1251,7 @@ struct drbd_device {
 
 	int open_cnt;
 	u64 *p_uuid;
+	u64 peer_bm_token; /* from P_BM_TOKEN, see drbd_bm_xchg_prepare() */
 	/* FIXME clean comments, restructure so it is more obvious which
 	 * members are protected by what */
 
@@ -1065,6 +1270,8 @@ struct drbd_device {
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
+	struct drbd_al_stats al_stats;
+	struct drbd_al_trace al_trace;
 	unsigned int al_tr_number;
 	int al_tr_cycle;
 	wait_queue_head_t seq_wait;
@@ -1193,6 +1400,7 @@ enum dds_flags {
 extern void drbd_init_set_defaults(struct drbd_device *device);
 extern int  drbd_thread_start(struct drbd_thread *thi);
 extern void _drbd_thread_stop(struct drbd_thread *thi, int restart, int wait);
+extern void drbd_set_numa_node(struct drbd_resource *resource, int node);
 #ifdef CONFIG_SMP
 extern void drbd_thread_current_set_cpu(struct drbd_thread *thi);
 #else
@@ -1201,10 +1409,15 @@ extern void drbd_thread_current_set_cpu(struct drbd_thread *thi);
 extern void tl_release(struct drbd_connection *, unsigned int barrier_nr,
 		       unsigned int set_size);
 extern void tl_clear(struct drbd_connection *);
+extern void conn_session_lost(struct drbd_connection *connection);
 extern void drbd_free_sock(struct drbd_connection *connection);
-extern int drbd_send(struct drbd_connection *connection, struct socket *sock,
+extern int drbd_sendv(struct drbd_connection *connection, struct drbd_socket *sock,
+		      struct kvec *iov, int iovcnt, unsigned msg_flags);
+extern int drbd_sendv_all(struct drbd_connection *, struct drbd_socket *, struct kvec *, int,
+			  unsigned);
+extern int drbd_send(struct drbd_connection *connection, struct drbd_socket *sock,
 		     void *buf, size_t size, unsigned msg_flags);
-extern int drbd_send_all(struct drbd_connection *, struct socket *, void *, size_t,
+extern int drbd_send_all(struct drbd_connection *, struct drbd_socket *, void *, size_t,
 			 unsigned);
 
 extern int __drbd_send_protocol(struct drbd_connection *connection, enum drbd_packet cmd);
@@ -1212,6 +1425,7 @@ extern int drbd_send_protocol(struct drbd_connection *connection);
 extern int drbd_send_uuids(struct drbd_peer_device *);
 extern int drbd_send_uuids_skip_initial_sync(struct drbd_peer_device *);
 extern void drbd_gen_and_send_sync_uuid(struct drbd_peer_device *);
+extern int drbd_send_bm_token(struct drbd_peer_device *);
 extern int drbd_send_sizes(struct drbd_peer_device *peer_device, int trigger_reply, enum dds_flags flags);
 extern int drbd_send_state(struct drbd_peer_device *, union drbd_state);
 extern int drbd_send_current_state(struct drbd_peer_device *);
@@ -1220,6 +1434,8 @@ extern void drbd_send_b_ack(struct drbd_connection *connection, u32 barrier_nr,
 			    u32 set_size);
 extern int drbd_send_ack(struct drbd_peer_device *, enum drbd_packet,
 			 struct drbd_peer_request *);
+extern void drbd_ack_batch_begin(struct drbd_connection *connection);
+extern int drbd_ack_batch_end(struct drbd_connection *connection);
 extern void drbd_send_ack_rp(struct drbd_peer_device *, enum drbd_packet,
 			     struct p_block_req *rp);
 extern void drbd_send_ack_dp(struct drbd_peer_device *, enum drbd_packet,
@@ -1229,6 +1445,7 @@ extern int drbd_send_ack_ex(struct drbd_peer_device *, enum drbd_packet,
 extern int drbd_send_out_of_sync(struct drbd_peer_device *, struct drbd_request *);
 extern int drbd_send_block(struct drbd_peer_device *, enum drbd_packet,
 			   struct drbd_peer_request *);
+extern int __drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
 extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
 extern int drbd_send_drequest(struct drbd_peer_device *, int cmd,
 			      sector_t sector, int size, u64 block_id);
@@ -1245,6 +1462,7 @@ extern void drbd_backing_dev_free(struct drbd_device *device, struct drbd_backin
 extern void drbd_device_cleanup(struct drbd_device *device);
 extern void drbd_print_uuids(struct drbd_device *device, const char *text);
 extern void drbd_queue_unplug(struct drbd_device *device);
+extern void drbd_arm_stats_timer(struct drbd_device *device);
 
 extern void conn_md_sync(struct drbd_connection *connection);
 extern void drbd_md_write(struct drbd_device *device, void *buffer);
@@ -1495,6 +1713,13 @@ extern unsigned long drbd_bm_find_next(struct drbd_device *device, unsigned long
 /* bm_find_next variants for use while you hold drbd_bm_lock() */
 extern unsigned long _drbd_bm_find_next(struct drbd_device *device, unsigned long bm_fo);
 extern unsigned long _drbd_bm_find_next_zero(struct drbd_device *device, unsigned long bm_fo);
+extern unsigned long _drbd_bm_find_next_xchg(struct drbd_device *device, unsigned long bm_fo,
+		const int find_zero_bit);
+extern u64  drbd_bm_xchg_token(struct drbd_device *device);
+extern void drbd_bm_xchg_cancel(struct drbd_device *device);
+extern long drbd_bm_xchg_prepare(struct drbd_device *device, u64 peer_token);
+extern void drbd_bm_xchg_sent(struct drbd_device *device);
+extern void drbd_bm_xchg_commit(struct drbd_device *device, u64 token);
 extern unsigned long _drbd_bm_total_weight(struct drbd_device *device);
 extern unsigned long drbd_bm_total_weight(struct drbd_device *device);
 /* for receive_bitmap */
@@ -1515,6 +1740,19 @@ extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 extern mempool_t *drbd_request_mempool;
 extern mempool_t *drbd_ee_mempool;
 
+/* Allocate an object of a mempool's slab cache from @node, if that is
+ * possible without waiting; fall back to the mempool otherwise.
+ * mempool_free() takes back either. */
+static inline void *drbd_mempool_alloc_node(mempool_t *pool, struct kmem_cache *cache,
+					    gfp_t gfp_mask, int node)
+{
+	void *p = NULL;
+
+	if (node != NUMA_NO_NODE)
+		p = kmem_cache_alloc_node(cache, GFP_NOWAIT | __GFP_NOWARN, node);
+	return p ?: mempool_alloc(pool, gfp_mask);
+}
+
 /* drbd's page pool, used to buffer data received from the peer,
  * or data requested by the peer.
  *
@@ -1617,6 +1855,7 @@ extern int drbd_khelper(struct drbd_device *device, char *cmd);
 
 /* drbd_worker.c */
 extern int drbd_worker(struct drbd_thread *thi);
+extern int drbd_sender(struct drbd_thread *thi);
 enum drbd_ret_code drbd_resync_after_valid(struct drbd_device *device, int o_minor);
 void drbd_resync_after_changed(struct drbd_device *device);
 extern void drbd_start_resync(struct drbd_device *device, enum drbd_conns side);
@@ -1661,9 +1900,11 @@ extern int w_e_reissue(struct drbd_work *, int);
 extern int w_restart_disk_io(struct drbd_work *, int);
 extern int w_send_out_of_sync(struct drbd_work *, int);
 extern int w_start_resync(struct drbd_work *, int);
+extern int w_resume_expired(struct drbd_work *, int);
 
 extern void resync_timer_fn(unsigned long data);
 extern void start_resync_timer_fn(unsigned long data);
+extern void resume_timer_fn(unsigned long data);
 
 extern void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req);
 
@@ -1693,33 +1934,16 @@ extern struct page *drbd_alloc_pages(struct drbd_peer_device *, unsigned int, bo
 extern void drbd_set_recv_tcq(struct drbd_device *device, int tcq_enabled);
 extern void _drbd_clear_done_ee(struct drbd_device *device, struct list_head *to_be_freed);
 extern int drbd_connected(struct drbd_peer_device *);
+extern int drbd_send_first_packet(struct drbd_connection *, struct drbd_socket *,
+				  enum drbd_packet);
+extern int drbd_receive_first_packet(struct drbd_connection *, struct drbd_socket *);
 
-static inline void drbd_tcp_cork(struct socket *sock)
-{
-	int val = 1;
-	(void) kernel_setsockopt(sock, SOL_TCP, TCP_CORK,
-			(char*)&val, sizeof(val));
-}
-
-static inline void drbd_tcp_uncork(struct socket *sock)
-{
-	int val = 0;
-	(void) kernel_setsockopt(sock, SOL_TCP, TCP_CORK,
-			(char*)&val, sizeof(val));
-}
-
-static inline void drbd_tcp_nodelay(struct socket *sock)
-{
-	int val = 1;
-	(void) kernel_setsockopt(sock, SOL_TCP, TCP_NODELAY,
-			(char*)&val, sizeof(val));
-}
-
-static inline void drbd_tcp_quickack(struct socket *sock)
+/* cork, uncork, nodelay, ... the stream of sock, if it is established */
+static inline void drbd_stream_hint(struct drbd_connection *connection,
+				    struct drbd_socket *sock, enum drbd_tr_hints hint)
 {
-	int val = 2;
-	(void) kernel_setsockopt(sock, SOL_TCP, TCP_QUICKACK,
-			(char*)&val, sizeof(val));
+	if (sock->stream)
+		connection->transport->hint(sock, hint);
 }
 
 static inline sector_t drbd_get_capacity(struct block_device *bdev)
@@ -1816,6 +2040,7 @@ struct sib_info {
 	};
 };
 void drbd_bcast_event(struct drbd_device *device, const struct sib_info *sib);
+void drbd_bcast_perf_stats(struct drbd_device *device);
 
 extern void notify_resource_state(struct sk_buff *,
 				  unsigned int,
@@ -2089,6 +2314,7 @@ drbd_device_post_work(struct drbd_device *device, int work_bit)
 }
 
 extern void drbd_flush_workqueue(struct drbd_work_queue *work_queue);
+extern void drbd_flush_data_work(struct drbd_connection *connection);
 
 /* To get the ack_receiver out of the blocking network stack,
  * so it can change its sk_rcvtimeo from idle- to ping-timeout,
@@ -2107,8 +2333,12 @@ static inline void request_ping(struct drbd_connection *connection)
 	wake_ack_receiver(connection);
 }
 
+extern void *__conn_prepare_command(struct drbd_connection *, struct drbd_socket *);
 extern void *conn_prepare_command(struct drbd_connection *, struct drbd_socket *);
 extern void *drbd_prepare_command(struct drbd_peer_device *, struct drbd_socket *);
+extern int __conn_send_command(struct drbd_connection *, struct drbd_socket *,
+			       enum drbd_packet, unsigned int, void *,
+			       unsigned int);
 extern int conn_send_command(struct drbd_connection *, struct drbd_socket *,
 			     enum drbd_packet, unsigned int, void *,
 			     unsigned int);
@@ -2389,7 +2619,8 @@ static inline int drbd_suspended(struct drbd_device *device)
 {
 	struct drbd_resource *resource = device->resource;
 
-	return resource->susp || resource->susp_fen || resource->susp_nod;
+	return resource->susp || resource->susp_fen || resource->susp_nod ||
+		resource->susp_res;
 }
 
 static inline bool may_inc_ap_bio(struct drbd_device *device)
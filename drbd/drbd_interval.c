@@ -142,6 +142,12 @@ drbd_find_overlap(struct rb_root *root, sector_t sector, unsigned int size)
 		struct drbd_interval *here =
 			rb_entry(node, struct drbd_interval, rb);
 
+		/* Nothing in this subtree reaches up to sector.  At the root,
+		 * this rejects requests above everything in flight (typical
+		 * for sequential writers) without walking the tree at all. */
+		if (sector >= here->end)
+			break;
+
 		if (node->rb_left &&
 		    sector < interval_end(node->rb_left)) {
 			/* Overlap if any must be on left side */
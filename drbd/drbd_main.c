@@ -48,6 +48,7 @@
 #include <linux/notifier.h>
 #include <linux/kthread.h>
 #include <linux/workqueue.h>
+#include <linux/kmod.h>
 #define __KERNEL_SYSCALLS__
 #include <linux/unistd.h>
 #include <linux/vmalloc.h>
@@ -81,6 +82,7 @@ static int drbd_open(struct inode *inode, struct file *file);
 static DRBD_RELEASE_RETURN drbd_release(struct inode *inode, struct file *file);
 #endif
 static void md_sync_timer_fn(unsigned long data);
+static void stats_timer_fn(unsigned long data);
 static int w_bitmap_io(struct drbd_work *w, int unused);
 
 MODULE_AUTHOR("Philipp Reisner <phil@linbit.com>, "
@@ -101,6 +103,8 @@ module_param(minor_count, uint, 0444);
 module_param(disable_sendpage, bool, 0644);
 module_param(allow_oos, bool, 0);
 module_param(proc_details, int, 0644);
+MODULE_PARM_DESC(al_trace_entries, "Record the last N activity log references per device in debugfs (0: off)");
+module_param(al_trace_entries, uint, 0644);
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 int enable_faults;
@@ -122,6 +126,7 @@ unsigned int minor_count = DRBD_MINOR_COUNT_DEF;
 bool disable_sendpage;
 bool allow_oos;
 int proc_details;       /* Detail level in proc drbd*/
+unsigned int al_trace_entries; /* for devices created afterwards */
 
 /* Module parameter for setting the user mode helper program
  * to run. Default is /sbin/drbdadm */
@@ -215,29 +220,17 @@ int _get_ldev_if_state(struct drbd_device *device, enum drbd_disk_state mins)
 
 #endif
 
-/**
- * tl_release() - mark as BARRIER_ACKED all requests in the corresponding transfer log epoch
- * @connection:	DRBD connection.
- * @barrier_nr:	Expected identifier of the DRBD write barrier packet.
- * @set_size:	Expected number of requests before that barrier.
- *
- * In case the passed barrier_nr or set_size does not match the oldest
- * epoch of not yet barrier-acked requests, this function will cause a
- * termination of the connection.
- */
-void tl_release(struct drbd_connection *connection, unsigned int barrier_nr,
-		unsigned int set_size)
+/* find oldest not yet barrier-acked write request after @start,
+ * count writes in its epoch. */
+static struct drbd_request *tl_find_oldest_epoch(struct drbd_connection *connection,
+		struct list_head *start, int *expect_epoch, int *expect_size)
 {
-	struct drbd_request *r;
+	struct drbd_request *r = list_entry(start, struct drbd_request, tl_requests);
 	struct drbd_request *req = NULL;
-	int expect_epoch = 0;
-	int expect_size = 0;
-
-	spin_lock_irq(&connection->resource->req_lock);
 
-	/* find oldest not yet barrier-acked write request,
-	 * count writes in its epoch. */
-	list_for_each_entry(r, &connection->transfer_log, tl_requests) {
+	*expect_epoch = 0;
+	*expect_size = 0;
+	list_for_each_entry_continue(r, &connection->transfer_log, tl_requests) {
 		const unsigned s = r->rq_state;
 		if (!req) {
 			if (!(s & RQ_WRITE))
@@ -247,18 +240,53 @@ void tl_release(struct drbd_connection *connection, unsigned int barrier_nr,
 			if (s & RQ_NET_DONE)
 				continue;
 			req = r;
-			expect_epoch = req->epoch;
-			expect_size ++;
+			*expect_epoch = req->epoch;
+			(*expect_size)++;
 		} else {
-			if (r->epoch != expect_epoch)
+			if (r->epoch != *expect_epoch)
 				break;
 			if (!(s & RQ_WRITE))
 				continue;
 			/* if (s & RQ_DONE): not expected */
 			/* if (!(s & RQ_NET_MASK)): not expected */
-			expect_size++;
+			(*expect_size)++;
 		}
 	}
+	return req;
+}
+
+/**
+ * tl_release() - mark as BARRIER_ACKED all requests in the corresponding transfer log epoch
+ * @connection:	DRBD connection.
+ * @barrier_nr:	Expected identifier of the DRBD write barrier packet.
+ * @set_size:	Expected number of requests before that barrier.
+ *
+ * In case the passed barrier_nr or set_size does not match the oldest
+ * epoch of not yet barrier-acked requests, this function will cause a
+ * termination of the connection.
+ */
+void tl_release(struct drbd_connection *connection, unsigned int barrier_nr,
+		unsigned int set_size)
+{
+	struct drbd_request *r;
+	struct drbd_request *req = NULL;
+	int expect_epoch = 0;
+	int expect_size = 0;
+
+	spin_lock_irq(&connection->resource->req_lock);
+
+	/* The epoch to be barrier-acked has been sent completely, so its
+	 * oldest write is at or after the oldest request that has been sent
+	 * but is not yet net-done.  Start there instead of at the head of a
+	 * potentially very long transfer log.  Should that not find the
+	 * expected epoch, double check the hard way before we complain. */
+	if (connection->req_not_net_done)
+		req = tl_find_oldest_epoch(connection,
+				connection->req_not_net_done->tl_requests.prev,
+				&expect_epoch, &expect_size);
+	if (req == NULL || expect_epoch != barrier_nr)
+		req = tl_find_oldest_epoch(connection, &connection->transfer_log,
+				&expect_epoch, &expect_size);
 
 	/* first some paranoia code */
 	if (req == NULL) {
@@ -278,14 +306,14 @@ void tl_release(struct drbd_connection *connection, unsigned int barrier_nr,
 		goto bail;
 	}
 
-	/* Clean up list of requests processed during current epoch. */
-	/* this extra list walk restart is paranoia,
-	 * to catch requests being barrier-acked "unexpectedly".
-	 * It usually should find the same req again, or some READ preceding it. */
-	list_for_each_entry(req, &connection->transfer_log, tl_requests)
-		if (req->epoch == expect_epoch)
+	/* Clean up list of requests processed during current epoch.
+	 * Requests are added to the transfer log in epoch order, so the
+	 * epoch starts at most a few (not on the wire, or READ) requests
+	 * before req.  Walk back there, rather than from the head. */
+	list_for_each_entry_continue_reverse(req, &connection->transfer_log, tl_requests)
+		if (req->epoch != expect_epoch)
 			break;
-	list_for_each_entry_safe_from(req, r, &connection->transfer_log, tl_requests) {
+	list_for_each_entry_safe_continue(req, r, &connection->transfer_log, tl_requests) {
 		if (req->epoch != expect_epoch)
 			break;
 		_req_mod(req, BARRIER_ACKED);
@@ -338,6 +366,56 @@ void tl_clear(struct drbd_connection *connection)
 	tl_restart(connection, CONNECTION_LOST_WHILE_PENDING);
 }
 
+/**
+ * conn_session_lost() - Give up a session held for resuming it
+ * @connection:	DRBD connection.
+ *
+ * After a network failure with resume-timeout, IO stays frozen and the
+ * transfer log is kept (resource->susp_res).  Once the session cannot be
+ * resumed, because the timeout expired, the peer is a different one, or we
+ * disconnect, do what we skipped at the network failure: create the new
+ * current UUID, clear the transfer log, and thaw IO.
+ */
+void conn_session_lost(struct drbd_connection *connection)
+{
+	struct drbd_resource *resource = connection->resource;
+	struct drbd_peer_device *peer_device;
+	bool held;
+	int vnr;
+
+	spin_lock_irq(&resource->req_lock);
+	held = resource->susp_res;
+	clear_bit(SESSION_RESUMING, &connection->flags);
+	spin_unlock_irq(&resource->req_lock);
+	if (!held)
+		return;
+
+	del_timer(&connection->resume_timer);
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
+		struct drbd_device *device = peer_device->device;
+
+		if (test_and_clear_bit(NEW_CUR_UUID, &device->flags) && get_ldev(device)) {
+			drbd_uuid_new_current(device);
+			put_ldev(device);
+		}
+	}
+	rcu_read_unlock();
+
+	spin_lock_irq(&resource->req_lock);
+	if (resource->susp_res) {
+		_tl_restart(connection, CONNECTION_LOST_WHILE_PENDING);
+		resource->susp_res = 0;
+	}
+	spin_unlock_irq(&resource->req_lock);
+
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr)
+		wake_up(&peer_device->device->misc_wait);
+	rcu_read_unlock();
+	drbd_info(connection, "Session not resumed\n");
+}
+
 /**
  * tl_abort_disk_io() - Abort disk I/O for all requests for a certain device in the TL
  * @device:	DRBD device.
@@ -346,14 +424,20 @@ void tl_abort_disk_io(struct drbd_device *device)
 {
 	struct drbd_connection *connection = first_peer_device(device)->connection;
 	struct drbd_request *req, *r;
+	int rw;
 
+	/* Requests with local I/O pending are on the per device
+	 * pending_completion lists; no need to walk the whole transfer log.
+	 * Empty flushes are never on the transfer log, leave them alone. */
 	spin_lock_irq(&connection->resource->req_lock);
-	list_for_each_entry_safe(req, r, &connection->transfer_log, tl_requests) {
-		if (!(req->rq_state & RQ_LOCAL_PENDING))
-			continue;
-		if (req->device != device)
-			continue;
-		_req_mod(req, ABORT_DISK_IO);
+	for (rw = 0; rw < 2; rw++) {
+		list_for_each_entry_safe(req, r, &device->pending_completion[rw], req_pending_local) {
+			if (!(req->rq_state & RQ_LOCAL_PENDING))
+				continue;
+			if (req->i.size == 0)
+				continue;
+			_req_mod(req, ABORT_DISK_IO);
+		}
 	}
 	spin_unlock_irq(&connection->resource->req_lock);
 }
@@ -405,7 +489,8 @@ restart:
 }
 
 static void drbd_thread_init(struct drbd_resource *resource, struct drbd_thread *thi,
-			     int (*func) (struct drbd_thread *), const char *name)
+			     int (*func) (struct drbd_thread *), const char *name,
+			     enum drbd_thread_type type)
 {
 	spin_lock_init(&thi->t_lock);
 	thi->task    = NULL;
@@ -413,6 +498,7 @@ static void drbd_thread_init(struct drbd_resource *resource, struct drbd_thread
 	thi->function = func;
 	thi->resource = resource;
 	thi->connection = NULL;
+	thi->type = type;
 	thi->name = name;
 }
 
@@ -533,11 +619,14 @@ int conn_lowest_minor(struct drbd_connection *connection)
 #ifdef CONFIG_SMP
 /**
  * drbd_calc_cpu_mask() - Generate CPU masks, spread over all CPUs
+ * @cpu_mask:	the mask to fill in.
+ * @node:	NUMA node to pick the CPU from, or NUMA_NO_NODE.
  *
  * Forces all threads of a resource onto the same CPU. This is beneficial for
  * DRBD's performance. May be overwritten by user's configuration.
+ * Prefers the least used CPU of @node, if that has any online.
  */
-static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
+static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask, int node)
 {
 	unsigned int *resources_per_cpu, min_index = ~0;
 
@@ -552,11 +641,18 @@ static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
 				resources_per_cpu[cpu]++;
 		}
 		rcu_read_unlock();
-		for_each_online_cpu(cpu) {
-			if (resources_per_cpu[cpu] < min) {
-				min = resources_per_cpu[cpu];
-				min_index = cpu;
+		for (;;) {
+			for_each_online_cpu(cpu) {
+				if (node != NUMA_NO_NODE && cpu_to_node(cpu) != node)
+					continue;
+				if (resources_per_cpu[cpu] < min) {
+					min = resources_per_cpu[cpu];
+					min_index = cpu;
+				}
 			}
+			if (min_index != ~0 || node == NUMA_NO_NODE)
+				break;
+			node = NUMA_NO_NODE;
 		}
 		kfree(resources_per_cpu);
 	}
@@ -583,12 +679,61 @@ void drbd_thread_current_set_cpu(struct drbd_thread *thi)
 	if (!thi->reset_cpu_mask)
 		return;
 	thi->reset_cpu_mask = 0;
-	set_cpus_allowed_ptr(p, resource->cpu_mask);
+	if (!cpumask_empty(resource->thread_cpu_mask[thi->type]))
+		set_cpus_allowed_ptr(p, resource->thread_cpu_mask[thi->type]);
+	else
+		set_cpus_allowed_ptr(p, resource->cpu_mask);
 }
 #else
-#define drbd_calc_cpu_mask(A) ({})
+#define drbd_calc_cpu_mask(A, B) ({})
 #endif
 
+static void resource_reset_cpu_masks(struct drbd_resource *resource)
+{
+	struct drbd_connection *connection;
+
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		connection->receiver.reset_cpu_mask = 1;
+		connection->ack_receiver.reset_cpu_mask = 1;
+		connection->worker.reset_cpu_mask = 1;
+		connection->sender.reset_cpu_mask = 1;
+	}
+	rcu_read_unlock();
+}
+
+/**
+ * drbd_set_numa_node() - Place a resource near its backing device or NIC
+ * @resource:	DRBD resource.
+ * @node:	NUMA node, NUMA_NO_NODE leaves the placement alone.
+ *
+ * Requests and peer requests of @resource are allocated from @node from now
+ * on.  Unless the user configured a cpu-mask, its threads move to the least
+ * used CPU of @node.
+ */
+void drbd_set_numa_node(struct drbd_resource *resource, int node)
+{
+	cpumask_var_t new_cpu_mask;
+
+	if (node == NUMA_NO_NODE || node == resource->numa_node)
+		return;
+
+	mutex_lock(&resource->conf_update);
+	resource->numa_node = node;
+	drbd_info(resource, "Placing threads and buffers on NUMA node %d\n", node);
+	if (resource->res_opts.cpu_mask[0] == 0 &&
+	    zalloc_cpumask_var(&new_cpu_mask, GFP_KERNEL)) {
+		drbd_calc_cpu_mask(&new_cpu_mask, node);
+		if (!cpumask_empty(new_cpu_mask) &&
+		    !cpumask_equal(resource->cpu_mask, new_cpu_mask)) {
+			cpumask_copy(resource->cpu_mask, new_cpu_mask);
+			resource_reset_cpu_masks(resource);
+		}
+		free_cpumask_var(new_cpu_mask);
+	}
+	mutex_unlock(&resource->conf_update);
+}
+
 /**
  * drbd_header_size  -  size of a packet header
  *
@@ -648,10 +793,17 @@ static unsigned int prepare_header(struct drbd_connection *connection, int vnr,
 		return prepare_header80(buffer, cmd, size);
 }
 
-static void *__conn_prepare_command(struct drbd_connection *connection,
-				    struct drbd_socket *sock)
+static int drbd_flush_ack_batch(struct drbd_connection *connection);
+
+/* Variants with a leading __ expect the caller to hold sock->mutex */
+void *__conn_prepare_command(struct drbd_connection *connection,
+			     struct drbd_socket *sock)
 {
-	if (!sock->socket)
+	if (!sock->stream)
+		return NULL;
+	/* nothing else on the meta socket may overtake queued acks */
+	if (sock == &connection->meta && connection->ack_batch.n &&
+	    drbd_flush_ack_batch(connection))
 		return NULL;
 	return sock->sbuf + drbd_header_size(connection);
 }
@@ -678,7 +830,7 @@ static int __send_command(struct drbd_connection *connection, int vnr,
 			  unsigned int header_size, void *data,
 			  unsigned int size)
 {
-	int msg_flags;
+	struct kvec iov[2];
 	int err;
 
 	/*
@@ -686,27 +838,26 @@ static int __send_command(struct drbd_connection *connection, int vnr,
 	 * for commands that send data blocks.  For those commands, omit the
 	 * MSG_MORE flag: this will increase the likelihood that data blocks
 	 * which are page aligned on the sender will end up page aligned on the
-	 * receiver.
+	 * receiver.  Otherwise, header and data go out as one message.
 	 */
-	msg_flags = data ? MSG_MORE : 0;
-
 	header_size += prepare_header(connection, vnr, sock->sbuf, cmd,
 				      header_size + size);
-	err = drbd_send_all(connection, sock->socket, sock->sbuf, header_size,
-			    msg_flags);
-	if (data && !err)
-		err = drbd_send_all(connection, sock->socket, data, size, 0);
+	iov[0].iov_base = sock->sbuf;
+	iov[0].iov_len = header_size;
+	iov[1].iov_base = data;
+	iov[1].iov_len = size;
+	err = drbd_sendv_all(connection, sock, iov, data ? 2 : 1, 0);
 	/* DRBD protocol "pings" are latency critical.
 	 * This is supposed to trigger tcp_push_pending_frames() */
 	if (!err && (cmd == P_PING || cmd == P_PING_ACK))
-		drbd_tcp_nodelay(sock->socket);
+		connection->transport->hint(sock, DRBD_HINT_NODELAY);
 
 	return err;
 }
 
-static int __conn_send_command(struct drbd_connection *connection, struct drbd_socket *sock,
-			       enum drbd_packet cmd, unsigned int header_size,
-			       void *data, unsigned int size)
+int __conn_send_command(struct drbd_connection *connection, struct drbd_socket *sock,
+			enum drbd_packet cmd, unsigned int header_size,
+			void *data, unsigned int size)
 {
 	return __send_command(connection, 0, sock, cmd, header_size, data, size);
 }
@@ -734,6 +885,83 @@ int drbd_send_command(struct drbd_peer_device *peer_device, struct drbd_socket *
 	return err;
 }
 
+/* Send out the queued acks as one P_ACK_BATCH.  Caller holds meta.mutex. */
+static int drbd_flush_ack_batch(struct drbd_connection *connection)
+{
+	struct drbd_ack_batch *b = &connection->ack_batch;
+	struct drbd_socket *sock = &connection->meta;
+	struct p_ack_batch *p;
+	unsigned int n = b->n;
+
+	if (!n)
+		return 0;
+	b->n = 0;
+	if (!sock->stream)
+		return -EIO;
+
+	p = sock->sbuf + drbd_header_size(connection);
+	p->command = cpu_to_be16(b->cmd);
+	p->count = cpu_to_be16(n);
+	p->pad = 0;
+	return __send_command(connection, b->vnr, sock, P_ACK_BATCH, sizeof(*p),
+			      b->acks, n * sizeof(b->acks[0]));
+}
+
+/**
+ * drbd_ack_batch_begin() - Start collecting write acks into P_ACK_BATCH packets
+ * @connection:	DRBD connection.
+ *
+ * Until the matching drbd_ack_batch_end(), P_WRITE_ACK and P_RECV_ACK are
+ * queued instead of sent, if the peer supports it.  Any other packet on the
+ * meta socket sends out the queued acks first, so ordering is preserved.
+ */
+void drbd_ack_batch_begin(struct drbd_connection *connection)
+{
+	mutex_lock(&connection->meta.mutex);
+	connection->ack_batch.open++;
+	mutex_unlock(&connection->meta.mutex);
+}
+
+int drbd_ack_batch_end(struct drbd_connection *connection)
+{
+	int err = 0;
+
+	mutex_lock(&connection->meta.mutex);
+	if (--connection->ack_batch.open == 0)
+		err = drbd_flush_ack_batch(connection);
+	mutex_unlock(&connection->meta.mutex);
+	return err;
+}
+
+/* Returns 1 if the ack was not queued, and needs to be sent on its own. */
+static int drbd_queue_ack(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
+			  u64 sector, u32 blksize, u64 block_id)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_ack_batch *b = &connection->ack_batch;
+	struct p_block_ack *p;
+	int err = 0;
+
+	mutex_lock(&connection->meta.mutex);
+	if (!b->open || !connection->meta.stream) {
+		mutex_unlock(&connection->meta.mutex);
+		return 1;
+	}
+	if (b->n && (b->cmd != cmd || b->vnr != peer_device->device->vnr))
+		err = drbd_flush_ack_batch(connection);
+	b->cmd = cmd;
+	b->vnr = peer_device->device->vnr;
+	p = &b->acks[b->n++];
+	p->sector = sector;
+	p->block_id = block_id;
+	p->blksize = blksize;
+	p->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->device->packet_seq));
+	if (b->n == DRBD_ACK_BATCH_MAX && !err)
+		err = drbd_flush_ack_batch(connection);
+	mutex_unlock(&connection->meta.mutex);
+	return err;
+}
+
 int drbd_send_ping(struct drbd_connection *connection)
 {
 	struct drbd_socket *sock;
@@ -943,6 +1171,7 @@ void drbd_gen_and_send_sync_uuid(struct drbd_peer_device *peer_device)
 	drbd_uuid_set(device, UI_BITMAP, uuid);
 	drbd_print_uuids(device, "updated sync UUID");
 	drbd_md_sync(device);
+	drbd_bm_xchg_commit(device, uuid);
 
 	sock = &peer_device->connection->data;
 	p = drbd_prepare_command(peer_device, sock);
@@ -952,6 +1181,22 @@ void drbd_gen_and_send_sync_uuid(struct drbd_peer_device *peer_device)
 	}
 }
 
+int drbd_send_bm_token(struct drbd_peer_device *peer_device)
+{
+	struct drbd_socket *sock;
+	struct p_bm_token *p;
+
+	if (!(peer_device->connection->agreed_features & DRBD_FF_BM_DELTA))
+		return 0;
+
+	sock = &peer_device->connection->data;
+	p = drbd_prepare_command(peer_device, sock);
+	if (!p)
+		return -EIO;
+	p->token = cpu_to_be64(drbd_bm_xchg_token(peer_device->device));
+	return drbd_send_command(peer_device, sock, P_BM_TOKEN, sizeof(*p), NULL, 0);
+}
+
 /* communicated if (agreed_features & DRBD_FF_WSAME) */
 static void
 assign_p_sizes_qlim(struct drbd_device *device, struct p_sizes *p,
@@ -1154,15 +1399,18 @@ static void dcbp_set_pad_bits(struct p_compressed_bm *p, int n)
 static int fill_bitmap_rle_bits(struct drbd_device *device,
 			 struct p_compressed_bm *p,
 			 unsigned int size,
-			 struct bm_xfer_ctx *c)
+			 struct bm_xfer_ctx *c,
+			 enum drbd_bitmap_code code)
 {
 	struct bitstream bs;
+	struct rice_state rice[2];
 	unsigned long plain_bits;
 	unsigned long tmp;
 	unsigned long rl;
 	unsigned len;
 	unsigned toggle;
 	int bits, use_rle;
+	int i;
 
 	/* may we use this feature? */
 	rcu_read_lock();
@@ -1180,6 +1428,13 @@ static int fill_bitmap_rle_bits(struct drbd_device *device,
 	/* plain bits covered in this code string */
 	plain_bits = 0;
 
+	if (code == RLE_Rice_Bits) {
+		for (i = 0; i < 2; i++) {
+			rice_init(&rice[i], c->rice_k[i]);
+			bitstream_put_bits(&bs, c->rice_k[i], RICE_K_BITS);
+		}
+	}
+
 	/* p->encoding & 0x80 stores whether the first run length is set.
 	 * bit offset is implicit.
 	 * start with toggle == 2 to be able to tell the first iteration */
@@ -1188,8 +1443,11 @@ static int fill_bitmap_rle_bits(struct drbd_device *device,
 	/* see how much plain bits we can stuff into one packet
 	 * using RLE and VLI. */
 	do {
-		tmp = (toggle == 0) ? _drbd_bm_find_next_zero(device, c->bit_offset)
-				    : _drbd_bm_find_next(device, c->bit_offset);
+		if (c->delta)
+			tmp = _drbd_bm_find_next_xchg(device, c->bit_offset, toggle == 0);
+		else
+			tmp = (toggle == 0) ? _drbd_bm_find_next_zero(device, c->bit_offset)
+					    : _drbd_bm_find_next(device, c->bit_offset);
 		if (tmp == -1UL)
 			tmp = c->bm_bits;
 		rl = tmp - c->bit_offset;
@@ -1214,7 +1472,10 @@ static int fill_bitmap_rle_bits(struct drbd_device *device,
 			return -1;
 		}
 
-		bits = vli_encode_bits(&bs, rl);
+		if (code == RLE_Rice_Bits)
+			bits = rice_encode_bits(&bs, &rice[toggle == 0], rl);
+		else
+			bits = vli_encode_bits(&bs, rl);
 		if (bits == -ENOBUFS) /* buffer full */
 			break;
 		if (bits <= 0) {
@@ -1242,6 +1503,11 @@ static int fill_bitmap_rle_bits(struct drbd_device *device,
 	 * update c->word_offset. */
 	bm_xfer_ctx_bit_to_word_offset(c);
 
+	/* start the next packet where this one left off */
+	if (code == RLE_Rice_Bits)
+		for (i = 0; i < 2; i++)
+			c->rice_k[i] = rice_k(&rice[i]);
+
 	/* store pad_bits */
 	dcbp_set_pad_bits(p, (8 - bs.cur.bit) & 0x7);
 
@@ -1260,20 +1526,51 @@ send_bitmap_rle_or_plain(struct drbd_device *device, struct bm_xfer_ctx *c)
 	struct drbd_socket *sock = &first_peer_device(device)->connection->data;
 	unsigned int header_size = drbd_header_size(first_peer_device(device)->connection);
 	struct p_compressed_bm *p = sock->sbuf + header_size;
+	unsigned int size = DRBD_SOCKET_BUFFER_SIZE - header_size - sizeof(*p);
+	enum drbd_bitmap_code code = RLE_VLI_Bits;
 	int len, err;
 
-	len = fill_bitmap_rle_bits(device, p,
-			DRBD_SOCKET_BUFFER_SIZE - header_size - sizeof(*p), c);
-	if (len < 0)
-		return -EIO;
+	if (c->rice_buf) {
+		/* Encode the next chunk both ways, and send whichever
+		 * covers more bits per byte. */
+		struct bm_xfer_ctx rice = *c;
+		unsigned long start = c->bit_offset;
+		int rice_len;
+
+		rice_len = fill_bitmap_rle_bits(device, c->rice_buf, size, &rice, RLE_Rice_Bits);
+		if (rice_len < 0)
+			return -EIO;
+		len = fill_bitmap_rle_bits(device, p, size, c, RLE_VLI_Bits);
+		if (len < 0)
+			return -EIO;
+		if (rice_len && (!len ||
+		    (u64)(rice.bit_offset - start) * len >
+		    (u64)(c->bit_offset - start) * rice_len)) {
+			memcpy(p, c->rice_buf, sizeof(*p) + rice_len);
+			*c = rice;
+			len = rice_len;
+			code = RLE_Rice_Bits;
+		} else {
+			c->rice_k[0] = rice.rice_k[0];
+			c->rice_k[1] = rice.rice_k[1];
+		}
+	} else {
+		len = fill_bitmap_rle_bits(device, p, size, c, RLE_VLI_Bits);
+		if (len < 0)
+			return -EIO;
+	}
 
 	if (len) {
-		dcbp_set_code(p, RLE_VLI_Bits);
+		dcbp_set_code(p, code);
 		err = __send_command(first_peer_device(device)->connection, device->vnr, sock,
 				     P_COMPRESSED_BITMAP, sizeof(*p) + len,
 				     NULL, 0);
 		c->packets[0]++;
 		c->bytes[0] += header_size + sizeof(*p) + len;
+		if (code == RLE_Rice_Bits) {
+			c->rice_packets++;
+			c->rice_bytes += header_size + sizeof(*p) + len;
+		}
 
 		if (c->bit_offset >= c->bm_bits)
 			len = 0; /* DONE */
@@ -1314,6 +1611,7 @@ send_bitmap_rle_or_plain(struct drbd_device *device, struct bm_xfer_ctx *c)
 static int _drbd_send_bitmap(struct drbd_device *device)
 {
 	struct bm_xfer_ctx c;
+	long delta_pages;
 	int err;
 
 	if (!expect(device->bitmap))
@@ -1340,11 +1638,25 @@ static int _drbd_send_bitmap(struct drbd_device *device)
 		.bm_bits = drbd_bm_bits(device),
 		.bm_words = drbd_bm_words(device),
 	};
+	delta_pages = drbd_bm_xchg_prepare(device, device->peer_bm_token);
+	if (delta_pages >= 0 &&
+	    first_peer_device(device)->connection->agreed_features & DRBD_FF_BM_DELTA) {
+		drbd_info(device, "Sending bitmap changes since last exchange only, %ld of %lu pages\n",
+			  delta_pages, (unsigned long)DIV_ROUND_UP(c.bm_words, PAGE_SIZE / sizeof(long)));
+		c.delta = true;
+	}
+	/* no big deal if this fails, we then just use RLE_VLI_Bits */
+	if (first_peer_device(device)->connection->agreed_features & DRBD_FF_BM_RICE)
+		c.rice_buf = (void *)__get_free_page(GFP_NOIO);
 
 	do {
 		err = send_bitmap_rle_or_plain(device, &c);
 	} while (err > 0);
 
+	free_page((unsigned long)c.rice_buf);
+	if (err == 0)
+		drbd_bm_xchg_sent(device);
+
 	return err == 0;
 }
 
@@ -1354,7 +1666,7 @@ int drbd_send_bitmap(struct drbd_device *device)
 	int err = -1;
 
 	mutex_lock(&sock->mutex);
-	if (sock->socket)
+	if (sock->stream)
 		err = !_drbd_send_bitmap(device);
 	mutex_unlock(&sock->mutex);
 	return err;
@@ -1394,6 +1706,13 @@ static int _drbd_send_ack(struct drbd_peer_device *peer_device, enum drbd_packet
 	if (peer_device->device->state.conn < C_CONNECTED)
 		return -EIO;
 
+	if ((cmd == P_WRITE_ACK || cmd == P_RECV_ACK) && block_id != ID_SYNCER &&
+	    peer_device->connection->agreed_features & DRBD_FF_ACK_BATCH) {
+		int err = drbd_queue_ack(peer_device, cmd, sector, blksize, block_id);
+		if (err <= 0)
+			return err;
+	}
+
 	sock = &peer_device->connection->meta;
 	p = drbd_prepare_command(peer_device, sock);
 	if (!p)
@@ -1411,8 +1730,7 @@ static int _drbd_send_ack(struct drbd_peer_device *peer_device, enum drbd_packet
 void drbd_send_ack_dp(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 		      struct p_data *dp, int data_size)
 {
-	if (peer_device->connection->peer_integrity_tfm)
-		data_size -= crypto_ahash_digestsize(peer_device->connection->peer_integrity_tfm);
+	data_size -= drbd_peer_digest_size(peer_device->connection, dp);
 	_drbd_send_ack(peer_device, cmd, dp->sector, cpu_to_be32(data_size),
 		       dp->block_id);
 }
@@ -1518,11 +1836,11 @@ int drbd_send_ov_request(struct drbd_peer_device *peer_device, sector_t sector,
  * returns false if we should retry,
  * true if we think connection is dead
  */
-static int we_should_drop_the_connection(struct drbd_connection *connection, struct socket *sock)
+static int we_should_drop_the_connection(struct drbd_connection *connection, struct drbd_socket *sock)
 {
 	int drop_it;
 
-	drop_it =   connection->meta.socket == sock
+	drop_it =   &connection->meta == sock
 		|| !connection->ack_receiver.task
 		|| get_t_state(&connection->ack_receiver) != RUNNING
 		|| connection->cstate < C_WF_REPORT_PARAMS;
@@ -1530,6 +1848,15 @@ static int we_should_drop_the_connection(struct drbd_connection *connection, str
 	if (drop_it)
 		return true;
 
+	/* no progress on the data stream for a whole timeout; with a standby
+	 * path, try that before counting down the ko-count */
+	if (connection->transport->failover &&
+	    connection->transport->failover(connection, sock)) {
+		drbd_warn(connection, "[%s/%d] sock_sendmsg time expired, continuing on another path\n",
+			  current->comm, current->pid);
+		return false;
+	}
+
 	drop_it = !--connection->ko_count;
 	if (!drop_it) {
 		drbd_err(connection, "[%s/%d] sock_sendmsg time expired, ko = %u\n",
@@ -1540,10 +1867,20 @@ static int we_should_drop_the_connection(struct drbd_connection *connection, str
 	return drop_it; /* && (device->state == R_PRIMARY) */;
 }
 
+static void drbd_account_send(struct drbd_socket *sock, ktime_t start, int sent)
+{
+	sock->stats.send_calls++;
+	sock->stats.send_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (sent > 0)
+		sock->stats.send_bytes += sent;
+}
+
 static void drbd_update_congested(struct drbd_connection *connection)
 {
-	struct sock *sk = connection->data.socket->sk;
-	if (sk->sk_wmem_queued > sk->sk_sndbuf * 4 / 5)
+	int queued, sndbuf;
+
+	connection->transport->sndbuf(&connection->data, &queued, &sndbuf);
+	if (queued > sndbuf * 4 / 5)
 		set_bit(NET_CONGESTED, &connection->flags);
 }
 
@@ -1571,13 +1908,12 @@ static void drbd_update_congested(struct drbd_connection *connection)
 static int _drbd_no_send_page(struct drbd_peer_device *peer_device, struct page *page,
 			      int offset, size_t size, unsigned msg_flags)
 {
-	struct socket *socket;
 	void *addr;
 	int err;
 
-	socket = peer_device->connection->data.socket;
 	addr = kmap(page) + offset;
-	err = drbd_send_all(peer_device->connection, socket, addr, size, msg_flags);
+	err = drbd_send_all(peer_device->connection, &peer_device->connection->data,
+			    addr, size, msg_flags);
 	kunmap(page);
 	if (!err)
 		peer_device->device->send_cnt += size >> 9;
@@ -1587,8 +1923,8 @@ static int _drbd_no_send_page(struct drbd_peer_device *peer_device, struct page
 static int _drbd_send_page(struct drbd_peer_device *peer_device, struct page *page,
 		    int offset, size_t size, unsigned msg_flags)
 {
-	struct socket *socket = peer_device->connection->data.socket;
-	mm_segment_t oldfs = get_fs();
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_socket *sock = &connection->data;
 	int len = size;
 	int err = -EIO;
 
@@ -1602,15 +1938,16 @@ static int _drbd_send_page(struct drbd_peer_device *peer_device, struct page *pa
 		return _drbd_no_send_page(peer_device, page, offset, size, msg_flags);
 
 	msg_flags |= MSG_NOSIGNAL;
-	drbd_update_congested(peer_device->connection);
-	set_fs(KERNEL_DS);
+	drbd_update_congested(connection);
 	do {
+		ktime_t start = ktime_get();
 		int sent;
 
-		sent = socket->ops->sendpage(socket, page, offset, len, msg_flags);
+		sent = connection->transport->send_page(sock, page, offset, len, msg_flags);
+		drbd_account_send(sock, start, sent);
 		if (sent <= 0) {
 			if (sent == -EAGAIN) {
-				if (we_should_drop_the_connection(peer_device->connection, socket))
+				if (we_should_drop_the_connection(connection, sock))
 					break;
 				continue;
 			}
@@ -1623,8 +1960,7 @@ static int _drbd_send_page(struct drbd_peer_device *peer_device, struct page *pa
 		len    -= sent;
 		offset += sent;
 	} while (len > 0 /* THINK && device->cstate >= C_CONNECTED*/);
-	set_fs(oldfs);
-	clear_bit(NET_CONGESTED, &peer_device->connection->flags);
+	clear_bit(NET_CONGESTED, &connection->flags);
 
 	if (len == 0) {
 		err = 0;
@@ -1633,25 +1969,61 @@ static int _drbd_send_page(struct drbd_peer_device *peer_device, struct page *pa
 	return err;
 }
 
-static int _drbd_send_bio(struct drbd_peer_device *peer_device, struct bio *bio)
+/* How many bio segments we hand to the transport at once */
+#define DRBD_SENDV_SEGS 16
+
+/* Sends a command together with a copy of the data of bio.  The header,
+ * and as many segments as fit into DRBD_SENDV_SEGS, go out as one message,
+ * instead of one send for the header and one for each segment.
+ * The send may block; kmap() slots are scarce, so a message contains at
+ * most one highmem page.  Lowmem pages need no mapping. */
+static int __send_command_bio(struct drbd_peer_device *peer_device,
+			      struct drbd_socket *sock, enum drbd_packet cmd,
+			      unsigned int header_size, struct bio *bio,
+			      unsigned int size)
 {
+	struct drbd_connection *connection = peer_device->connection;
+	struct kvec iov[DRBD_SENDV_SEGS];
+	struct page *mapped = NULL;
 	DRBD_BIO_VEC_TYPE bvec;
 	DRBD_ITER_TYPE iter;
+	int n = 1;
+	int err;
 
-	/* hint all but last page with MSG_MORE */
-	bio_for_each_segment(bvec, bio, iter) {
-		int err;
+	header_size += prepare_header(connection, peer_device->device->vnr,
+				      sock->sbuf, cmd, header_size + size);
+	iov[0].iov_base = sock->sbuf;
+	iov[0].iov_len = header_size;
 
-		err = _drbd_no_send_page(peer_device, bvec BVD bv_page,
-					 bvec BVD bv_offset, bvec BVD bv_len,
-					 bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
-		if (err)
-			return err;
+	bio_for_each_segment(bvec, bio, iter) {
+		struct page *page = bvec BVD bv_page;
+
+		if (n == DRBD_SENDV_SEGS || (mapped && PageHighMem(page))) {
+			err = drbd_sendv_all(connection, sock, iov, n, MSG_MORE);
+			if (mapped)
+				kunmap(mapped);
+			mapped = NULL;
+			if (err)
+				return err;
+			n = 0;
+		}
+		if (PageHighMem(page)) {
+			mapped = page;
+			iov[n].iov_base = kmap(page) + bvec BVD bv_offset;
+		} else
+			iov[n].iov_base = page_address(page) + bvec BVD bv_offset;
+		iov[n].iov_len = bvec BVD bv_len;
+		n++;
 		/* REQ_WRITE_SAME has only one segment */
 		if (bio_op(bio) == REQ_OP_WRITE_SAME)
 			break;
 	}
-	return 0;
+	err = drbd_sendv_all(connection, sock, iov, n, 0);
+	if (mapped)
+		kunmap(mapped);
+	if (!err)
+		peer_device->device->send_cnt += size >> 9;
+	return err;
 }
 
 static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *bio)
@@ -1712,10 +2084,33 @@ static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio
 	return bio->bi_opf & (DRBD_REQ_SYNC | DRBD_REQ_UNPLUG) ? DP_RW_SYNC : 0;
 }
 
+/* Decide whether the next data packet carries a digest, and how large that is.
+ * With DRBD_FF_INTEGRITY_SAMPLE, we digest only every nth data packet,
+ * and flag those with DP_DIGEST.  Called with data.mutex held. */
+static int drbd_integrity_sample(struct drbd_connection *connection, unsigned int *dp_flags)
+{
+	unsigned int every;
+
+	if (!connection->integrity_tfm)
+		return 0;
+
+	if (connection->agreed_features & DRBD_FF_INTEGRITY_SAMPLE) {
+		every = drbd_integrity_sample_every(connection);
+		if (connection->integrity_seq++ % every) {
+			connection->integrity_skipped++;
+			return 0;
+		}
+		*dp_flags |= DP_DIGEST;
+	}
+	connection->integrity_sent++;
+	return crypto_ahash_digestsize(connection->integrity_tfm);
+}
+
 /* Used to send write or TRIM aka REQ_DISCARD requests
  * R_PRIMARY -> Peer	(P_DATA, P_TRIM)
+ * Caller holds data.mutex, see drbd_send_dblock()
  */
-int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
+int __drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_socket *sock;
@@ -1723,13 +2118,14 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	struct p_wsame *wsame = NULL;
 	void *digest_out;
 	unsigned int dp_flags = 0;
-	int digest_size;
+	unsigned int header_size, size;
+	enum drbd_packet cmd;
+	int digest_size = 0;
+	bool precomputed;
 	int err;
 
 	sock = &peer_device->connection->data;
-	p = drbd_prepare_command(peer_device, sock);
-	digest_size = peer_device->connection->integrity_tfm ?
-		      crypto_ahash_digestsize(peer_device->connection->integrity_tfm) : 0;
+	p = __conn_prepare_command(peer_device->connection, sock);
 
 	if (!p)
 		return -EIO;
@@ -1749,13 +2145,15 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		|| (dp_flags & DP_MAY_SET_IN_SYNC))
 			dp_flags |= DP_SEND_WRITE_ACK;
 	}
+	/* TRIM does not carry any payload, so no digest either */
+	if (!(dp_flags & DP_DISCARD))
+		digest_size = drbd_integrity_sample(peer_device->connection, &dp_flags);
 	p->dp_flags = cpu_to_be32(dp_flags);
 
 	if (dp_flags & DP_DISCARD) {
 		struct p_trim *t = (struct p_trim*)p;
 		t->size = cpu_to_be32(req->i.size);
-		err = __send_command(peer_device->connection, device->vnr, sock, P_TRIM, sizeof(*t), NULL, 0);
-		goto out;
+		return __send_command(peer_device->connection, device->vnr, sock, P_TRIM, sizeof(*t), NULL, 0);
 	}
 	if (dp_flags & DP_WSAME) {
 		/* this will only work if DRBD_FF_WSAME is set AND the
@@ -1768,36 +2166,47 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		digest_out = p + 1;
 
 	/* our digest is still only over the payload.
-	 * TRIM does not carry any payload. */
-	if (digest_size)
+	 * Usually the submitter already calculated it for us. */
+	precomputed = digest_size && req->digest &&
+		req->digest_gen == peer_device->connection->integrity_gen;
+	if (precomputed)
+		memcpy(digest_out, req->digest, digest_size);
+	else if (digest_size)
 		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, digest_out);
 	if (wsame) {
-		err =
-		    __send_command(peer_device->connection, device->vnr, sock, P_WSAME,
-				   sizeof(*wsame) + digest_size, NULL,
-				   bio_iovec(req->master_bio) BVD bv_len);
-	} else
-		err =
-		    __send_command(peer_device->connection, device->vnr, sock, P_DATA,
-				   sizeof(*p) + digest_size, NULL, req->i.size);
-	if (!err) {
-		/* For protocol A, we have to memcpy the payload into
-		 * socket buffers, as we may complete right away
-		 * as soon as we handed it over to tcp, at which point the data
-		 * pages may become invalid.
-		 *
-		 * For data-integrity enabled, we copy it as well, so we can be
-		 * sure that even if the bio pages may still be modified, it
-		 * won't change the data on the wire, thus if the digest checks
-		 * out ok after sending on this side, but does not fit on the
-		 * receiving side, we sure have detected corruption elsewhere.
-		 */
-		if (!(req->rq_state & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
-			err = _drbd_send_bio(peer_device, req->master_bio);
-		else
-			err = _drbd_send_zc_bio(peer_device, req->master_bio);
+		cmd = P_WSAME;
+		header_size = sizeof(*wsame) + digest_size;
+		size = bio_iovec(req->master_bio) BVD bv_len;
+	} else {
+		cmd = P_DATA;
+		header_size = sizeof(*p) + digest_size;
+		size = req->i.size;
+	}
 
-		/* double check digest, sometimes buffers have been modified in flight. */
+	/* For protocol A, we have to memcpy the payload into
+	 * socket buffers, as we may complete right away
+	 * as soon as we handed it over to tcp, at which point the data
+	 * pages may become invalid.
+	 *
+	 * For data-integrity enabled, we copy it as well, so we can be
+	 * sure that even if the bio pages may still be modified, it
+	 * won't change the data on the wire, thus if the digest checks
+	 * out ok after sending on this side, but does not fit on the
+	 * receiving side, we sure have detected corruption elsewhere.
+	 */
+	if (!(req->rq_state & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size) {
+		err = __send_command_bio(peer_device, sock, cmd, header_size,
+					 req->master_bio, size);
+	} else {
+		err = __send_command(peer_device->connection, device->vnr, sock, cmd,
+				     header_size, NULL, size);
+		if (!err)
+			err = _drbd_send_zc_bio(peer_device, req->master_bio);
+	}
+	/* double check digest, sometimes buffers have been modified in flight.
+	 * Not for a digest of the submitter: that would hash every write on
+	 * the sender again.  The peer still notices a modified buffer. */
+	if (!err && !precomputed) {
 		if (digest_size > 0 && digest_size <= 64) {
 			/* 64 byte, 512 bit, is the largest digest size
 			 * currently supported in kernel crypto. */
@@ -1812,8 +2221,18 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		     ... Be noisy about digest too large ...
 		} */
 	}
-out:
-	mutex_unlock(&sock->mutex);  /* locked by drbd_prepare_command() */
+
+	return err;
+}
+
+int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
+{
+	struct drbd_socket *sock = &peer_device->connection->data;
+	int err;
+
+	mutex_lock(&sock->mutex);
+	err = __drbd_send_dblock(peer_device, req);
+	mutex_unlock(&sock->mutex);
 
 	return err;
 }
@@ -1828,21 +2247,20 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 	struct drbd_device *device = peer_device->device;
 	struct drbd_socket *sock;
 	struct p_data *p;
+	unsigned int dp_flags = 0;
 	int err;
 	int digest_size;
 
 	sock = &peer_device->connection->data;
 	p = drbd_prepare_command(peer_device, sock);
 
-	digest_size = peer_device->connection->integrity_tfm ?
-		      crypto_ahash_digestsize(peer_device->connection->integrity_tfm) : 0;
-
 	if (!p)
 		return -EIO;
+	digest_size = drbd_integrity_sample(peer_device->connection, &dp_flags);
 	p->sector = cpu_to_be64(peer_req->i.sector);
 	p->block_id = peer_req->block_id;
 	p->seq_num = 0;  /* unused */
-	p->dp_flags = 0;
+	p->dp_flags = cpu_to_be32(dp_flags);
 	if (digest_size)
 		drbd_csum_ee(peer_device->connection->integrity_tfm, peer_req, p + 1);
 	err = __send_command(peer_device->connection, device->vnr, sock, cmd, sizeof(*p) + digest_size, NULL, peer_req->i.size);
@@ -1882,36 +2300,33 @@ int drbd_send_out_of_sync(struct drbd_peer_device *peer_device, struct drbd_requ
 
 /*
  * you must have down()ed the appropriate [m]sock_mutex elsewhere!
+ * Sends all of iov as one message, advancing iov over what was sent.
  */
-int drbd_send(struct drbd_connection *connection, struct socket *sock,
-	      void *buf, size_t size, unsigned msg_flags)
+int drbd_sendv(struct drbd_connection *connection, struct drbd_socket *sock,
+	       struct kvec *iov, int iovcnt, unsigned msg_flags)
 {
-	struct kvec iov;
-	struct msghdr msg;
-	int rv, sent = 0;
+	size_t size = 0;
+	int i, rv, sent = 0;
 
-	if (!sock)
+	if (!sock->stream)
 		return -EBADR;
 
-	/* THINK  if (signal_pending) return ... ? */
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
 
-	iov.iov_base = buf;
-	iov.iov_len  = size;
-
-	msg.msg_name       = NULL;
-	msg.msg_namelen    = 0;
-	msg.msg_control    = NULL;
-	msg.msg_controllen = 0;
-	msg.msg_flags      = msg_flags | MSG_NOSIGNAL;
+	/* THINK  if (signal_pending) return ... ? */
 
-	if (sock == connection->data.socket) {
+	if (sock == &connection->data) {
 		rcu_read_lock();
 		connection->ko_count = rcu_dereference(connection->net_conf)->ko_count;
 		rcu_read_unlock();
 		drbd_update_congested(connection);
 	}
 	do {
-		rv = kernel_sendmsg(sock, &msg, &iov, 1, iov.iov_len);
+		ktime_t start = ktime_get();
+
+		rv = connection->transport->sendv(sock, iov, iovcnt, size - sent, msg_flags);
+		drbd_account_send(sock, start, rv);
 		if (rv == -EAGAIN) {
 			if (we_should_drop_the_connection(connection, sock))
 				break;
@@ -1925,17 +2340,21 @@ int drbd_send(struct drbd_connection *connection, struct socket *sock,
 		if (rv < 0)
 			break;
 		sent += rv;
-		iov.iov_base += rv;
-		iov.iov_len  -= rv;
+		for (i = rv; i && i >= iov->iov_len; iov++, iovcnt--)
+			i -= iov->iov_len;
+		if (i) {
+			iov->iov_base += i;
+			iov->iov_len  -= i;
+		}
 	} while (sent < size);
 
-	if (sock == connection->data.socket)
+	if (sock == &connection->data)
 		clear_bit(NET_CONGESTED, &connection->flags);
 
 	if (rv <= 0) {
 		if (rv != -EAGAIN) {
 			drbd_err(connection, "%s_sendmsg returned %d\n",
-				 sock == connection->meta.socket ? "msock" : "sock",
+				 sock == &connection->meta ? "msock" : "sock",
 				 rv);
 			conn_request_state(connection, NS(conn, C_BROKEN_PIPE), CS_HARD);
 		} else
@@ -1945,22 +2364,47 @@ int drbd_send(struct drbd_connection *connection, struct socket *sock,
 	return sent;
 }
 
+int drbd_send(struct drbd_connection *connection, struct drbd_socket *sock,
+	      void *buf, size_t size, unsigned msg_flags)
+{
+	struct kvec iov = {
+		.iov_base = buf,
+		.iov_len = size,
+	};
+
+	return drbd_sendv(connection, sock, &iov, 1, msg_flags);
+}
+
+int drbd_sendv_all(struct drbd_connection *connection, struct drbd_socket *sock,
+		   struct kvec *iov, int iovcnt, unsigned msg_flags)
+{
+	size_t size = 0;
+	int i, err;
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+	err = drbd_sendv(connection, sock, iov, iovcnt, msg_flags);
+	if (err < 0)
+		return err;
+	if (err != size)
+		return -EIO;
+	return 0;
+}
+
 /**
  * drbd_send_all  -  Send an entire buffer
  *
  * Returns 0 upon success and a negative error value otherwise.
  */
-int drbd_send_all(struct drbd_connection *connection, struct socket *sock, void *buffer,
+int drbd_send_all(struct drbd_connection *connection, struct drbd_socket *sock, void *buffer,
 		  size_t size, unsigned msg_flags)
 {
-	int err;
+	struct kvec iov = {
+		.iov_base = buffer,
+		.iov_len = size,
+	};
 
-	err = drbd_send(connection, sock, buffer, size, msg_flags);
-	if (err < 0)
-		return err;
-	if (err != size)
-		return -EIO;
-	return 0;
+	return drbd_sendv_all(connection, sock, &iov, 1, msg_flags);
 }
 
 #ifdef BD_OPS_USE_FMODE
@@ -2023,7 +2467,7 @@ void drbd_queue_unplug(struct drbd_device *device)
 		D_ASSERT(device, device->state.role == R_PRIMARY);
 		if (test_and_clear_bit(UNPLUG_REMOTE, &device->flags)) {
 			drbd_queue_work_if_unqueued(
-				&first_peer_device(device)->connection->sender_work,
+				&first_peer_device(device)->connection->data_work,
 				&device->unplug_work);
 		}
 	}
@@ -2113,6 +2557,7 @@ void drbd_init_set_defaults(struct drbd_device *device)
 	init_timer(&device->md_sync_timer);
 	init_timer(&device->start_resync_timer);
 	init_timer(&device->request_timer);
+	init_timer(&device->stats_timer);
 	device->resync_timer.function = resync_timer_fn;
 	device->resync_timer.data = (unsigned long) device;
 	device->md_sync_timer.function = md_sync_timer_fn;
@@ -2121,6 +2566,8 @@ void drbd_init_set_defaults(struct drbd_device *device)
 	device->start_resync_timer.data = (unsigned long) device;
 	device->request_timer.function = request_timer_fn;
 	device->request_timer.data = (unsigned long) device;
+	device->stats_timer.function = stats_timer_fn;
+	device->stats_timer.data = (unsigned long) device;
 
 	init_waitqueue_head(&device->misc_wait);
 	init_waitqueue_head(&device->state_wait);
@@ -2129,6 +2576,7 @@ void drbd_init_set_defaults(struct drbd_device *device)
 	init_waitqueue_head(&device->seq_wait);
 
 	device->resync_wenr = LC_FREE;
+	device->perf_last_jif = jiffies;
 	device->peer_max_bio_size = DRBD_MAX_BIO_SIZE_SAFE;
 	device->local_max_bio_size = DRBD_MAX_BIO_SIZE_SAFE;
 }
@@ -2177,6 +2625,7 @@ void drbd_device_cleanup(struct drbd_device *device)
 	D_ASSERT(device, list_empty(&device->net_ee));
 	D_ASSERT(device, list_empty(&device->resync_reads));
 	D_ASSERT(device, list_empty(&first_peer_device(device)->connection->sender_work.q));
+	D_ASSERT(device, list_empty(&first_peer_device(device)->connection->data_work.q));
 	D_ASSERT(device, list_empty(&device->resync_work.list));
 	D_ASSERT(device, list_empty(&device->unplug_work.list));
 
@@ -2350,6 +2799,7 @@ void drbd_destroy_device(struct kref *kref)
 
 	lc_destroy(device->act_log);
 	lc_destroy(device->resync);
+	vfree(device->al_trace.entries);
 
 	kfree(device->p_uuid);
 	/* device->p_uuid = NULL; */
@@ -2397,6 +2847,7 @@ static void do_retry(struct work_struct *ws)
 	list_for_each_entry_safe(req, tmp, &writes, tl_requests) {
 		struct drbd_device *device = req->device;
 		struct bio *bio = req->master_bio;
+		struct bio *merged = req->merged_bios;
 		unsigned long start_jif = req->start_jif;
 		bool expected;
 
@@ -2433,6 +2884,15 @@ static void do_retry(struct work_struct *ws)
 		 * as we want to keep the start_time information. */
 		inc_ap_bio(device);
 		__drbd_make_request(device, bio, start_jif);
+
+		/* discards merged into it start over on their own */
+		while (merged) {
+			bio = merged;
+			merged = bio->bi_next;
+			bio->bi_next = NULL;
+			inc_ap_bio(device);
+			__drbd_make_request(device, bio, start_jif);
+		}
 	}
 }
 
@@ -2440,6 +2900,7 @@ static void do_retry(struct work_struct *ws)
  * holds resource->req_lock */
 void drbd_restart_request(struct drbd_request *req)
 {
+	struct bio *bio;
 	unsigned long flags;
 	spin_lock_irqsave(&retry.lock, flags);
 	list_move_tail(&req->tl_requests, &retry.writes);
@@ -2449,6 +2910,8 @@ void drbd_restart_request(struct drbd_request *req)
 	 * have been dropped by complete_master_bio.
 	 * do_retry() needs to grab a new one. */
 	dec_ap_bio(req->device);
+	for (bio = req->merged_bios; bio; bio = bio->bi_next)
+		dec_ap_bio(req->device);
 
 	queue_work(retry.wq, &retry.worker);
 }
@@ -2457,8 +2920,11 @@ void drbd_destroy_resource(struct kref *kref)
 {
 	struct drbd_resource *resource =
 		container_of(kref, struct drbd_resource, kref);
+	int t;
 
 	idr_destroy(&resource->devices);
+	for (t = 0; t < DRBD_THREAD_TYPES; t++)
+		free_cpumask_var(resource->thread_cpu_mask[t]);
 	free_cpumask_var(resource->cpu_mask);
 	kfree(resource->name);
 	memset(resource, 0xf2, sizeof(*resource));
@@ -2510,6 +2976,9 @@ static void drbd_cleanup(void)
 		drbd_free_resource(resource);
 	}
 
+	drbd_unregister_transport(&drbd_loop_transport);
+	drbd_unregister_transport(&drbd_tcp_transport);
+
 	drbd_destroy_mempools();
 	drbd_unregister_blkdev(DRBD_MAJOR, "drbd");
 
@@ -2605,6 +3074,14 @@ void drbd_flush_workqueue(struct drbd_work_queue *work_queue)
 	wait_for_completion(&completion_work.done);
 }
 
+/* Wait until the sender has processed (or canceled) everything that was on
+ * the data_work queue.  Without a sender there is nobody to wait for. */
+void drbd_flush_data_work(struct drbd_connection *connection)
+{
+	if (get_t_state(&connection->sender) == RUNNING)
+		drbd_flush_workqueue(&connection->data_work);
+}
+
 struct drbd_resource *drbd_find_resource(const char *name)
 {
 	struct drbd_resource *resource;
@@ -2670,10 +3147,18 @@ void conn_free_crypto(struct drbd_connection *connection)
 {
 	drbd_free_sock(connection);
 
+	/* submitters may still use it, see drbd_req_csum() */
+	if (connection->integrity_tfm) {
+		struct crypto_ahash *tfm = connection->integrity_tfm;
+
+		conn_set_integrity_tfm(connection, NULL);
+		synchronize_srcu(&connection->integrity_srcu);
+		crypto_free_ahash(tfm);
+	}
+
 	crypto_free_ahash(connection->csums_tfm);
 	crypto_free_ahash(connection->verify_tfm);
 	crypto_free_shash(connection->cram_hmac_tfm);
-	crypto_free_ahash(connection->integrity_tfm);
 	crypto_free_ahash(connection->peer_integrity_tfm);
 	kfree(connection->int_dig_in);
 	kfree(connection->int_dig_vv);
@@ -2687,53 +3172,105 @@ void conn_free_crypto(struct drbd_connection *connection)
 	connection->int_dig_vv = NULL;
 }
 
+static int drbd_parse_cpu_mask(struct drbd_resource *resource, const char *str,
+			       cpumask_var_t cpu_mask)
+{
+	int err;
+
+	cpumask_clear(cpu_mask);
+	/* silently ignore cpu mask on UP kernel */
+	if (nr_cpu_ids <= 1 || str[0] == 0)
+		return 0;
+
+	err = bitmap_parse(str, DRBD_CPU_MASK_SIZE,
+			   cpumask_bits(cpu_mask), nr_cpu_ids);
+	if (err == -EOVERFLOW) {
+		/* So what. mask it out. */
+		cpumask_var_t tmp_cpu_mask;
+		if (zalloc_cpumask_var(&tmp_cpu_mask, GFP_KERNEL)) {
+			cpumask_setall(tmp_cpu_mask);
+			cpumask_and(cpu_mask, cpu_mask, tmp_cpu_mask);
+			drbd_warn(resource, "Overflow in bitmap_parse(%.12s%s), truncating to %u bits\n",
+				str, strlen(str) > 12 ? "..." : "", nr_cpu_ids);
+			free_cpumask_var(tmp_cpu_mask);
+			err = 0;
+		}
+	}
+	if (err)
+		drbd_warn(resource, "bitmap_parse() failed with %d\n", err);
+	return err;
+}
+
+static const char *thread_cpu_mask_opt(struct res_opts *res_opts, enum drbd_thread_type type)
+{
+	switch (type) {
+	case DRBD_THREAD_RECEIVER:
+		return res_opts->receiver_cpu_mask;
+	case DRBD_THREAD_ACK_RECEIVER:
+		return res_opts->ack_receiver_cpu_mask;
+	case DRBD_THREAD_WORKER:
+		return res_opts->worker_cpu_mask;
+	case DRBD_THREAD_SENDER:
+	default:
+		return res_opts->sender_cpu_mask;
+	}
+}
+
 int set_resource_options(struct drbd_resource *resource, struct res_opts *res_opts)
 {
-	struct drbd_connection *connection;
+	struct drbd_device *device;
 	cpumask_var_t new_cpu_mask;
-	int err;
+	cpumask_var_t new_thread_cpu_mask[DRBD_THREAD_TYPES];
+	bool stats_interval_changed;
+	bool reset_cpu_masks = false;
+	int err = -ENOMEM, vnr, t, allocated = 0;
 
 	if (!zalloc_cpumask_var(&new_cpu_mask, GFP_KERNEL))
 		return -ENOMEM;
+	for (; allocated < DRBD_THREAD_TYPES; allocated++)
+		if (!zalloc_cpumask_var(&new_thread_cpu_mask[allocated], GFP_KERNEL))
+			goto fail;
 
-	/* silently ignore cpu mask on UP kernel */
-	if (nr_cpu_ids > 1 && res_opts->cpu_mask[0] != 0) {
-		err = bitmap_parse(res_opts->cpu_mask, DRBD_CPU_MASK_SIZE,
-				   cpumask_bits(new_cpu_mask), nr_cpu_ids);
-		if (err == -EOVERFLOW) {
-			/* So what. mask it out. */
-			cpumask_var_t tmp_cpu_mask;
-			if (zalloc_cpumask_var(&tmp_cpu_mask, GFP_KERNEL)) {
-				cpumask_setall(tmp_cpu_mask);
-				cpumask_and(new_cpu_mask, new_cpu_mask, tmp_cpu_mask);
-				drbd_warn(resource, "Overflow in bitmap_parse(%.12s%s), truncating to %u bits\n",
-					res_opts->cpu_mask,
-					strlen(res_opts->cpu_mask) > 12 ? "..." : "",
-					nr_cpu_ids);
-				free_cpumask_var(tmp_cpu_mask);
-				err = 0;
-			}
-		}
-		if (err) {
-			drbd_warn(resource, "bitmap_parse() failed with %d\n", err);
-			/* retcode = ERR_CPU_MASK_PARSE; */
+	/* parse the per thread masks once, before changing anything */
+	for (t = 0; t < DRBD_THREAD_TYPES; t++) {
+		err = drbd_parse_cpu_mask(resource, thread_cpu_mask_opt(res_opts, t),
+					  new_thread_cpu_mask[t]);
+		if (err)
 			goto fail;
-		}
 	}
+	err = drbd_parse_cpu_mask(resource, res_opts->cpu_mask, new_cpu_mask);
+	if (err) {
+		/* retcode = ERR_CPU_MASK_PARSE; */
+		goto fail;
+	}
+	stats_interval_changed =
+		resource->res_opts.stats_interval != res_opts->stats_interval;
+	mutex_lock(&resource->conf_update);
 	resource->res_opts = *res_opts;
+	if (stats_interval_changed) {
+		idr_for_each_entry(&resource->devices, device, vnr)
+			drbd_arm_stats_timer(device);
+	}
 	if (cpumask_empty(new_cpu_mask))
-		drbd_calc_cpu_mask(&new_cpu_mask);
+		drbd_calc_cpu_mask(&new_cpu_mask, resource->numa_node);
 	if (!cpumask_equal(resource->cpu_mask, new_cpu_mask)) {
 		cpumask_copy(resource->cpu_mask, new_cpu_mask);
-		for_each_connection_rcu(connection, resource) {
-			connection->receiver.reset_cpu_mask = 1;
-			connection->ack_receiver.reset_cpu_mask = 1;
-			connection->worker.reset_cpu_mask = 1;
+		reset_cpu_masks = true;
+	}
+	for (t = 0; t < DRBD_THREAD_TYPES; t++) {
+		if (!cpumask_equal(resource->thread_cpu_mask[t], new_thread_cpu_mask[t])) {
+			cpumask_copy(resource->thread_cpu_mask[t], new_thread_cpu_mask[t]);
+			reset_cpu_masks = true;
 		}
 	}
+	if (reset_cpu_masks)
+		resource_reset_cpu_masks(resource);
+	mutex_unlock(&resource->conf_update);
 	err = 0;
 
 fail:
+	while (allocated--)
+		free_cpumask_var(new_thread_cpu_mask[allocated]);
 	free_cpumask_var(new_cpu_mask);
 	return err;
 
@@ -2742,6 +3279,7 @@ fail:
 struct drbd_resource *drbd_create_resource(const char *name)
 {
 	struct drbd_resource *resource;
+	int t;
 
 	resource = kzalloc(sizeof(struct drbd_resource), GFP_KERNEL);
 	if (!resource)
@@ -2751,6 +3289,11 @@ struct drbd_resource *drbd_create_resource(const char *name)
 		goto fail_free_resource;
 	if (!zalloc_cpumask_var(&resource->cpu_mask, GFP_KERNEL))
 		goto fail_free_name;
+	for (t = 0; t < DRBD_THREAD_TYPES; t++) {
+		if (!zalloc_cpumask_var(&resource->thread_cpu_mask[t], GFP_KERNEL))
+			goto fail_free_cpu_masks;
+	}
+	resource->numa_node = NUMA_NO_NODE;
 	kref_init(&resource->kref);
 	idr_init(&resource->devices);
 	INIT_LIST_HEAD(&resource->connections);
@@ -2762,6 +3305,10 @@ struct drbd_resource *drbd_create_resource(const char *name)
 	drbd_debugfs_resource_add(resource);
 	return resource;
 
+fail_free_cpu_masks:
+	while (t--)
+		free_cpumask_var(resource->thread_cpu_mask[t]);
+	free_cpumask_var(resource->cpu_mask);
 fail_free_name:
 	kfree(resource->name);
 fail_free_resource:
@@ -2789,6 +3336,9 @@ struct drbd_connection *conn_create(const char *name, struct res_opts *res_opts)
 	if (!connection->current_epoch)
 		goto fail;
 
+	if (init_srcu_struct(&connection->integrity_srcu))
+		goto fail;
+
 	INIT_LIST_HEAD(&connection->transfer_log);
 
 	INIT_LIST_HEAD(&connection->current_epoch->list);
@@ -2801,7 +3351,7 @@ struct drbd_connection *conn_create(const char *name, struct res_opts *res_opts)
 
 	resource = drbd_create_resource(name);
 	if (!resource)
-		goto fail;
+		goto fail_srcu;
 
 	connection->cstate = C_STANDALONE;
 	mutex_init(&connection->cstate_mutex);
@@ -2809,14 +3359,28 @@ struct drbd_connection *conn_create(const char *name, struct res_opts *res_opts)
 	idr_init(&connection->peer_devices);
 
 	drbd_init_workqueue(&connection->sender_work);
+	drbd_init_workqueue(&connection->data_work);
 	mutex_init(&connection->data.mutex);
 	mutex_init(&connection->meta.mutex);
+	connection->transport = &drbd_tcp_transport; /* built in, no reference */
 
-	drbd_thread_init(resource, &connection->receiver, drbd_receiver, "receiver");
+	INIT_LIST_HEAD(&connection->resume_work.list);
+	connection->resume_work.cb = w_resume_expired;
+	init_timer(&connection->resume_timer);
+	connection->resume_timer.function = resume_timer_fn;
+	connection->resume_timer.data = (unsigned long) connection;
+
+	drbd_thread_init(resource, &connection->receiver, drbd_receiver, "receiver",
+			 DRBD_THREAD_RECEIVER);
 	connection->receiver.connection = connection;
-	drbd_thread_init(resource, &connection->worker, drbd_worker, "worker");
+	drbd_thread_init(resource, &connection->worker, drbd_worker, "worker",
+			 DRBD_THREAD_WORKER);
 	connection->worker.connection = connection;
-	drbd_thread_init(resource, &connection->ack_receiver, drbd_ack_receiver, "ack_recv");
+	drbd_thread_init(resource, &connection->sender, drbd_sender, "sender",
+			 DRBD_THREAD_SENDER);
+	connection->sender.connection = connection;
+	drbd_thread_init(resource, &connection->ack_receiver, drbd_ack_receiver, "ack_recv",
+			 DRBD_THREAD_ACK_RECEIVER);
 	connection->ack_receiver.connection = connection;
 
 	kref_init(&connection->kref);
@@ -2834,6 +3398,8 @@ struct drbd_connection *conn_create(const char *name, struct res_opts *res_opts)
 fail_resource:
 	list_del(&resource->resources);
 	drbd_free_resource(resource);
+fail_srcu:
+	cleanup_srcu_struct(&connection->integrity_srcu);
 fail:
 	kfree(connection->current_epoch);
 	drbd_free_socket(&connection->meta);
@@ -2852,9 +3418,12 @@ void drbd_destroy_connection(struct kref *kref)
 	kfree(connection->current_epoch);
 
 	idr_destroy(&connection->peer_devices);
+	del_timer_sync(&connection->resume_timer);
+	cleanup_srcu_struct(&connection->integrity_srcu);
 
 	drbd_free_socket(&connection->meta);
 	drbd_free_socket(&connection->data);
+	drbd_put_transport(connection->transport);
 	kfree(connection->int_dig_in);
 	kfree(connection->int_dig_vv);
 	memset(connection, 0xfc, sizeof(*connection));
@@ -3002,6 +3571,14 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 		goto out_idr_remove_vol;
 	}
 
+	/* diagnostic only, not having it is no reason to fail */
+	if (al_trace_entries) {
+		unsigned int n = min(al_trace_entries, DRBD_AL_TRACE_MAX);
+		device->al_trace.entries = vzalloc(n * sizeof(u32));
+		if (device->al_trace.entries)
+			device->al_trace.size = n;
+	}
+
 	add_disk(disk);
 
 	/* inherit the connection state */
@@ -3014,6 +3591,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	for_each_peer_device(peer_device, device)
 		drbd_debugfs_peer_device_add(peer_device);
 	drbd_debugfs_device_add(device);
+	drbd_arm_stats_timer(device);
 	return NO_ERROR;
 
 out_idr_remove_vol:
@@ -3054,6 +3632,8 @@ void drbd_delete_device(struct drbd_device *device)
 	struct drbd_connection *connection;
 	struct drbd_peer_device *peer_device;
 
+	del_timer_sync(&device->stats_timer);
+
 	/* move to free_peer_device() */
 	for_each_peer_device(peer_device, device)
 		drbd_debugfs_peer_device_cleanup(peer_device);
@@ -3103,6 +3683,9 @@ static int __init drbd_init(void)
 	mutex_init(&resources_mutex);
 	INIT_LIST_HEAD(&drbd_resources);
 
+	drbd_register_transport(&drbd_tcp_transport);
+	drbd_register_transport(&drbd_loop_transport);
+
 	err = drbd_genl_register();
 	if (err) {
 		pr_err("unable to register generic netlink family\n");
@@ -3148,27 +3731,99 @@ fail:
 	return err;
 }
 
-static void drbd_free_one_sock(struct drbd_socket *ds)
+static void drbd_free_one_sock(struct drbd_connection *connection, struct drbd_socket *ds)
 {
-	struct socket *s;
+	void *stream;
 	mutex_lock(&ds->mutex);
-	s = ds->socket;
-	ds->socket = NULL;
+	stream = ds->stream;
+	ds->stream = NULL;
 	mutex_unlock(&ds->mutex);
-	if (s) {
+	if (stream) {
 		/* so debugfs does not need to mutex_lock() */
 		synchronize_rcu();
-		kernel_sock_shutdown(s, SHUT_RDWR);
-		sock_release(s);
+		connection->transport->free_stream(stream);
 	}
 }
 
 void drbd_free_sock(struct drbd_connection *connection)
 {
-	if (connection->data.socket)
-		drbd_free_one_sock(&connection->data);
-	if (connection->meta.socket)
-		drbd_free_one_sock(&connection->meta);
+	if (connection->data.stream)
+		drbd_free_one_sock(connection, &connection->data);
+	if (connection->meta.stream)
+		drbd_free_one_sock(connection, &connection->meta);
+}
+
+static LIST_HEAD(drbd_transports);
+static DEFINE_MUTEX(drbd_transports_mutex);
+
+static struct drbd_transport_ops *__find_transport(const char *name)
+{
+	struct drbd_transport_ops *ops;
+
+	list_for_each_entry(ops, &drbd_transports, list)
+		if (!strcmp(ops->name, name))
+			return ops;
+	return NULL;
+}
+
+int drbd_register_transport(struct drbd_transport_ops *ops)
+{
+	int rv = 0;
+
+	mutex_lock(&drbd_transports_mutex);
+	if (__find_transport(ops->name)) {
+		pr_err("transport %s already registered\n", ops->name);
+		rv = -EEXIST;
+	} else {
+		list_add_tail(&ops->list, &drbd_transports);
+		pr_info("registered transport %s\n", ops->name);
+	}
+	mutex_unlock(&drbd_transports_mutex);
+	return rv;
+}
+EXPORT_SYMBOL(drbd_register_transport);
+
+/* The module references the connections hold keep this from being called
+ * while the transport is in use. */
+void drbd_unregister_transport(struct drbd_transport_ops *ops)
+{
+	mutex_lock(&drbd_transports_mutex);
+	list_del_init(&ops->list);
+	mutex_unlock(&drbd_transports_mutex);
+}
+EXPORT_SYMBOL(drbd_unregister_transport);
+
+static struct drbd_transport_ops *__get_transport(const char *name)
+{
+	struct drbd_transport_ops *ops;
+
+	mutex_lock(&drbd_transports_mutex);
+	ops = __find_transport(name);
+	if (ops && ops->module && !try_module_get(ops->module))
+		ops = NULL;
+	mutex_unlock(&drbd_transports_mutex);
+	return ops;
+}
+
+/* An empty name means the default, tcp.  May sleep. */
+struct drbd_transport_ops *drbd_get_transport(const char *name)
+{
+	struct drbd_transport_ops *ops;
+
+	if (!name[0])
+		name = drbd_tcp_transport.name;
+	ops = __get_transport(name);
+	if (!ops) {
+		request_module("drbd_transport_%s", name);
+		ops = __get_transport(name);
+	}
+	return ops;
+}
+
+void drbd_put_transport(struct drbd_transport_ops *ops)
+{
+	if (ops->module)
+		module_put(ops->module);
 }
 
 /* meta data management */
@@ -3820,6 +4475,30 @@ static void md_sync_timer_fn(unsigned long data)
 	drbd_device_post_work(device, MD_SYNC);
 }
 
+/**
+ * drbd_arm_stats_timer() - (Re)start or stop the periodic statistics broadcast
+ * @device:	DRBD device.
+ *
+ * The interval is taken from the resource options, unit deci-seconds.
+ * An interval of zero disables the broadcast.
+ */
+void drbd_arm_stats_timer(struct drbd_device *device)
+{
+	unsigned int interval = device->resource->res_opts.stats_interval;
+
+	if (interval)
+		mod_timer(&device->stats_timer, jiffies + interval * HZ / 10);
+	else
+		del_timer(&device->stats_timer);
+}
+
+static void stats_timer_fn(unsigned long data)
+{
+	struct drbd_device *device = (struct drbd_device *) data;
+	drbd_device_post_work(device, STATS_BCAST);
+	drbd_arm_stats_timer(device);
+}
+
 const char *cmdname(enum drbd_packet cmd)
 {
 	/* THINK may need to become several global tables
@@ -3828,6 +4507,8 @@ const char *cmdname(enum drbd_packet cmd)
 	static const char *cmdnames[] = {
 		[P_DATA]	        = "Data",
 		[P_WSAME]	        = "WriteSame",
+		[P_ACK_BATCH]		= "AckBatch",
+		[P_BM_TOKEN]		= "BitmapToken",
 		[P_TRIM]	        = "Trim",
 		[P_DATA_REPLY]	        = "DataReply",
 		[P_RS_DATA_REPLY]	= "RSDataReply",
@@ -3887,6 +4568,10 @@ const char *cmdname(enum drbd_packet cmd)
 		return "InitialMeta";
 	if (cmd == P_INITIAL_DATA)
 		return "InitialData";
+	if (cmd == P_INITIAL_DATA2)
+		return "InitialData2";
+	if (cmd == P_INITIAL_META2)
+		return "InitialMeta2";
 	if (cmd == P_CONNECTION_FEATURES)
 		return "ConnectionFeatures";
 	if (cmd >= ARRAY_SIZE(cmdnames))
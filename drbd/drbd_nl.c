@@ -483,7 +483,8 @@ static enum drbd_fencing_p highest_fencing_policy(struct drbd_connection *connec
 
 static bool resource_is_supended(struct drbd_resource *resource)
 {
-	return resource->susp || resource->susp_fen || resource->susp_nod;
+	return resource->susp || resource->susp_fen || resource->susp_nod ||
+		resource->susp_res;
 }
 
 bool conn_try_outdate_peer(struct drbd_connection *connection)
@@ -1188,20 +1189,25 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 	if (t) {
 		for (i = 0; i < t->nr_elements; i++) {
 			e = lc_element_by_index(t, i);
-			if (e->refcnt)
+			if (atomic_read(&e->refcnt))
 				drbd_err(device, "refcnt(%d)==%d\n",
-				    e->lc_number, e->refcnt);
-			in_use += e->refcnt;
+				    e->lc_number, atomic_read(&e->refcnt));
+			in_use += atomic_read(&e->refcnt);
 		}
 	}
-	if (!in_use)
+	if (!in_use) {
 		device->act_log = n;
+		/* history refers to the counters of the old lru_cache */
+		memset(&device->al_stats, 0, sizeof(device->al_stats));
+	}
 	spin_unlock_irq(&device->al_lock);
 	if (in_use) {
 		drbd_err(device, "Activity log still in use!\n");
 		lc_destroy(n);
 		return -EBUSY;
 	} else {
+		/* _al_get_rcu() may still be looking at it */
+		synchronize_rcu();
 		lc_destroy(t);
 	}
 	drbd_md_mark_dirty(device); /* we changed device->act_log->nr_elemens */
@@ -1438,14 +1444,16 @@ void drbd_reconsider_queue_parameters(struct drbd_device *device, struct drbd_ba
 	drbd_setup_queue_param(device, bdev, new, o);
 }
 
-/* Starts the worker thread */
+/* Starts the worker and the sender thread */
 static void conn_reconfig_start(struct drbd_connection *connection)
 {
 	drbd_thread_start(&connection->worker);
+	drbd_thread_start(&connection->sender);
 	drbd_flush_workqueue(&connection->sender_work);
+	drbd_flush_workqueue(&connection->data_work);
 }
 
-/* if still unconfigured, stops worker again. */
+/* if still unconfigured, stops worker and sender again. */
 static void conn_reconfig_done(struct drbd_connection *connection)
 {
 	bool stop_threads;
@@ -1457,6 +1465,7 @@ static void conn_reconfig_done(struct drbd_connection *connection)
 		/* ack_receiver thread and ack_sender workqueue are implicitly
 		 * stopped by receiver in conn_disconnect() */
 		drbd_thread_stop(&connection->receiver);
+		drbd_thread_stop(&connection->sender);
 		drbd_thread_stop(&connection->worker);
 	}
 }
@@ -1801,7 +1810,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	struct drbd_device *device;
 	struct drbd_peer_device *peer_device;
 	struct drbd_connection *connection;
-	int err;
+	int err, numa_node;
 	enum drbd_ret_code retcode;
 	enum determine_dev_size dd;
 	sector_t max_possible_sectors;
@@ -1977,6 +1986,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	wait_event(device->misc_wait, !atomic_read(&device->ap_pending_cnt) || drbd_suspended(device));
 	/* and for any other previously queued work */
 	drbd_flush_workqueue(&connection->sender_work);
+	drbd_flush_workqueue(&connection->data_work);
 
 	rv = _drbd_request_state(device, NS(disk, D_ATTACHING), CS_VERBOSE);
 	retcode = rv;  /* FIXME: Type mismatch. */
@@ -2045,9 +2055,13 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	new_plan = NULL;
 
 	drbd_resync_after_changed(device);
+	numa_node = bdev_get_queue(device->ldev->backing_bdev)->node;
 	drbd_bump_write_ordering(device->resource, device->ldev, WO_BIO_BARRIER);
 	unlock_all_resources();
 
+	/* takes conf_update and allocates, so not under the resources lock */
+	drbd_set_numa_node(device->resource, numa_node);
+
 	if (drbd_md_test_flag(device->ldev, MDF_CRASHED_PRIMARY))
 		set_bit(CRASHED_PRIMARY, &device->flags);
 	else
@@ -2367,6 +2381,7 @@ static enum drbd_ret_code
 check_net_options(struct drbd_connection *connection, struct net_conf *new_net_conf)
 {
 	static enum drbd_ret_code rv;
+	struct drbd_transport_ops *transport;
 	struct drbd_peer_device *peer_device;
 	int i;
 
@@ -2374,6 +2389,13 @@ check_net_options(struct drbd_connection *connection, struct net_conf *new_net_c
 	rv = _check_net_options(connection, rcu_dereference(connection->net_conf), new_net_conf);
 	rcu_read_unlock();
 
+	/* may load the module of the transport;
+	 * a change of the transport takes effect with the next connect */
+	transport = drbd_get_transport(new_net_conf->transport_name);
+	if (!transport)
+		return ERR_INVALID_REQUEST;
+	drbd_put_transport(transport);
+
 	/* connection->peer_devices protected by genl_lock() here */
 	idr_for_each_entry(&connection->peer_devices, peer_device, i) {
 		struct drbd_device *device = peer_device->device;
@@ -2470,6 +2492,7 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	int ovr; /* online verify running */
 	int rsr; /* re-sync running */
 	struct crypto crypto = { };
+	struct crypto_ahash *old_integrity_tfm;
 
 	retcode = drbd_adm_prepare(&adm_ctx, skb, info, DRBD_ADM_NEED_CONNECTION);
 	if (!adm_ctx.reply_skb)
@@ -2544,8 +2567,9 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 		crypto.verify_tfm = NULL;
 	}
 
-	crypto_free_ahash(connection->integrity_tfm);
-	connection->integrity_tfm = crypto.integrity_tfm;
+	/* freed below, after the grace period, see drbd_req_csum() */
+	old_integrity_tfm = connection->integrity_tfm;
+	conn_set_integrity_tfm(connection, crypto.integrity_tfm);
 	if (connection->cstate >= C_WF_REPORT_PARAMS && connection->agreed_pro_version >= 100)
 		/* Do this without trying to take connection->data.mutex again.  */
 		__drbd_send_protocol(connection, P_PROTOCOL_UPDATE);
@@ -2557,6 +2581,8 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	mutex_unlock(&connection->data.mutex);
 	synchronize_rcu();
 	kfree(old_net_conf);
+	synchronize_srcu(&connection->integrity_srcu);
+	crypto_free_ahash(old_integrity_tfm);
 
 	if (connection->cstate >= C_WF_REPORT_PARAMS) {
 		struct drbd_peer_device *peer_device;
@@ -2686,6 +2712,7 @@ int drbd_adm_connect(struct sk_buff *skb, struct genl_info *info)
 	((char *)new_net_conf->shared_secret)[SHARED_SECRET_MAX-1] = 0;
 
 	drbd_flush_workqueue(&connection->sender_work);
+	drbd_flush_workqueue(&connection->data_work);
 
 	mutex_lock(&adm_ctx.resource->conf_update);
 	old_net_conf = connection->net_conf;
@@ -2698,7 +2725,7 @@ int drbd_adm_connect(struct sk_buff *skb, struct genl_info *info)
 
 	conn_free_crypto(connection);
 	connection->cram_hmac_tfm = crypto.cram_hmac_tfm;
-	connection->integrity_tfm = crypto.integrity_tfm;
+	conn_set_integrity_tfm(connection, crypto.integrity_tfm);
 	connection->csums_tfm = crypto.csums_tfm;
 	connection->verify_tfm = crypto.verify_tfm;
 
@@ -3261,6 +3288,9 @@ int drbd_adm_resume_io(struct sk_buff *skb, struct genl_info *info)
 		}
 		clear_bit(NEW_CUR_UUID, &device->flags);
 	}
+	/* stop waiting for the session to resume */
+	if (device->state.conn < C_CONNECTED)
+		conn_session_lost(first_peer_device(device)->connection);
 	drbd_suspend_io(device);
 	retcode = drbd_request_state(device, NS3(susp, 0, susp_nod, 0, susp_fen, 0));
 	if (retcode == SS_SUCCESS) {
@@ -4437,6 +4467,7 @@ static enum drbd_ret_code adm_del_minor(struct drbd_device *device)
 		/* If the state engine hasn't stopped the sender thread yet, we
 		 * need to flush the sender work queue before generating the
 		 * DESTROY events here. */
+		drbd_flush_data_work(connection);
 		if (get_t_state(&connection->worker) == RUNNING)
 			drbd_flush_workqueue(&connection->sender_work);
 
@@ -4498,8 +4529,10 @@ static int adm_del_resource(struct drbd_resource *resource)
 	mutex_unlock(&resources_mutex);
 	/* Make sure all threads have actually stopped: state handling only
 	 * does drbd_thread_stop_nowait(). */
-	list_for_each_entry(connection, &resource->connections, connections)
+	list_for_each_entry(connection, &resource->connections, connections) {
+		drbd_thread_stop(&connection->sender);
 		drbd_thread_stop(&connection->worker);
+	}
 	synchronize_rcu();
 	drbd_free_resource(resource);
 	return NO_ERROR;
@@ -4883,6 +4916,154 @@ fail:
 		 err, seq);
 }
 
+/* upper bound, in usec, of the histogram bucket holding the given percentile */
+static u32 lat_hist_percentile(const u32 *hist, u64 total, unsigned int percent)
+{
+	u64 want = div_u64(total * percent + 99, 100);
+	u64 seen = 0;
+	int n;
+
+	if (!total)
+		return 0;
+	for (n = 0; n < DRBD_LAT_HIST_BUCKETS - 1; n++) {
+		seen += hist[n];
+		if (seen >= want)
+			break;
+	}
+	return 1U << n;
+}
+
+static void device_to_perf_statistics(struct perf_statistics *s,
+				      struct drbd_device *device)
+{
+	struct drbd_connection *connection = first_peer_device(device)->connection;
+	struct drbd_perf_counters p;
+	unsigned long now = jiffies;
+	u64 al_total;
+
+	memset(s, 0, sizeof(*s));
+
+	spin_lock_irq(&device->resource->req_lock);
+	p = device->perf;
+	memset(&device->perf, 0, sizeof(device->perf));
+	spin_unlock_irq(&device->resource->req_lock);
+
+	s->perf_interval_ms = jiffies_to_msecs(now - device->perf_last_jif);
+	device->perf_last_jif = now;
+	s->perf_read_ios = p.ios[0];
+	s->perf_write_ios = p.ios[1];
+	s->perf_read_bytes = p.bytes[0];
+	s->perf_write_bytes = p.bytes[1];
+	s->perf_read_lat_p50 = lat_hist_percentile(p.lat_hist[0], p.ios[0], 50);
+	s->perf_read_lat_p90 = lat_hist_percentile(p.lat_hist[0], p.ios[0], 90);
+	s->perf_read_lat_p99 = lat_hist_percentile(p.lat_hist[0], p.ios[0], 99);
+	s->perf_write_lat_p50 = lat_hist_percentile(p.lat_hist[1], p.ios[1], 50);
+	s->perf_write_lat_p90 = lat_hist_percentile(p.lat_hist[1], p.ios[1], 90);
+	s->perf_write_lat_p99 = lat_hist_percentile(p.lat_hist[1], p.ios[1], 99);
+
+	if (get_ldev(device)) {
+		unsigned long hits, misses, evicted;
+		unsigned int writ_cnt;
+
+		spin_lock_irq(&device->al_lock);
+		hits = lc_hits(device->act_log);
+		misses = device->act_log->misses;
+		evicted = device->act_log->evicted;
+		writ_cnt = device->al_writ_cnt;
+		spin_unlock_irq(&device->al_lock);
+		/* the lru_cache counters restart from zero on al-extents change */
+		s->perf_al_hits = hits - device->perf_al_hits;
+		s->perf_al_misses = misses - device->perf_al_misses;
+		s->perf_al_evicted = evicted - device->perf_al_evicted;
+		if (hits < device->perf_al_hits || misses < device->perf_al_misses ||
+		    evicted < device->perf_al_evicted) {
+			s->perf_al_hits = hits;
+			s->perf_al_misses = misses;
+			s->perf_al_evicted = evicted;
+		}
+		s->perf_al_transactions = writ_cnt - device->perf_al_writ_cnt;
+		device->perf_al_hits = hits;
+		device->perf_al_misses = misses;
+		device->perf_al_evicted = evicted;
+		device->perf_al_writ_cnt = writ_cnt;
+		put_ldev(device);
+	}
+	al_total = s->perf_al_hits + s->perf_al_misses;
+	if (al_total)
+		s->perf_al_hit_ratio = div64_u64(s->perf_al_hits * 1000, al_total);
+
+	s->perf_pp_in_use = atomic_read(&device->pp_in_use);
+	s->perf_pp_in_use_by_net = atomic_read(&device->pp_in_use_by_net);
+	s->perf_pp_vacant = drbd_pp_vacant;
+	s->perf_ap_in_flight = atomic_read(&device->ap_in_flight);
+	if (is_sync_state(device->state.conn))
+		s->perf_resync_rate = device->c_sync_rate;
+
+	mutex_lock(&connection->data.mutex);
+	if (connection->data.stream) {
+		int queued, size;
+
+		connection->transport->sndbuf(&connection->data, &queued, &size);
+		s->perf_sndbuf_queued = queued;
+		s->perf_sndbuf_size = size;
+	}
+	mutex_unlock(&connection->data.mutex);
+}
+
+/**
+ * drbd_bcast_perf_stats() - Multicast performance counters of one device
+ * @device:	DRBD device.
+ *
+ * Called from the worker, every res_opts.stats_interval, see stats_timer_fn().
+ * Sent to the "stats" multicast group, not to "events".
+ */
+void drbd_bcast_perf_stats(struct drbd_device *device)
+{
+	struct drbd_peer_device *peer_device = first_peer_device(device);
+	struct device_statistics device_statistics;
+	struct peer_device_statistics peer_device_statistics;
+	struct perf_statistics perf_statistics;
+	struct drbd_genlmsghdr *dh;
+	struct sk_buff *skb;
+	unsigned int seq;
+	int err;
+
+	device_to_perf_statistics(&perf_statistics, device);
+
+	seq = atomic_inc_return(&notify_genl_seq);
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_NOIO);
+	err = -ENOMEM;
+	if (!skb)
+		goto failed;
+
+	err = -EMSGSIZE;
+	dh = genlmsg_put(skb, 0, seq, &drbd_genl_family, 0, DRBD_PERF_STATISTICS);
+	if (!dh)
+		goto nla_put_failure;
+	dh->minor = device->minor;
+	dh->ret_code = NO_ERROR;
+	if (nla_put_drbd_cfg_context(skb, device->resource, peer_device->connection, device))
+		goto nla_put_failure;
+	device_to_statistics(&device_statistics, device);
+	peer_device_to_statistics(&peer_device_statistics, peer_device);
+	if (device_statistics_to_skb(skb, &device_statistics, !capable(CAP_SYS_ADMIN)) ||
+	    peer_device_statistics_to_skb(skb, &peer_device_statistics, !capable(CAP_SYS_ADMIN)) ||
+	    perf_statistics_to_skb(skb, &perf_statistics, !capable(CAP_SYS_ADMIN)))
+		goto nla_put_failure;
+	genlmsg_end(skb, dh);
+	err = drbd_genl_multicast_stats(skb, GFP_NOWAIT);
+	/* skb has been consumed or freed in netlink_broadcast() */
+	if (err && err != -ESRCH)
+		goto failed;
+	return;
+
+nla_put_failure:
+	nlmsg_free(skb);
+failed:
+	drbd_err(device, "Error %d while broadcasting statistics. Event seq:%u\n",
+		 err, seq);
+}
+
 static void notify_initial_state_done(struct sk_buff *skb, unsigned int seq)
 {
 	struct drbd_genlmsghdr *dh;
@@ -69,6 +69,14 @@ enum drbd_packet {
 	 * we may fall back to an opencoded loop instead. */
 	P_WSAME               = 0x34,
 
+	/* meta socket, many P_WRITE_ACK or P_RECV_ACK in one packet.
+	 * Only used if both support FF_ACK_BATCH */
+	P_ACK_BATCH           = 0x35,
+
+	/* data socket, before P_UUIDS: identifies the last completed bitmap
+	 * exchange.  Only used if both support FF_BM_DELTA */
+	P_BM_TOKEN            = 0x36,
+
 	P_MAY_IGNORE	      = 0x100, /* Flag to test if (cmd > P_MAY_IGNORE) ... */
 	P_MAX_OPT_CMD	      = 0x101,
 
@@ -76,6 +84,8 @@ enum drbd_packet {
 
 	P_INITIAL_META	      = 0xfff1, /* First Packet on the MetaSock */
 	P_INITIAL_DATA	      = 0xfff2, /* First Packet on the Socket */
+	P_INITIAL_DATA2	      = 0xfff3, /* First Packet on the standby path for the Socket */
+	P_INITIAL_META2	      = 0xfff4, /* First Packet on the standby path for the MetaSock */
 
 	P_CONNECTION_FEATURES = 0xfffe	/* FIXED for the next century! */
 };
@@ -129,6 +139,7 @@ struct p_header100 {
 #define DP_SEND_RECEIVE_ACK 128 /* This is a proto B write request */
 #define DP_SEND_WRITE_ACK   256 /* This is a proto C write request */
 #define DP_WSAME            512 /* equiv. REQ_WRITE_SAME */
+#define DP_DIGEST          1024 /* carries a data-integrity digest, see DRBD_FF_INTEGRITY_SAMPLE */
 
 struct p_data {
 	u64	    sector;    /* 64 bits sector number */
@@ -162,6 +173,15 @@ struct p_block_ack {
 	u32	    seq_num;
 } __packed;
 
+/* P_ACK_BATCH: @count acks of type @command, in the order they have been
+ * generated.  Each still carries its own seq_num. */
+struct p_ack_batch {
+	u16	    command;
+	u16	    count;
+	u32	    pad;
+	struct p_block_ack acks[0];
+} __packed;
+
 struct p_block_req {
 	u64 sector;
 	u64 block_id;
@@ -196,6 +216,34 @@ struct p_block_req {
  */
 #define DRBD_FF_WSAME 4
 
+/* supports P_ACK_BATCH on the meta socket */
+#define DRBD_FF_ACK_BATCH 8
+
+/* understands the RLE_Rice_Bits bitmap encoding */
+#define DRBD_FF_BM_RICE 16
+
+/* sends P_BM_TOKEN, and may then send only the bitmap changes since the
+ * last bitmap exchange both peers completed */
+#define DRBD_FF_BM_DELTA 32
+
+/* with data-integrity-alg, a data packet carries a digest
+ * only if it has DP_DIGEST set in its dp_flags */
+#define DRBD_FF_INTEGRITY_SAMPLE 64
+
+/* the transport may pass references to the pages of data blocks,
+ * instead of copies.  Only offered by transports that can, see
+ * drbd_transport_ops.features */
+#define DRBD_FF_PAGE_PASSING 128
+
+/* the transport runs the data and the meta stream over two network paths,
+ * each the standby of the other, and fails a stream over to its standby
+ * without a disconnect; offered only if it established them */
+#define DRBD_FF_MULTIPATH 256
+
+/* identifies the session in p_connection_features.session, and after a
+ * network failure resumes it, see resume-timeout */
+#define DRBD_FF_SESSION_RESUME 512
+
 struct p_connection_features {
 	u32 protocol_min;
 	u32 feature_flags;
@@ -206,7 +254,8 @@ struct p_connection_features {
 	 */
 
 	u32 _pad;
-	u64 reserved[7];
+	u64 session;	/* with DRBD_FF_SESSION_RESUME, random per session */
+	u64 reserved[6];
 } __packed;
 
 struct p_barrier {
@@ -269,6 +318,10 @@ struct p_rs_uuid {
 	u64	    uuid;
 } __packed;
 
+struct p_bm_token {
+	u64	    token;	/* 0: no usable history */
+} __packed;
+
 /* optional queue_limits if (agreed_features & DRBD_FF_WSAME)
  * see also struct queue_limits, as of late 2015 */
 struct o_qlim {
@@ -351,6 +404,9 @@ enum drbd_bitmap_code {
 	 * and other bit variants had been defined during
 	 * algorithm evaluation. */
 	RLE_VLI_Bits = 2,
+	/* adaptive Golomb-Rice coded run lengths, see drbd_vli.h.
+	 * Only used if both support DRBD_FF_BM_RICE. */
+	RLE_Rice_Bits = 3,
 };
 
 struct p_compressed_bm {
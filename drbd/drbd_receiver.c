@@ -47,7 +47,9 @@
 #include "drbd_vli.h"
 #include <linux/scatterlist.h>
 
-#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME)
+#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_ACK_BATCH| \
+		      DRBD_FF_BM_RICE|DRBD_FF_BM_DELTA|DRBD_FF_INTEGRITY_SAMPLE| \
+		      DRBD_FF_SESSION_RESUME)
 
 struct flush_work {
 	struct drbd_work w;
@@ -195,9 +197,10 @@ static struct page *__drbd_alloc_pages(struct drbd_device *device,
 
 	/* GFP_TRY, because we must not cause arbitrary write-out: in a DRBD
 	 * "criss-cross" setup, that might cause write-out on some other DRBD,
-	 * which in turn might block on the other node at this very place.  */
+	 * which in turn might block on the other node at this very place.
+	 * Fresh pages come from the NUMA node the resource lives on. */
 	for (i = 0; i < number; i++) {
-		tmp = alloc_page(GFP_TRY);
+		tmp = alloc_pages_node(device->resource->numa_node, GFP_TRY, 0);
 		if (!tmp)
 			break;
 		set_page_private(tmp, (unsigned long)page);
@@ -416,7 +419,9 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, u64 id, sector_t secto
 	if (drbd_insert_fault(device, DRBD_FAULT_AL_EE))
 		return NULL;
 
-	peer_req = mempool_alloc(drbd_ee_mempool, gfp_mask & ~__GFP_HIGHMEM);
+	peer_req = drbd_mempool_alloc_node(drbd_ee_mempool, drbd_ee_cache,
+					   gfp_mask & ~__GFP_HIGHMEM,
+					   device->resource->numa_node);
 	if (!peer_req) {
 		if (!(gfp_mask & __GFP_NOWARN))
 			drbd_err(device, "%s: allocation failed\n", __func__);
@@ -489,10 +494,11 @@ int drbd_free_peer_reqs(struct drbd_device *device, struct list_head *list)
  */
 static int drbd_finish_peer_reqs(struct drbd_device *device)
 {
+	struct drbd_connection *connection = first_peer_device(device)->connection;
 	LIST_HEAD(work_list);
 	LIST_HEAD(reclaimed);
 	struct drbd_peer_request *peer_req, *t;
-	int err = 0;
+	int err = 0, err2;
 
 	spin_lock_irq(&device->resource->req_lock);
 	reclaim_finished_net_peer_reqs(device, &reclaimed);
@@ -506,15 +512,17 @@ static int drbd_finish_peer_reqs(struct drbd_device *device)
 	 * e_end_block, and e_end_resync_block, e_send_superseded.
 	 * all ignore the last argument.
 	 */
+	drbd_ack_batch_begin(connection);
 	list_for_each_entry_safe(peer_req, t, &work_list, w.list) {
-		int err2;
-
 		/* list_del not necessary, next/prev members not touched */
 		err2 = peer_req->w.cb(&peer_req->w, !!err);
 		if (!err)
 			err = err2;
 		drbd_free_peer_req(device, peer_req);
 	}
+	err2 = drbd_ack_batch_end(connection);
+	if (!err)
+		err = err2;
 	wake_up(&device->ee_wait);
 
 	return err;
@@ -545,23 +553,26 @@ static void drbd_wait_ee_list_empty(struct drbd_device *device,
 	spin_unlock_irq(&device->resource->req_lock);
 }
 
-static int drbd_recv_short(struct socket *sock, void *buf, size_t size, int flags)
+static int drbd_recv_short(struct drbd_connection *connection, struct drbd_socket *sock,
+			   void *buf, size_t size, int flags)
 {
-	struct kvec iov = {
-		.iov_base = buf,
-		.iov_len = size,
-	};
-	struct msghdr msg = {
-		.msg_flags = (flags ? flags : MSG_WAITALL | MSG_NOSIGNAL)
-	};
-	return kernel_recvmsg(sock, &msg, &iov, 1, size, msg.msg_flags);
+	ktime_t start = ktime_get();
+	int rv;
+
+	rv = connection->transport->recv(sock, buf, size,
+					 flags ? flags : MSG_WAITALL | MSG_NOSIGNAL);
+	sock->stats.recv_calls++;
+	sock->stats.recv_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (rv > 0)
+		sock->stats.recv_bytes += rv;
+	return rv;
 }
 
 static int drbd_recv(struct drbd_connection *connection, void *buf, size_t size)
 {
 	int rv;
 
-	rv = drbd_recv_short(connection->data.socket, buf, size, 0);
+	rv = drbd_recv_short(connection, &connection->data, buf, size, 0);
 
 	if (rv < 0) {
 		if (rv == -ECONNRESET)
@@ -613,325 +624,19 @@ static int drbd_recv_all_warn(struct drbd_connection *connection, void *buf, siz
 	return err;
 }
 
-/* quoting tcp(7):
- *   On individual connections, the socket buffer size must be set prior to the
- *   listen(2) or connect(2) calls in order to have it take effect.
- * This is our wrapper to do so.
- */
-static void drbd_setbufsize(struct socket *sock, unsigned int snd,
-		unsigned int rcv)
-{
-	/* open coded SO_SNDBUF, SO_RCVBUF */
-	if (snd) {
-		sock->sk->sk_sndbuf = snd;
-		sock->sk->sk_userlocks |= SOCK_SNDBUF_LOCK;
-	}
-	if (rcv) {
-		sock->sk->sk_rcvbuf = rcv;
-		sock->sk->sk_userlocks |= SOCK_RCVBUF_LOCK;
-	}
-}
-
-static struct socket *drbd_try_connect(struct drbd_connection *connection, int use_addr2)
-{
-	const char *what;
-	struct socket *sock;
-	struct sockaddr_in6 src_in6;
-	struct sockaddr_in6 peer_in6;
-	struct net_conf *nc;
-	int err, peer_addr_len = 0, my_addr_len = 0;
-	int sndbuf_size, rcvbuf_size, connect_int;
-	int disconnect_on_error = 1;
-
-	if (!use_addr2) {
-		my_addr_len = min_t(int, connection->my_addr_len, sizeof(src_in6));
-		memcpy(&src_in6, &connection->my_addr, my_addr_len);
-
-		peer_addr_len = min_t(int, connection->peer_addr_len, sizeof(src_in6));
-		memcpy(&peer_in6, &connection->peer_addr, peer_addr_len);
-	}
-
-	rcu_read_lock();
-	nc = rcu_dereference(connection->net_conf);
-	if (!nc) {
-		rcu_read_unlock();
-		return NULL;
-	}
-
-	sndbuf_size = nc->sndbuf_size;
-	rcvbuf_size = nc->rcvbuf_size;
-	connect_int = nc->connect_int;
-	if (use_addr2) {
-		my_addr_len = min_t(int, nc->my_addr2_len, sizeof(src_in6));
-		memcpy(&src_in6, &nc->my_addr2, my_addr_len);
-
-		peer_addr_len = min_t(int, nc->peer_addr2_len, sizeof(src_in6));
-		memcpy(&peer_in6, &nc->peer_addr2, peer_addr_len);
-	}
-	rcu_read_unlock();
-
-	if (((struct sockaddr *)&connection->my_addr)->sa_family == AF_INET6)
-		src_in6.sin6_port = 0;
-	else
-		((struct sockaddr_in *)&src_in6)->sin_port = 0; /* AF_INET & AF_SCI */
-
-	what = "sock_create_kern_in_try_connect";
-	err = sock_create_kern(&init_net, ((struct sockaddr *)&src_in6)->sa_family,
-			       SOCK_STREAM, IPPROTO_TCP, &sock);
-	if (err < 0) {
-		sock = NULL;
-		goto out;
-	}
-
-	sock->sk->sk_rcvtimeo =
-	sock->sk->sk_sndtimeo = connect_int * HZ;
-	drbd_setbufsize(sock, sndbuf_size, rcvbuf_size);
-
-       /* explicitly bind to the configured IP as source IP
-	*  for the outgoing connections.
-	*  This is needed for multihomed hosts and to be
-	*  able to use lo: interfaces for drbd.
-	* Make sure to use 0 as port number, so linux selects
-	*  a free one dynamically.
-	*/
-	what = "bind before connect";
-	err = sock->ops->bind(sock, (struct sockaddr *) &src_in6, my_addr_len);
-	if (err < 0)
-		goto out;
-
-	/* connect may fail, peer not yet available.
-	 * stay C_WF_CONNECTION, don't go Disconnecting! */
-	disconnect_on_error = 0;
-	what = "connect";
-	err = sock->ops->connect(sock, (struct sockaddr *) &peer_in6, peer_addr_len, 0);
-
-out:
-	if (err < 0) {
-		if (sock) {
-			sock_release(sock);
-			sock = NULL;
-		}
-		switch (-err) {
-			/* timeout, busy, signal pending */
-		case ETIMEDOUT: case EAGAIN: case EINPROGRESS:
-		case EINTR: case ERESTARTSYS:
-			/* peer not (yet) available, network problem */
-		case ECONNREFUSED: case ENETUNREACH:
-		case EHOSTDOWN:    case EHOSTUNREACH:
-			disconnect_on_error = 0;
-			break;
-		default:
-			drbd_err(connection, "%s failed, err = %d\n", what, err);
-		}
-		if (disconnect_on_error)
-			conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
-	}
-
-	return sock;
-}
-
-struct accept_wait_data {
-	struct drbd_connection *connection;
-	struct socket *s_listen;
-	struct socket *s_listen2;
-	int using_addr; /* 0 = undecided. 1 = addr, 2 = addr 2*/
-	struct completion door_bell;
-	void (*original_sk_state_change)(struct sock *sk);
-};
-
-static void drbd_incoming_connection(struct sock *sk)
-{
-	struct accept_wait_data *ad = sk->sk_user_data;
-	void (*state_change)(struct sock *sk);
-
-	state_change = ad->original_sk_state_change;
-	if (sk->sk_state == TCP_ESTABLISHED)
-		complete(&ad->door_bell);
-	state_change(sk);
-}
-
-static struct socket *create_listen_socket(struct drbd_connection *connection,
-					   struct sockaddr *addr,
-					   int addr_len)
-{
-	int err, sndbuf_size, rcvbuf_size;
-	struct socket *s_listen;
-	struct net_conf *nc;
-	const char *what;
-
-	rcu_read_lock();
-	nc = rcu_dereference(connection->net_conf);
-	if (!nc) {
-		rcu_read_unlock();
-		return NULL;
-	}
-	sndbuf_size = nc->sndbuf_size;
-	rcvbuf_size = nc->rcvbuf_size;
-	rcu_read_unlock();
-
-	what = "sock_create_kern";
-	err = sock_create_kern(&init_net, addr->sa_family, SOCK_STREAM, IPPROTO_TCP, &s_listen);
-	if (err) {
-		s_listen = NULL;
-		goto out;
-	}
-
-	s_listen->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
-	drbd_setbufsize(s_listen, sndbuf_size, rcvbuf_size);
-
-	what = "bind before listen";
-	err = s_listen->ops->bind(s_listen, addr, addr_len);
-	if (err < 0)
-		goto out;
-
-	return s_listen;
-out:
-	if (s_listen)
-		sock_release(s_listen);
-
-	drbd_err(connection, "%s failed, err = %d\n", what, err);
-
-	return NULL;
-}
-
-static int prepare_listen_socket(struct drbd_connection *connection, struct accept_wait_data *ad)
-{
-	int err = -EIO, my_addr_len;
-	struct sockaddr_in6 my_addr;
-	struct net_conf *nc;
-	const char *what;
-
-	my_addr_len = min_t(int, connection->my_addr_len, sizeof(struct sockaddr_in6));
-	memcpy(&my_addr, &connection->my_addr, my_addr_len);
-
-	what = "create_listen_socket";
-	ad->s_listen = create_listen_socket(connection, (struct sockaddr *)&my_addr, my_addr_len);
-	if (!ad->s_listen)
-		goto out;
-
-	rcu_read_lock();
-	nc = rcu_dereference(connection->net_conf);
-	if (!nc) {
-		rcu_read_unlock();
-		goto out;
-	}
-	my_addr_len = nc->my_addr2_len;
-	memcpy(&my_addr, nc->my_addr2, my_addr_len);
-	rcu_read_unlock();
-
-	if (my_addr_len) {
-		what = "create_listen_socket2";
-		ad->s_listen2 = create_listen_socket(connection, (struct sockaddr *)&my_addr, my_addr_len);
-		if (!ad->s_listen2)
-			goto out;
-
-		write_lock_bh(&ad->s_listen2->sk->sk_callback_lock);
-		ad->s_listen2->sk->sk_state_change = drbd_incoming_connection;
-		ad->s_listen2->sk->sk_user_data = ad;
-		write_unlock_bh(&ad->s_listen2->sk->sk_callback_lock);
-
-		what = "listen2";
-		err = ad->s_listen2->ops->listen(ad->s_listen2, 5);
-		if (err < 0)
-			goto out;
-	}
-
-	write_lock_bh(&ad->s_listen->sk->sk_callback_lock);
-	ad->original_sk_state_change = ad->s_listen->sk->sk_state_change;
-	ad->s_listen->sk->sk_state_change = drbd_incoming_connection;
-	ad->s_listen->sk->sk_user_data = ad;
-	write_unlock_bh(&ad->s_listen->sk->sk_callback_lock);
-
-	what = "listen";
-	err = ad->s_listen->ops->listen(ad->s_listen, 5);
-	if (err < 0)
-		goto out;
-
-	return 0;
-out:
-	if (ad->s_listen)
-		sock_release(ad->s_listen);
-	if (ad->s_listen2)
-		sock_release(ad->s_listen2);
-	if (err < 0) {
-		if (err != -EAGAIN && err != -EINTR && err != -ERESTARTSYS) {
-			drbd_err(connection, "%s failed, err = %d\n", what, err);
-			conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
-		}
-	}
-
-	return -EIO;
-}
-
-static void unregister_state_change(struct sock *sk, struct accept_wait_data *ad)
-{
-	write_lock_bh(&sk->sk_callback_lock);
-	sk->sk_state_change = ad->original_sk_state_change;
-	sk->sk_user_data = NULL;
-	write_unlock_bh(&sk->sk_callback_lock);
-}
-
-static struct socket *drbd_wait_for_connect(struct drbd_connection *connection, struct accept_wait_data *ad)
-{
-	int timeo, connect_int, err = 0;
-	struct socket *s_estab = NULL;
-	struct net_conf *nc;
-
-	rcu_read_lock();
-	nc = rcu_dereference(connection->net_conf);
-	if (!nc) {
-		rcu_read_unlock();
-		return NULL;
-	}
-	connect_int = nc->connect_int;
-	rcu_read_unlock();
-
-	timeo = connect_int * HZ;
-	timeo += (prandom_u32() & 1) ? timeo / 7 : -timeo / 7; /* 28.5% random jitter */
-
-	err = wait_for_completion_interruptible_timeout(&ad->door_bell, timeo);
-	if (err <= 0)
-		return NULL;
-
-	err = kernel_accept(ad->s_listen, &s_estab, O_NONBLOCK);
-	if (err < 0 && err != -EAGAIN && err != -EINTR && err != -ERESTARTSYS) {
-		drbd_err(connection, "accept failed, err = %d\n", err);
-		conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
-		return NULL;
-	}
-	if (!err) {
-		ad->using_addr = 1;
-		unregister_state_change(s_estab->sk, ad);
-		return s_estab;
-	}
-	else if (!ad->s_listen2)
-		return NULL;
-
-	err = kernel_accept(ad->s_listen2, &s_estab, O_NONBLOCK);
-	if (err < 0 && err != -EAGAIN && err != -EINTR && err != -ERESTARTSYS) {
-		drbd_err(connection, "accept failed, err = %d\n", err);
-		conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
-	}
-
-	if (s_estab) {
-		ad->using_addr = 2;
-		unregister_state_change(s_estab->sk, ad);
-	}
-
-	return s_estab;
-}
-
 static int decode_header(struct drbd_connection *, void *, struct packet_info *);
 
-static int send_first_packet(struct drbd_connection *connection, struct drbd_socket *sock,
-			     enum drbd_packet cmd)
+/* The transports send and receive the initial packets through these,
+ * to tell the data from the meta stream while they are establishing them. */
+int drbd_send_first_packet(struct drbd_connection *connection, struct drbd_socket *sock,
+			   enum drbd_packet cmd)
 {
 	if (!conn_prepare_command(connection, sock))
 		return -EIO;
 	return conn_send_command(connection, sock, cmd, 0, NULL, 0);
 }
 
-static int receive_first_packet(struct drbd_connection *connection, struct socket *sock)
+int drbd_receive_first_packet(struct drbd_connection *connection, struct drbd_socket *sock)
 {
 	unsigned int header_size = drbd_header_size(connection);
 	struct packet_info pi;
@@ -944,10 +649,10 @@ static int receive_first_packet(struct drbd_connection *connection, struct socke
 		rcu_read_unlock();
 		return -EIO;
 	}
-	sock->sk->sk_rcvtimeo = nc->ping_timeo * 4 * HZ / 10;
+	connection->transport->set_rcvtimeo(sock, nc->ping_timeo * 4 * HZ / 10);
 	rcu_read_unlock();
 
-	err = drbd_recv_short(sock, connection->data.rbuf, header_size, 0);
+	err = drbd_recv_short(connection, sock, connection->data.rbuf, header_size, 0);
 	if (err != header_size) {
 		if (err >= 0)
 			err = -EIO;
@@ -959,52 +664,6 @@ static int receive_first_packet(struct drbd_connection *connection, struct socke
 	return pi.cmd;
 }
 
-/**
- * drbd_socket_okay() - Free the socket if its connection is not okay
- * @sock:	pointer to the pointer to the socket.
- */
-static bool drbd_socket_okay(struct socket **sock)
-{
-	int rr;
-	char tb[4];
-
-	if (!*sock)
-		return false;
-
-	rr = drbd_recv_short(*sock, tb, 4, MSG_DONTWAIT | MSG_PEEK);
-
-	if (rr > 0 || rr == -EAGAIN) {
-		return true;
-	} else {
-		sock_release(*sock);
-		*sock = NULL;
-		return false;
-	}
-}
-
-static bool connection_established(struct drbd_connection *connection,
-				   struct socket **sock1,
-				   struct socket **sock2)
-{
-	struct net_conf *nc;
-	int timeout;
-	bool ok;
-
-	if (!*sock1 || !*sock2)
-		return false;
-
-	rcu_read_lock();
-	nc = rcu_dereference(connection->net_conf);
-	timeout = (nc->sock_check_timeo ?: nc->ping_timeo) * HZ / 10;
-	rcu_read_unlock();
-	schedule_timeout_interruptible(timeout);
-
-	ok = drbd_socket_okay(sock1);
-	ok = drbd_socket_okay(sock2) && ok;
-
-	return ok;
-}
-
 /* Gets called if a connection is established, or if a new minor gets created
    in a connection */
 int drbd_connected(struct drbd_peer_device *peer_device)
@@ -1019,9 +678,15 @@ int drbd_connected(struct drbd_peer_device *peer_device)
 		&peer_device->connection->cstate_mutex :
 		&device->own_state_mutex;
 
+	/* only what we send on this connection can get confirmed */
+	drbd_bm_xchg_cancel(device);
+	device->peer_bm_token = 0;
+
 	err = drbd_send_sync_param(peer_device);
 	if (!err)
 		err = drbd_send_sizes(peer_device, 0, 0);
+	if (!err)
+		err = drbd_send_bm_token(peer_device);
 	if (!err)
 		err = drbd_send_uuids(peer_device);
 	if (!err)
@@ -1043,163 +708,74 @@ int drbd_connected(struct drbd_peer_device *peer_device)
  */
 static int conn_connect(struct drbd_connection *connection)
 {
-	struct drbd_socket sock, msock;
+	char transport_name[DRBD_TRANSPORT_NAME_MAX];
+	struct drbd_transport_ops *transport;
 	struct drbd_peer_device *peer_device;
 	struct net_conf *nc;
 	int vnr, timeout, h;
-	bool discard_my_data, ok;
+	bool discard_my_data;
 	enum drbd_state_rv rv;
-	bool addr2_enabled;
-	struct accept_wait_data ad = {
-		.connection = connection,
-		.door_bell = COMPLETION_INITIALIZER_ONSTACK(ad.door_bell),
-		.using_addr = 0,
-	};
 
 	clear_bit(DISCONNECT_SENT, &connection->flags);
 	if (conn_request_state(connection, NS(conn, C_WF_CONNECTION), CS_VERBOSE) < SS_SUCCESS)
 		return -2;
 
-	mutex_init(&sock.mutex);
-	sock.sbuf = connection->data.sbuf;
-	sock.rbuf = connection->data.rbuf;
-	sock.socket = NULL;
-	mutex_init(&msock.mutex);
-	msock.sbuf = connection->meta.sbuf;
-	msock.rbuf = connection->meta.rbuf;
-	msock.socket = NULL;
-
 	/* Assume that the peer only understands protocol 80 until we know better.  */
 	connection->agreed_pro_version = 80;
 
 	rcu_read_lock();
 	nc = rcu_dereference(connection->net_conf);
-	addr2_enabled = nc->my_addr2_len > 0;
+	strcpy(transport_name, nc->transport_name);
 	rcu_read_unlock();
+	transport = drbd_get_transport(transport_name);
+	if (!transport) {
+		drbd_err(connection, "transport %s not available\n", transport_name);
+		return -1;
+	}
+	/* both streams are down, only debugfs may still look at the old one */
+	if (transport != connection->transport) {
+		struct drbd_transport_ops *old = connection->transport;
 
-	if (prepare_listen_socket(connection, &ad))
-		return 0;
-
-	do {
-		struct socket *s = NULL;
-
-		switch (ad.using_addr) {
-		case 0:
-			s = drbd_try_connect(connection, false);
-			if (!s && addr2_enabled)
-				s = drbd_try_connect(connection, true);
-			break;
-		case 1:
-			s = drbd_try_connect(connection, false);
-			break;
-		case 2:
-			s = drbd_try_connect(connection, true);
-			break;
-		}
-
-		if (s) {
-			if (!sock.socket) {
-				sock.socket = s;
-				send_first_packet(connection, &sock, P_INITIAL_DATA);
-			} else if (!msock.socket) {
-				clear_bit(RESOLVE_CONFLICTS, &connection->flags);
-				msock.socket = s;
-				send_first_packet(connection, &msock, P_INITIAL_META);
-			} else {
-				drbd_err(connection, "Logic error in conn_connect()\n");
-				goto out_release_sockets;
-			}
-		}
-
-		if (connection_established(connection, &sock.socket, &msock.socket))
-			break;
-
-retry:
-		s = drbd_wait_for_connect(connection, &ad);
-		if (s) {
-			int fp = receive_first_packet(connection, s);
-			drbd_socket_okay(&sock.socket);
-			drbd_socket_okay(&msock.socket);
-			switch (fp) {
-			case P_INITIAL_DATA:
-				if (sock.socket) {
-					drbd_warn(connection, "initial packet S crossed\n");
-					sock_release(sock.socket);
-					sock.socket = s;
-					goto randomize;
-				}
-				sock.socket = s;
-				break;
-			case P_INITIAL_META:
-				set_bit(RESOLVE_CONFLICTS, &connection->flags);
-				if (msock.socket) {
-					drbd_warn(connection, "initial packet M crossed\n");
-					sock_release(msock.socket);
-					msock.socket = s;
-					goto randomize;
-				}
-				msock.socket = s;
-				break;
-			default:
-				drbd_warn(connection, "Error receiving initial packet\n");
-				sock_release(s);
-randomize:
-				if (prandom_u32() & 1)
-					goto retry;
-			}
-		}
-
-		if (connection->cstate <= C_DISCONNECTING)
-			goto out_release_sockets;
-		if (signal_pending(current)) {
-			flush_signals(current);
-			smp_rmb();
-			if (get_t_state(&connection->receiver) == EXITING)
-				goto out_release_sockets;
-		}
-
-		ok = connection_established(connection, &sock.socket, &msock.socket);
-	} while (!ok);
-
-	if (ad.s_listen)
-		sock_release(ad.s_listen);
-	if (ad.s_listen2)
-		sock_release(ad.s_listen2);
-
-	sock.socket->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
-	msock.socket->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
-
-	sock.socket->sk->sk_allocation = GFP_NOIO;
-	msock.socket->sk->sk_allocation = GFP_NOIO;
+		rcu_assign_pointer(connection->transport, transport);
+		synchronize_rcu();
+		drbd_put_transport(old);
+	} else
+		drbd_put_transport(transport);
+	memset(&connection->data.stats, 0, sizeof(connection->data.stats));
+	memset(&connection->meta.stats, 0, sizeof(connection->meta.stats));
 
-	sock.socket->sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
-	msock.socket->sk->sk_priority = TC_PRIO_INTERACTIVE;
+	h = transport->connect(connection);
+	if (h <= 0)
+		return h;
 
 	/* NOT YET ...
-	 * sock.socket->sk->sk_sndtimeo = connection->net_conf->timeout*HZ/10;
-	 * sock.socket->sk->sk_rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+	 * data sndtimeo = connection->net_conf->timeout*HZ/10;
+	 * data rcvtimeo = MAX_SCHEDULE_TIMEOUT;
 	 * first set it to the P_CONNECTION_FEATURES timeout,
 	 * which we set to 4x the configured ping_timeout. */
 	rcu_read_lock();
 	nc = rcu_dereference(connection->net_conf);
 
-	sock.socket->sk->sk_sndtimeo =
-	sock.socket->sk->sk_rcvtimeo = nc->ping_timeo*4*HZ/10;
+	transport->set_sndtimeo(&connection->data, nc->ping_timeo*4*HZ/10);
+	transport->set_rcvtimeo(&connection->data, nc->ping_timeo*4*HZ/10);
 
-	msock.socket->sk->sk_rcvtimeo = nc->ping_int*HZ;
+	transport->set_rcvtimeo(&connection->meta, nc->ping_int*HZ);
 	timeout = nc->timeout * HZ / 10;
 	discard_my_data = nc->discard_my_data;
 	rcu_read_unlock();
 
-	msock.socket->sk->sk_sndtimeo = timeout;
+	transport->set_sndtimeo(&connection->meta, timeout);
 
 	/* we don't want delays.
 	 * we use TCP_CORK where appropriate, though */
-	drbd_tcp_nodelay(sock.socket);
-	drbd_tcp_nodelay(msock.socket);
+	transport->hint(&connection->data, DRBD_HINT_NODELAY);
+	transport->hint(&connection->meta, DRBD_HINT_NODELAY);
+
+	/* without a backing device on a known node, stay close to the NIC */
+	if (transport->numa_node && connection->resource->numa_node == NUMA_NO_NODE)
+		drbd_set_numa_node(connection->resource,
+				   transport->numa_node(&connection->data));
 
-	connection->data.socket = sock.socket;
-	connection->meta.socket = msock.socket;
 	connection->last_received = jiffies;
 
 	h = drbd_do_features(connection);
@@ -1218,8 +794,8 @@ randomize:
 		}
 	}
 
-	connection->data.socket->sk->sk_sndtimeo = timeout;
-	connection->data.socket->sk->sk_rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+	transport->set_sndtimeo(&connection->data, timeout);
+	transport->set_rcvtimeo(&connection->data, MAX_SCHEDULE_TIMEOUT);
 
 	if (drbd_send_protocol(connection) == -EOPNOTSUPP)
 		return -1;
@@ -1285,17 +861,6 @@ randomize:
 	mutex_unlock(&connection->resource->conf_update);
 
 	return h;
-
-out_release_sockets:
-	if (ad.s_listen)
-		sock_release(ad.s_listen);
-	if (ad.s_listen2)
-		sock_release(ad.s_listen2);
-	if (sock.socket)
-		sock_release(sock.socket);
-	if (msock.socket)
-		sock_release(msock.socket);
-	return -1;
 }
 
 static int decode_header(struct drbd_connection *connection, void *header, struct packet_info *pi)
@@ -1383,14 +948,14 @@ static int drbd_recv_header_maybe_unplug(struct drbd_connection *connection, str
 	unsigned int size = drbd_header_size(connection);
 	int err;
 
-	err = drbd_recv_short(connection->data.socket, buffer, size, MSG_NOSIGNAL|MSG_DONTWAIT);
+	err = drbd_recv_short(connection, &connection->data, buffer, size, MSG_NOSIGNAL|MSG_DONTWAIT);
 	if (err != size) {
 		/* If we have nothing in the receive buffer now, to reduce
 		 * application latency, try to drain the backend queues as
 		 * quickly as possible, and let remote TCP know what we have
 		 * received so far. */
 		if (err == -EAGAIN) {
-			drbd_tcp_quickack(connection->data.socket);
+			drbd_stream_hint(connection, &connection->data, DRBD_HINT_QUICKACK);
 			drbd_unplug_all_devices(connection);
 		}
 		if (err > 0) {
@@ -2157,7 +1722,7 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 	struct p_barrier *p = pi->data;
 	struct drbd_epoch *epoch;
 
-	drbd_tcp_quickack(connection->data.socket);
+	drbd_stream_hint(connection, &connection->data, DRBD_HINT_QUICKACK);
 	drbd_unplug_all_devices(connection);
 
 	/* FIXME these are unacked on connection,
@@ -2267,8 +1832,9 @@ read_in_block(struct drbd_peer_device *peer_device, u64 id, sector_t sector,
 	struct p_trim *wsame = (pi->cmd == P_WSAME) ? pi->data : NULL;
 
 	digest_size = 0;
-	if (!trim && peer_device->connection->peer_integrity_tfm) {
-		digest_size = crypto_ahash_digestsize(peer_device->connection->peer_integrity_tfm);
+	if (!trim)
+		digest_size = drbd_peer_digest_size(peer_device->connection, pi->data);
+	if (digest_size) {
 		/*
 		 * FIXME: Receive the incoming digest into the receive buffer
 		 *	  here, together with its struct p_data?
@@ -2353,7 +1919,9 @@ read_in_block(struct drbd_peer_device *peer_device, u64 id, sector_t sector,
 
 	if (digest_size) {
 		drbd_csum_ee_size(peer_device->connection->peer_integrity_tfm, peer_req, dig_vv, data_size);
+		peer_device->connection->integrity_checked++;
 		if (memcmp(dig_in, dig_vv, digest_size)) {
+			peer_device->connection->integrity_failed++;
 			drbd_err(device, "Digest integrity check FAILED: %llus +%u\n",
 				(unsigned long long)sector, data_size);
 			drbd_free_peer_req(device, peer_req);
@@ -2393,7 +1961,7 @@ static int drbd_drain_block(struct drbd_peer_device *peer_device, int data_size)
 }
 
 static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_request *req,
-			   sector_t sector, int data_size)
+			   sector_t sector, struct packet_info *pi)
 {
 	DRBD_BIO_VEC_TYPE bvec;
 	DRBD_ITER_TYPE iter;
@@ -2401,10 +1969,10 @@ static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_req
 	int digest_size, err, expect;
 	void *dig_in = peer_device->connection->int_dig_in;
 	void *dig_vv = peer_device->connection->int_dig_vv;
+	int data_size = pi->size;
 
-	digest_size = 0;
-	if (peer_device->connection->peer_integrity_tfm) {
-		digest_size = crypto_ahash_digestsize(peer_device->connection->peer_integrity_tfm);
+	digest_size = drbd_peer_digest_size(peer_device->connection, pi->data);
+	if (digest_size) {
 		err = drbd_recv_all_warn(peer_device->connection, dig_in, digest_size);
 		if (err)
 			return err;
@@ -2430,7 +1998,9 @@ static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_req
 
 	if (digest_size) {
 		drbd_csum_bio(peer_device->connection->peer_integrity_tfm, bio, dig_vv);
+		peer_device->connection->integrity_checked++;
 		if (memcmp(dig_in, dig_vv, digest_size)) {
+			peer_device->connection->integrity_failed++;
 			drbd_err(peer_device, "Digest integrity check FAILED. Broken NICs?\n");
 			return -EINVAL;
 		}
@@ -2513,12 +2083,20 @@ static struct drbd_request *
 find_request(struct drbd_device *device, struct rb_root *root, u64 id,
 	     sector_t sector, bool missing_ok, const char *func)
 {
+	struct drbd_request *wanted = (struct drbd_request *)(unsigned long)id;
+	const bool write = root == &device->write_requests;
 	struct drbd_request *req;
 
-	/* Request object according to our peer */
-	req = (struct drbd_request *)(unsigned long)id;
-	if (drbd_contains_interval(root, sector, &req->i) && req->i.local)
-		return req;
+	/* Request object according to our peer.  Do not dereference it
+	 * before we found it on our hash of pending requests. */
+	hlist_for_each_entry(req, drbd_req_hash_slot(device, wanted), req_hash) {
+		if (req != wanted)
+			continue;
+		if (req->i.sector == sector && req->i.local &&
+		    !!(req->rq_state & RQ_WRITE) == write)
+			return req;
+		break;
+	}
 	if (!missing_ok) {
 		drbd_err(device, "%s: failed to find request 0x%lx, sector %llus\n", func,
 			(unsigned long)id, (unsigned long long)sector);
@@ -2551,7 +2129,7 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 	/* drbd_remove_request_interval() is done in _req_may_be_done, to avoid
 	 * special casing it there for the various failure cases.
 	 * still no race with drbd_fail_pending_reads */
-	err = recv_dless_read(peer_device, req, sector, pi->size);
+	err = recv_dless_read(peer_device, req, sector, pi);
 	if (!err)
 		req_mod(req, DATA_RECEIVED);
 	/* else: nothing. handled from drbd_disconnect...
@@ -5004,6 +4582,19 @@ static int receive_state(struct drbd_connection *connection, struct packet_info
 	return 0;
 }
 
+static int receive_bm_token(struct drbd_connection *connection, struct packet_info *pi)
+{
+	struct drbd_peer_device *peer_device;
+	struct p_bm_token *p = pi->data;
+
+	peer_device = conn_peer_device(connection, pi->vnr);
+	if (!peer_device)
+		return -EIO;
+
+	peer_device->device->peer_bm_token = be64_to_cpu(p->token);
+	return 0;
+}
+
 static int receive_sync_uuid(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_device *peer_device;
@@ -5028,6 +4619,7 @@ static int receive_sync_uuid(struct drbd_connection *connection, struct packet_i
 	if (get_ldev_if_state(device, D_NEGOTIATING)) {
 		_drbd_uuid_set(device, UI_CURRENT, be64_to_cpu(p->uuid));
 		_drbd_uuid_set(device, UI_BITMAP, 0UL);
+		drbd_bm_xchg_commit(device, be64_to_cpu(p->uuid));
 
 		drbd_print_uuids(device, "updated sync uuid");
 		drbd_start_resync(device, C_SYNC_TARGET);
@@ -5160,6 +4752,56 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 	return (s != c->bm_bits);
 }
 
+/**
+ * recv_bm_rice_bits
+ *
+ * Return 0 when done, 1 when another iteration is needed, and a negative error
+ * code upon failure.
+ */
+static int
+recv_bm_rice_bits(struct drbd_peer_device *peer_device,
+		struct p_compressed_bm *p,
+		 struct bm_xfer_ctx *c,
+		 unsigned int len)
+{
+	struct bitstream bs;
+	struct rice_state rice[2];
+	unsigned long s = c->bit_offset;
+	int toggle = dcbp_get_start(p);
+	u64 k, rl;
+	int i;
+
+	bitstream_init(&bs, p->code, len, dcbp_get_pad_bits(p));
+
+	/* initial parameters, [0] clear, [1] set runs */
+	for (i = 0; i < 2; i++) {
+		if (bitstream_get_bits(&bs, &k, RICE_K_BITS) != RICE_K_BITS || k > RICE_K_MAX)
+			return -EIO;
+		rice_init(&rice[i], k);
+	}
+
+	for (; bitstream_bits_left(&bs) > 0; s += rl, toggle = !toggle) {
+		if (rice_decode_bits(&bs, &rice[toggle], &rl) < 0) {
+			drbd_err(peer_device, "bitmap decoding error: l:%u/%u\n",
+				(unsigned int)(bs.cur.b - p->code),
+				(unsigned int)bs.buf_len);
+			return -EIO;
+		}
+		if (rl > c->bm_bits - s) {
+			drbd_err(peer_device, "bitmap overflow (s:%lu rl:%llu) while decoding bm Rice packet\n",
+				s, rl);
+			return -EIO;
+		}
+		if (toggle)
+			_drbd_bm_set_bits(peer_device->device, s, s + rl - 1);
+	}
+
+	c->bit_offset = s;
+	bm_xfer_ctx_bit_to_word_offset(c);
+
+	return (s != c->bm_bits);
+}
+
 /**
  * decode_bitmap_c
  *
@@ -5174,6 +4816,12 @@ decode_bitmap_c(struct drbd_peer_device *peer_device,
 {
 	if (dcbp_get_code(p) == RLE_VLI_Bits)
 		return recv_bm_rle_bits(peer_device, p, c, len - sizeof(*p));
+	if (dcbp_get_code(p) == RLE_Rice_Bits &&
+	    peer_device->connection->agreed_features & DRBD_FF_BM_RICE) {
+		c->rice_packets++;
+		c->rice_bytes += drbd_header_size(peer_device->connection) + len;
+		return recv_bm_rice_bits(peer_device, p, c, len - sizeof(*p));
+	}
 
 	/* other variants had been implemented for evaluation,
 	 * but have been dropped as this one turned out to be "best"
@@ -5218,6 +4866,11 @@ void INFO_bm_xfer_stats(struct drbd_device *device,
 			c->bytes[1], c->packets[1],
 			c->bytes[0], c->packets[0],
 			total, r/10, r % 10);
+	if (c->rice_packets)
+		drbd_info(device, "%s bitmap stats: of the RLE, Golomb-Rice coded %u(%u), VLI coded %u(%u)\n",
+			direction,
+			c->rice_bytes, c->rice_packets,
+			c->bytes[0] - c->rice_bytes, c->packets[0] - c->rice_packets);
 }
 
 /* Since we are processing the bitfield from lower addresses to higher,
@@ -5328,7 +4981,7 @@ static int receive_UnplugRemote(struct drbd_connection *connection, struct packe
 {
 	/* Make sure we've acked all the TCP data associated
 	 * with the data requests being unplugged */
-	drbd_tcp_quickack(connection->data.socket);
+	drbd_stream_hint(connection, &connection->data, DRBD_HINT_QUICKACK);
 
 	/* just unplug all devices always, regardless which volume number */
 	drbd_unplug_all_devices(connection);
@@ -5452,6 +5105,7 @@ static struct data_cmd drbd_cmd_handler[] = {
 	[P_STATE]	    = { 0, sizeof(struct p_state), receive_state },
 	[P_STATE_CHG_REQ]   = { 0, sizeof(struct p_req_state), receive_req_state },
 	[P_SYNC_UUID]       = { 0, sizeof(struct p_rs_uuid), receive_sync_uuid },
+	[P_BM_TOKEN]        = { 0, sizeof(struct p_bm_token), receive_bm_token },
 	[P_OV_REQUEST]      = { 0, sizeof(struct p_block_req), receive_DataRequest },
 	[P_OV_REPLY]        = { 1, sizeof(struct p_block_req), receive_DataRequest },
 	[P_CSUM_RS_REQUEST] = { 1, sizeof(struct p_block_req), receive_DataRequest },
@@ -5522,14 +5176,32 @@ static void drbdd(struct drbd_connection *connection)
 	conn_request_state(connection, NS(conn, C_PROTOCOL_ERROR), CS_HARD);
 }
 
+/* A network failure, or a failed attempt to re-establish the connection,
+ * as opposed to a disconnect or a protocol error */
+static bool conn_lost_transiently(enum drbd_conns cstate)
+{
+	switch (cstate) {
+	case C_TIMEOUT:
+	case C_BROKEN_PIPE:
+	case C_NETWORK_FAILURE:
+	case C_WF_CONNECTION:
+	case C_WF_REPORT_PARAMS:
+		return true;
+	default:
+		return false;
+	}
+}
+
 static void conn_disconnect(struct drbd_connection *connection)
 {
 	struct drbd_peer_device *peer_device;
 	enum drbd_conns oc;
+	bool transient;
 	int vnr;
 
 	if (connection->cstate == C_STANDALONE)
 		return;
+	transient = conn_lost_transiently(connection->cstate);
 
 	/* We are about to start the cleanup after connection loss.
 	 * Make sure drbd_make_request knows about that.
@@ -5566,6 +5238,16 @@ static void conn_disconnect(struct drbd_connection *connection)
 
 	drbd_info(connection, "Connection closed\n");
 
+	/* Keep a held session until resume-timeout, from the first network
+	 * failure on; the next handshake may still resume it. */
+	clear_bit(SESSION_RESUMING, &connection->flags);
+	if (connection->resource->susp_res) {
+		if (transient && time_before(jiffies, connection->resume_deadline))
+			mod_timer(&connection->resume_timer, connection->resume_deadline);
+		else
+			conn_session_lost(connection);
+	}
+
 	if (conn_highest_role(connection) == R_PRIMARY && conn_highest_pdsk(connection) >= D_UNKNOWN)
 		conn_try_outdate_peer_async(connection);
 
@@ -5611,10 +5293,12 @@ static int drbd_disconnected(struct drbd_peer_device *peer_device)
 	del_timer_sync(&device->resync_timer);
 	resync_timer_fn((unsigned long)device);
 
-	/* wait for all w_e_end_data_req, w_e_end_rsdata_req, w_send_barrier,
-	 * w_make_resync_request etc. which may still be on the worker queue
-	 * to be "canceled" */
+	/* wait for all w_e_end_data_req, w_e_end_rsdata_req,
+	 * w_make_resync_request etc. which may still be on the worker queue,
+	 * and all w_send_dblock, w_send_read_req, w_send_out_of_sync which may
+	 * still be on the sender queue, to be "canceled" */
 	drbd_flush_workqueue(&peer_device->connection->sender_work);
+	drbd_flush_data_work(peer_device->connection);
 
 	drbd_finish_peer_reqs(device);
 
@@ -5622,6 +5306,7 @@ static int drbd_disconnected(struct drbd_peer_device *peer_device)
 	   might have issued a work again. The one before drbd_finish_peer_reqs() is
 	   necessary to reclain net_ee in drbd_finish_peer_reqs(). */
 	drbd_flush_workqueue(&peer_device->connection->sender_work);
+	drbd_flush_data_work(peer_device->connection);
 
 	/* need to do it again, drbd_finish_peer_reqs() may have populated it
 	 * again via drbd_try_clear_on_disk_bm(). */
@@ -5666,6 +5351,16 @@ static int drbd_disconnected(struct drbd_peer_device *peer_device)
 	return 0;
 }
 
+static u32 conn_offered_features(struct drbd_connection *connection)
+{
+	struct drbd_transport_ops *transport = connection->transport;
+	u32 features = PRO_FEATURES | transport->features;
+
+	if (transport->offered_features)
+		features |= transport->offered_features(connection);
+	return features;
+}
+
 /*
  * We support PRO_VERSION_MIN to PRO_VERSION_MAX. The protocol version
  * we can agree on is stored in agreed_pro_version.
@@ -5687,7 +5382,8 @@ static int drbd_send_features(struct drbd_connection *connection)
 	memset(p, 0, sizeof(*p));
 	p->protocol_min = cpu_to_be32(PRO_VERSION_MIN);
 	p->protocol_max = cpu_to_be32(PRO_VERSION_MAX);
-	p->feature_flags = cpu_to_be32(PRO_FEATURES);
+	p->feature_flags = cpu_to_be32(conn_offered_features(connection));
+	p->session = cpu_to_be64(connection->my_session);
 	return conn_send_command(connection, sock, P_CONNECTION_FEATURES, sizeof(*p), NULL, 0);
 }
 
@@ -5704,8 +5400,20 @@ static int drbd_do_features(struct drbd_connection *connection)
 	struct p_connection_features *p;
 	const int expect = sizeof(struct p_connection_features);
 	struct packet_info pi;
+	bool resuming;
+	u64 peer_session;
 	int err;
 
+	/* While a session is held, offer to resume it; else start a new one */
+	spin_lock_irq(&connection->resource->req_lock);
+	resuming = connection->resource->susp_res &&
+		time_before(jiffies, connection->resume_deadline);
+	if (resuming)
+		set_bit(SESSION_RESUMING, &connection->flags);
+	spin_unlock_irq(&connection->resource->req_lock);
+	if (!resuming)
+		get_random_bytes(&connection->my_session, sizeof(connection->my_session));
+
 	err = drbd_send_features(connection);
 	if (err)
 		return 0;
@@ -5741,15 +5449,34 @@ static int drbd_do_features(struct drbd_connection *connection)
 		goto incompat;
 
 	connection->agreed_pro_version = min_t(int, PRO_VERSION_MAX, p->protocol_max);
-	connection->agreed_features = PRO_FEATURES & be32_to_cpu(p->feature_flags);
+	connection->agreed_features = conn_offered_features(connection) &
+		be32_to_cpu(p->feature_flags);
+	if (connection->transport->features_agreed)
+		connection->transport->features_agreed(connection);
+
+	/* The peer resumes as well only if it still has our session, too */
+	peer_session = be64_to_cpu(p->session);
+	if (resuming && (!(connection->agreed_features & DRBD_FF_SESSION_RESUME) ||
+			 peer_session != connection->peer_session)) {
+		drbd_info(connection, "Peer has a new session, not resuming\n");
+		conn_session_lost(connection);
+	}
+	connection->peer_session = peer_session;
 
 	drbd_info(connection, "Handshake successful: "
 	     "Agreed network protocol version %d\n", connection->agreed_pro_version);
 
-	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s.\n",
+	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s%s%s%s%s%s%s.\n",
 		  connection->agreed_features,
 		  connection->agreed_features & DRBD_FF_TRIM ? " TRIM" : "",
 		  connection->agreed_features & DRBD_FF_THIN_RESYNC ? " THIN_RESYNC" : "",
+		  connection->agreed_features & DRBD_FF_ACK_BATCH ? " ACK_BATCH" : "",
+		  connection->agreed_features & DRBD_FF_BM_RICE ? " BM_RICE" : "",
+		  connection->agreed_features & DRBD_FF_BM_DELTA ? " BM_DELTA" : "",
+		  connection->agreed_features & DRBD_FF_INTEGRITY_SAMPLE ? " INTEGRITY_SAMPLE" : "",
+		  connection->agreed_features & DRBD_FF_PAGE_PASSING ? " PAGE_PASSING" : "",
+		  connection->agreed_features & DRBD_FF_MULTIPATH ? " MULTIPATH" : "",
+		  connection->agreed_features & DRBD_FF_SESSION_RESUME ? " SESSION_RESUME" : "",
 		  connection->agreed_features & DRBD_FF_WSAME ? " WRITE_SAME" :
 		  connection->agreed_features ? "" : " none");
 
@@ -6140,6 +5867,71 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 					     what, false);
 }
 
+static int got_AckBatch(struct drbd_connection *connection, struct packet_info *pi)
+{
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
+	struct p_ack_batch *p = pi->data;
+	unsigned int count = be16_to_cpu(p->count);
+	struct bio_and_error m[16];
+	enum drbd_req_event what;
+	unsigned int i, nr_bios, j;
+	u32 seq;
+	int err = 0;
+
+	if (pi->size != sizeof(*p) + count * sizeof(p->acks[0]))
+		return -EIO;
+
+	peer_device = conn_peer_device(connection, pi->vnr);
+	if (!peer_device)
+		return -EIO;
+	device = peer_device->device;
+
+	switch (be16_to_cpu(p->command)) {
+	case P_WRITE_ACK:
+		what = WRITE_ACKED_BY_PEER;
+		break;
+	case P_RECV_ACK:
+		what = RECV_ACKED_BY_PEER;
+		break;
+	default:
+		return -EIO;
+	}
+
+	if (!count)
+		return 0;
+	seq = be32_to_cpu(p->acks[0].seq_num);
+	for (i = 1; i < count; i++)
+		seq = seq_max(seq, be32_to_cpu(p->acks[i].seq_num));
+	update_peer_seq(peer_device, seq);
+
+	/* like validate_req_change_req_state(), but for many requests per
+	 * lock round trip; master bios are completed outside the lock */
+	for (i = 0; i < count && !err; ) {
+		nr_bios = 0;
+		spin_lock_irq(&device->resource->req_lock);
+		for (; i < count && nr_bios < ARRAY_SIZE(m); i++) {
+			struct p_block_ack *a = &p->acks[i];
+			struct drbd_request *req;
+
+			req = find_request(device, &device->write_requests, a->block_id,
+					   be64_to_cpu(a->sector), false, __func__);
+			if (unlikely(!req)) {
+				err = -EIO;
+				break;
+			}
+			__req_mod(req, what, &m[nr_bios]);
+			if (m[nr_bios].bio)
+				nr_bios++;
+		}
+		spin_unlock_irq(&device->resource->req_lock);
+
+		for (j = 0; j < nr_bios; j++)
+			complete_master_bio(device, &m[j]);
+	}
+	return err;
+}
+
 static int got_NegAck(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_device *peer_device;
@@ -6316,8 +6108,9 @@ static int got_skip(struct drbd_connection *connection, struct packet_info *pi)
 }
 
 struct meta_sock_cmd {
-	size_t pkt_size;
+	size_t pkt_size;	/* minimum size, if var_size */
 	int (*fn)(struct drbd_connection *connection, struct packet_info *);
+	bool var_size;
 };
 
 static void set_rcvtimeo(struct drbd_connection *connection, bool ping_timeout)
@@ -6334,7 +6127,7 @@ static void set_rcvtimeo(struct drbd_connection *connection, bool ping_timeout)
 	if (ping_timeout)
 		t /= 10;
 
-	connection->meta.socket->sk->sk_rcvtimeo = t;
+	connection->transport->set_rcvtimeo(&connection->meta, t);
 }
 
 static void set_ping_timeout(struct drbd_connection *connection)
@@ -6365,6 +6158,7 @@ static struct meta_sock_cmd ack_receiver_tbl[] = {
 	[P_RS_CANCEL]       = { sizeof(struct p_block_ack), got_NegRSDReply },
 	[P_CONN_ST_CHG_REPLY]={ sizeof(struct p_req_state_reply), got_conn_RqSReply },
 	[P_RETRY_WRITE]	    = { sizeof(struct p_block_ack), got_BlockAck },
+	[P_ACK_BATCH]	    = { sizeof(struct p_ack_batch), got_AckBatch, true },
 };
 
 int drbd_ack_receiver(struct drbd_thread *thi)
@@ -6400,7 +6194,7 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 		}
 
 		pre_recv_jif = jiffies;
-		rv = drbd_recv_short(connection->meta.socket, buf, expect-received, 0);
+		rv = drbd_recv_short(connection, &connection->meta, buf, expect-received, 0);
 
 		/* Note:
 		 * -EINTR	 (on meta) we got a signal
@@ -6436,6 +6230,16 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 			if (time_after(connection->last_received, pre_recv_jif))
 				continue;
 			if (ping_timeout_active) {
+				struct drbd_transport_ops *transport = connection->transport;
+
+				if (transport->failover &&
+				    transport->failover(connection, &connection->meta)) {
+					drbd_warn(connection, "PingAck did not arrive in time, "
+						  "continuing on another path.\n");
+					ping_timeout_active = false;
+					set_bit(SEND_PING, &connection->flags);
+					continue;
+				}
 				drbd_err(connection, "PingAck did not arrive in time.\n");
 				goto reconnect;
 			}
@@ -6462,6 +6266,9 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 				goto disconnect;
 			}
 			expect = header_size + cmd->pkt_size;
+			if (cmd->var_size && pi.size >= cmd->pkt_size &&
+			    pi.size <= DRBD_SOCKET_BUFFER_SIZE - header_size)
+				expect = header_size + pi.size;
 			if (pi.size != expect - header_size) {
 				drbd_err(connection, "Wrong packet size on meta (c: %d, l: %d)\n",
 					pi.cmd, pi.size);
@@ -6521,7 +6328,7 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	rcu_read_unlock();
 
 	if (tcp_cork)
-		drbd_tcp_cork(connection->meta.socket);
+		drbd_stream_hint(connection, &connection->meta, DRBD_HINT_CORK);
 
 	err = drbd_finish_peer_reqs(device);
 	kref_put(&device->kref, drbd_destroy_device);
@@ -6534,7 +6341,7 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	}
 
 	if (tcp_cork)
-		drbd_tcp_uncork(connection->meta.socket);
+		drbd_stream_hint(connection, &connection->meta, DRBD_HINT_UNCORK);
 
 	return;
 }
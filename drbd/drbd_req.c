@@ -34,45 +34,66 @@
 
 static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector, int size);
 
+/* Disk stats are kept per master bio, a request with discards merged into
+ * it (req->merged_bios) accounts for each of them. */
 #ifndef __disk_stat_inc
 /* Update disk stats at start of I/O request */
-static void _drbd_start_io_acct(struct drbd_device *device, struct drbd_request *req)
+static void _drbd_start_io_acct(struct drbd_device *device, struct bio *bio)
 {
-	generic_start_io_acct(bio_data_dir(req->master_bio), req->i.size >> 9,
+	generic_start_io_acct(bio_data_dir(bio), DRBD_BIO_BI_SIZE(bio) >> 9,
 			      &device->vdisk->part0);
 }
 
 /* Update disk stats when completing request upwards */
-static void _drbd_end_io_acct(struct drbd_device *device, struct drbd_request *req)
+static void _drbd_end_io_acct(struct drbd_device *device, struct bio *bio,
+			      unsigned long start_jif)
 {
-	generic_end_io_acct(bio_data_dir(req->master_bio),
-			    &device->vdisk->part0, req->start_jif);
+	generic_end_io_acct(bio_data_dir(bio),
+			    &device->vdisk->part0, start_jif);
 }
 #else
-static void _drbd_start_io_acct(struct drbd_device *device, struct drbd_request *req)
+static void _drbd_start_io_acct(struct drbd_device *device, struct bio *bio)
 {
-	const int rw = bio_data_dir(req->master_bio);
+	const int rw = bio_data_dir(bio);
 	BUILD_BUG_ON(sizeof(atomic_t) != sizeof(device->vdisk->in_flight));
 	disk_stat_inc(device->vdisk, ios[rw]);
-	disk_stat_add(device->vdisk, sectors[rw], req->i.size >> 9);
+	disk_stat_add(device->vdisk, sectors[rw], DRBD_BIO_BI_SIZE(bio) >> 9);
 	disk_round_stats(device->vdisk);
 	atomic_inc((atomic_t*)&device->vdisk->in_flight);
 }
-static void _drbd_end_io_acct(struct drbd_device *device, struct drbd_request *req)
+static void _drbd_end_io_acct(struct drbd_device *device, struct bio *bio,
+			      unsigned long start_jif)
 {
-	const int rw = bio_data_dir(req->master_bio);
-	unsigned long duration = jiffies - req->start_jif;
+	const int rw = bio_data_dir(bio);
+	unsigned long duration = jiffies - start_jif;
 	disk_stat_add(device->vdisk, ticks[rw], duration);
 	disk_round_stats(device->vdisk);
 	atomic_dec((atomic_t*)&device->vdisk->in_flight);
 }
 #endif
 
+/* Feed the DRBD_PERF_STATISTICS broadcast, see drbd_bcast_perf_stats().
+ * Must hold resource->req_lock. */
+static void _drbd_perf_account(struct drbd_device *device, struct drbd_request *req)
+{
+	struct drbd_perf_counters *p = &device->perf;
+	const int rw = bio_data_dir(req->master_bio) == WRITE;
+	s64 usecs = ktime_to_us(ktime_sub(ktime_get(), req->start_kt));
+	int bucket = usecs > 0 ? fls64(usecs) : 0;
+
+	if (bucket >= DRBD_LAT_HIST_BUCKETS)
+		bucket = DRBD_LAT_HIST_BUCKETS - 1;
+	p->ios[rw]++;
+	p->bytes[rw] += req->i.size;
+	p->lat_hist[rw][bucket]++;
+}
+
 static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio *bio_src)
 {
 	struct drbd_request *req;
 
-	req = mempool_alloc(drbd_request_mempool, GFP_NOIO);
+	req = drbd_mempool_alloc_node(drbd_request_mempool, drbd_request_cache,
+				      GFP_NOIO, device->resource->numa_node);
 	if (!req)
 		return NULL;
 	memset(req, 0, sizeof(*req));
@@ -95,6 +116,7 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 	INIT_LIST_HEAD(&req->w.list);
 	INIT_LIST_HEAD(&req->req_pending_master_completion);
 	INIT_LIST_HEAD(&req->req_pending_local);
+	INIT_HLIST_NODE(&req->req_hash);
 
 	/* one reference to be put by __drbd_make_request */
 	atomic_set(&req->completion_ref, 1);
@@ -103,6 +125,13 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 	return req;
 }
 
+static void drbd_insert_request_interval(struct rb_root *root,
+					 struct drbd_request *req)
+{
+	drbd_insert_interval(root, &req->i);
+	hlist_add_head(&req->req_hash, drbd_req_hash_slot(req->device, req));
+}
+
 static void drbd_remove_request_interval(struct rb_root *root,
 					 struct drbd_request *req)
 {
@@ -110,6 +139,7 @@ static void drbd_remove_request_interval(struct rb_root *root,
 	struct drbd_interval *i = &req->i;
 
 	drbd_remove_interval(root, i);
+	hlist_del_init(&req->req_hash);
 
 	/* Wake up any processes waiting for this request to complete.  */
 	if (i->waiting)
@@ -200,11 +230,12 @@ void drbd_req_destroy(struct kref *kref)
 		}
 	}
 
+	kfree(req->digest);
 	mempool_free(req, drbd_request_mempool);
 }
 
 static void wake_all_senders(struct drbd_connection *connection) {
-	wake_up(&connection->sender_work.q_wait);
+	wake_up(&connection->data_work.q_wait);
 }
 
 /* must hold resource->req_lock */
@@ -222,8 +253,19 @@ void start_new_tl_epoch(struct drbd_connection *connection)
 void complete_master_bio(struct drbd_device *device,
 		struct bio_and_error *m)
 {
+	struct bio *bio = m->merged;
+
 	bio_endio(m->bio, m->error);
 	dec_ap_bio(device);
+
+	while (bio) {
+		struct bio *next = bio->bi_next;
+
+		bio->bi_next = NULL;
+		bio_endio(bio, m->error);
+		dec_ap_bio(device);
+		bio = next;
+	}
 }
 
 
@@ -238,6 +280,7 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 {
 	const unsigned s = req->rq_state;
 	struct drbd_device *device = req->device;
+	struct bio *bio;
 	int error, ok;
 
 	/* we must not complete the master bio, while it is
@@ -289,7 +332,10 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 		start_new_tl_epoch(first_peer_device(device)->connection);
 
 	/* Update disk stats */
-	_drbd_end_io_acct(device, req);
+	_drbd_end_io_acct(device, req->master_bio, req->start_jif);
+	for (bio = req->merged_bios; bio; bio = bio->bi_next)
+		_drbd_end_io_acct(device, bio, req->start_jif);
+	_drbd_perf_account(device, req);
 
 	/* If READ failed,
 	 * have it be pushed back to the retry work queue,
@@ -314,7 +360,9 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 	if (!(req->rq_state & RQ_POSTPONED)) {
 		m->error = ok ? 0 : (error ?: -EIO);
 		m->bio = req->master_bio;
+		m->merged = req->merged_bios;
 		req->master_bio = NULL;
+		req->merged_bios = NULL;
 		/* We leave it in the tree, to be able to verify later
 		 * write-acks in protocol != C during resync.
 		 * But we mark it as "complete", so it won't be counted as
@@ -687,7 +735,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 * Corresponding drbd_remove_request_interval is in
 		 * drbd_req_complete() */
 		D_ASSERT(device, drbd_interval_empty(&req->i));
-		drbd_insert_interval(&device->read_requests, &req->i);
+		drbd_insert_request_interval(&device->read_requests, req);
 
 		set_bit(UNPLUG_REMOTE, &device->flags);
 
@@ -695,7 +743,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		D_ASSERT(device, (req->rq_state & RQ_LOCAL_MASK) == 0);
 		mod_rq_state(req, m, 0, RQ_NET_QUEUED);
 		req->w.cb = w_send_read_req;
-		drbd_queue_work(&connection->sender_work,
+		drbd_queue_work(&connection->data_work,
 				&req->w);
 		break;
 
@@ -706,7 +754,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		/* Corresponding drbd_remove_request_interval is in
 		 * drbd_req_complete() */
 		D_ASSERT(device, drbd_interval_empty(&req->i));
-		drbd_insert_interval(&device->write_requests, &req->i);
+		drbd_insert_request_interval(&device->write_requests, req);
 
 		/* NOTE
 		 * In case the req ended up on the transfer log before being
@@ -731,7 +779,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		D_ASSERT(device, req->rq_state & RQ_NET_PENDING);
 		mod_rq_state(req, m, 0, RQ_NET_QUEUED|RQ_EXP_BARR_ACK);
 		req->w.cb =  w_send_dblock;
-		drbd_queue_work(&connection->sender_work,
+		drbd_queue_work(&connection->data_work,
 				&req->w);
 
 		/* close the epoch, in case it outgrew the limit */
@@ -747,7 +795,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 	case QUEUE_FOR_SEND_OOS:
 		mod_rq_state(req, m, 0, RQ_NET_QUEUED);
 		req->w.cb =  w_send_out_of_sync;
-		drbd_queue_work(&connection->sender_work,
+		drbd_queue_work(&connection->data_work,
 				&req->w);
 		break;
 
@@ -881,7 +929,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 			mod_rq_state(req, m, RQ_COMPLETION_SUSP, RQ_NET_QUEUED|RQ_NET_PENDING);
 			if (req->w.cb) {
 				/* w.cb expected to be w_send_dblock, or w_send_read_req */
-				drbd_queue_work(&connection->sender_work,
+				drbd_queue_work(&connection->data_work,
 						&req->w);
 				rv = req->rq_state & RQ_WRITE ? MR_WRITE : MR_READ;
 			} /* else: FIXME can this happen? */
@@ -1228,6 +1276,94 @@ static void drbd_queue_write(struct drbd_device *device, struct drbd_request *re
 	wake_up(&device->al_wait);
 }
 
+/* With data-integrity-alg, calculate the digest of a write here, in the
+ * context of the submitting process.  That way it is spread over all CPUs
+ * that submit IO, instead of all of it being done by the sender thread.
+ * Only for writes we are about to mirror; drbd_send_dblock() uses the
+ * digest, unless the algorithm changed meanwhile, or the packet goes
+ * without digest.
+ *
+ * Hashing a large bio takes a while, so we do not do that inside
+ * rcu_read_lock(); the tfm is freed only after an integrity_srcu grace
+ * period instead.  The digest is tagged with the integrity_gen read before
+ * the tfm, see conn_set_integrity_tfm(). */
+static void drbd_req_csum(struct drbd_device *device, struct drbd_request *req)
+{
+	struct drbd_connection *connection = first_peer_device(device)->connection;
+	struct crypto_ahash *tfm;
+	unsigned int gen;
+	int idx;
+
+	if (!(req->rq_state & RQ_WRITE) || (req->rq_state & RQ_UNMAP) || !req->i.size)
+		return;
+	if (!rcu_access_pointer(connection->integrity_tfm))
+		return;
+	/* not connected, Ahead, or the peer's disk is gone: nothing to send */
+	if (!drbd_should_do_remote(device->state))
+		return;
+	/* when sampling, most of them would go unused; the sender
+	 * calculates those it picks (drbd_integrity_sample()) */
+	if (drbd_integrity_sample_every(connection) > 1)
+		return;
+
+	/* 64 byte, 512 bit, is the largest digest size
+	 * currently supported in kernel crypto. */
+	req->digest = kmalloc(64, GFP_NOIO);
+	if (!req->digest)
+		return; /* the sender will calculate it, then */
+
+	gen = READ_ONCE(connection->integrity_gen);
+	smp_rmb();
+	idx = srcu_read_lock(&connection->integrity_srcu);
+	tfm = srcu_dereference(connection->integrity_tfm, &connection->integrity_srcu);
+	if (tfm && crypto_ahash_digestsize(tfm) <= 64) {
+		drbd_csum_bio(tfm, req->master_bio, req->digest);
+		req->digest_gen = gen;
+	} else {
+		kfree(req->digest);
+		req->digest = NULL;
+	}
+	srcu_read_unlock(&connection->integrity_srcu, idx);
+}
+
+/* Filesystems trim free space in runs of contiguous discards.  Merge a
+ * discard into the one queued for the submitter just before it, as long as
+ * the submitter did not pick that up yet, both have the same flags (FUA,
+ * secure erase, ...), and the result does not exceed what we announced as
+ * max_discard_sectors, which is what the peer accepts.  Pieces the block
+ * layer split at max_discard_sectors are already that large, this merges
+ * runs of smaller discards.
+ * The merged request then takes one pass through the activity log, one
+ * local discard, and one P_TRIM for the whole range.
+ * The merged bio is completed together with the request. */
+static bool drbd_merge_discard(struct drbd_device *device, struct bio *bio)
+{
+	unsigned int max_size = device->rq_queue->limits.max_discard_sectors << 9;
+	struct drbd_request *req;
+	bool merged = false;
+
+	spin_lock_irq(&device->resource->req_lock);
+	if (list_empty(&device->submit.writes))
+		goto out;
+	req = list_entry(device->submit.writes.prev, struct drbd_request, tl_requests);
+	if (!(req->rq_state & RQ_UNMAP) ||
+	    req->master_bio->bi_opf != bio->bi_opf ||
+	    req->i.sector + (req->i.size >> 9) != DRBD_BIO_BI_SECTOR(bio) ||
+	    req->i.size + DRBD_BIO_BI_SIZE(bio) > max_size)
+		goto out;
+
+	_drbd_start_io_acct(device, bio);
+	req->i.size += DRBD_BIO_BI_SIZE(bio);
+	if (req->private_bio)
+		DRBD_BIO_BI_SIZE(req->private_bio) = req->i.size;
+	bio->bi_next = req->merged_bios;
+	req->merged_bios = bio;
+	merged = true;
+out:
+	spin_unlock_irq(&device->resource->req_lock);
+	return merged;
+}
+
 /* returns the new drbd_request pointer, if the caller is expected to
  * drbd_send_and_submit() it (to save latency), or NULL if we queued the
  * request on the submitter thread.
@@ -1239,6 +1375,9 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio, unsigned long
 	const int rw = bio_data_dir(bio);
 	struct drbd_request *req;
 
+	if (bio_op(bio) == REQ_OP_DISCARD && drbd_merge_discard(device, bio))
+		return NULL;
+
 	/* allocate outside of all locks; */
 	req = drbd_req_new(device, bio);
 	if (!req) {
@@ -1250,6 +1389,7 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio, unsigned long
 		return ERR_PTR(-ENOMEM);
 	}
 	req->start_jif = start_jif;
+	req->start_kt = ktime_get();
 
 	if (!get_ldev(device)) {
 		bio_put(req->private_bio);
@@ -1257,7 +1397,9 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio, unsigned long
 	}
 
 	/* Update disk stats */
-	_drbd_start_io_acct(device, req);
+	_drbd_start_io_acct(device, bio);
+
+	drbd_req_csum(device, req);
 
 	/* process discards always from our submitter thread */
 	if (bio_op(bio) == REQ_OP_DISCARD)
@@ -28,6 +28,7 @@
 #include <linux/module.h>
 
 #include <linux/slab.h>
+#include <linux/hash.h>
 #include <linux/drbd.h>
 #include "drbd_int.h"
 
@@ -278,11 +279,18 @@ static inline void drbd_req_make_private_bio(struct drbd_request *req, struct bi
 	bio->bi_next     = NULL;
 }
 
+static inline struct hlist_head *
+drbd_req_hash_slot(struct drbd_device *device, const void *id)
+{
+	return &device->req_hash[hash_ptr((void *)id, DRBD_REQ_HASH_BITS)];
+}
+
 /* Short lived temporary struct on the stack.
  * We could squirrel the error to be returned into
  * bio->bi_iter.bi_size, or similar. But that would be too ugly. */
 struct bio_and_error {
 	struct bio *bio;
+	struct bio *merged;	/* req->merged_bios, completed with bio */
 	int error;
 };
 
@@ -440,6 +440,70 @@ enum drbd_conns conn_lowest_conn(struct drbd_connection *connection)
 	return conn;
 }
 
+/* Called with req_lock held, when the connection broke.  If both agreed on
+ * DRBD_FF_SESSION_RESUME, keep the transfer log and freeze IO for up to
+ * resume-timeout, so that a reconnect to the same peer can resend what is
+ * not yet acknowledged, instead of marking it out of sync.
+ *
+ * Only with protocol C: tl_restart(RESEND) resends requests without
+ * RQ_NET_OK, and drops the others as if their barrier was acked.  With
+ * protocol A, RQ_NET_OK only means handed over to our socket, with B
+ * received by the peer; neither is on the peer's disk.  */
+static void conn_hold_session(struct drbd_connection *connection)
+{
+	struct net_conf *nc;
+	unsigned int timeout = 0;
+
+	if (!(connection->agreed_features & DRBD_FF_SESSION_RESUME))
+		return;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (nc && nc->wire_protocol == DRBD_PROT_C)
+		timeout = nc->resume_timeout;
+	rcu_read_unlock();
+	if (!timeout)
+		return;
+
+	connection->resource->susp_res = 1;
+	connection->resume_deadline = jiffies + timeout * HZ / 10;
+	mod_timer(&connection->resume_timer, connection->resume_deadline);
+}
+
+/* The handshake with the peer of the held session is complete */
+static void conn_session_resumed(struct drbd_connection *connection)
+{
+	struct drbd_resource *resource = connection->resource;
+	struct drbd_peer_device *peer_device;
+	bool resumed = false;
+	int vnr;
+
+	spin_lock_irq(&resource->req_lock);
+	if (resource->susp_res && test_bit(SESSION_RESUMING, &connection->flags) &&
+	    conn_lowest_conn(connection) >= C_CONNECTED) {
+		clear_bit(SESSION_RESUMING, &connection->flags);
+		/* no new current UUID, the peer has everything up to
+		 * what we resend now */
+		rcu_read_lock();
+		idr_for_each_entry(&connection->peer_devices, peer_device, vnr)
+			clear_bit(NEW_CUR_UUID, &peer_device->device->flags);
+		rcu_read_unlock();
+		_tl_restart(connection, RESEND);
+		resource->susp_res = 0;
+		resumed = true;
+	}
+	spin_unlock_irq(&resource->req_lock);
+
+	if (resumed) {
+		del_timer(&connection->resume_timer);
+		rcu_read_lock();
+		idr_for_each_entry(&connection->peer_devices, peer_device, vnr)
+			wake_up(&peer_device->device->misc_wait);
+		rcu_read_unlock();
+		drbd_info(connection, "Session resumed\n");
+	}
+}
+
 static bool no_peer_wf_report_params(struct drbd_connection *connection)
 {
 	struct drbd_peer_device *peer_device;
@@ -1223,17 +1287,21 @@ static void set_ov_position(struct drbd_device *device, enum drbd_conns cs)
 }
 
 /**
- * _drbd_set_state() - Set a new DRBD state
+ * __drbd_set_state() - Set a new DRBD state
  * @device:	DRBD device.
  * @ns:		new state.
  * @flags:	Flags
  * @done:	Optional completion, that will get completed after the after_state_ch() finished
+ * @batch:	Optional, filled in instead of queueing an after_state_ch() work
  *
- * Caller needs to hold req_lock. Do not call directly.
+ * With @batch, the caller takes one snapshot of the whole resource for
+ * the netlink broadcast, and runs after_state_ch() itself.
+ * Caller needs to hold req_lock.
  */
-enum drbd_state_rv
-_drbd_set_state(struct drbd_device *device, union drbd_state ns,
-	        enum chg_state_flags flags, struct completion *done)
+static enum drbd_state_rv
+__drbd_set_state(struct drbd_device *device, union drbd_state ns,
+		 enum chg_state_flags flags, struct completion *done,
+		 struct after_state_chg_work *batch)
 {
 	struct drbd_peer_device *peer_device = first_peer_device(device);
 	struct drbd_connection *connection = peer_device ? peer_device->connection : NULL;
@@ -1241,7 +1309,7 @@ _drbd_set_state(struct drbd_device *device, union drbd_state ns,
 	enum drbd_state_rv rv = SS_SUCCESS;
 	enum sanitize_state_warnings ssw;
 	struct after_state_chg_work *ascw;
-	struct drbd_state_change *state_change;
+	struct drbd_state_change *state_change = NULL;
 
 	os = drbd_read_state(device);
 
@@ -1297,7 +1365,8 @@ _drbd_set_state(struct drbd_device *device, union drbd_state ns,
 		clear_bit(RS_DONE, &device->flags);
 
 	/* FIXME: Have any flags been set earlier in this function already? */
-	state_change = remember_old_state(device->resource, GFP_ATOMIC);
+	if (!batch)
+		state_change = remember_old_state(device->resource, GFP_ATOMIC);
 
 	/* changes to local_cnt and device flags should be visible before
 	 * changes to state, which again should be visible before anything else
@@ -1309,6 +1378,10 @@ _drbd_set_state(struct drbd_device *device, union drbd_state ns,
 	device->resource->susp_fen = ns.susp_fen;
 	smp_wmb();
 
+	if (os.conn >= C_CONNECTED && !device->resource->susp_res &&
+	    (ns.conn == C_TIMEOUT || ns.conn == C_BROKEN_PIPE || ns.conn == C_NETWORK_FAILURE))
+		conn_hold_session(connection);
+
 	remember_new_state(state_change);
 
 	/* put replicated vs not-replicated requests in seperate epochs */
@@ -1440,7 +1513,7 @@ _drbd_set_state(struct drbd_device *device, union drbd_state ns,
 	    ns.disk > D_NEGOTIATING)
 		device->last_reattach_jif = jiffies;
 
-	ascw = kmalloc(sizeof(*ascw), GFP_ATOMIC);
+	ascw = batch ?: kmalloc(sizeof(*ascw), GFP_ATOMIC);
 	if (ascw) {
 		ascw->os = os;
 		ascw->ns = ns;
@@ -1449,8 +1522,9 @@ _drbd_set_state(struct drbd_device *device, union drbd_state ns,
 		ascw->device = device;
 		ascw->done = done;
 		ascw->state_change = state_change;
-		drbd_queue_work(&connection->sender_work,
-				&ascw->w);
+		if (!batch)
+			drbd_queue_work(&connection->sender_work,
+					&ascw->w);
 	} else {
 		drbd_err(device, "Could not kmalloc an ascw\n");
 	}
@@ -1458,6 +1532,22 @@ _drbd_set_state(struct drbd_device *device, union drbd_state ns,
 	return rv;
 }
 
+/**
+ * _drbd_set_state() - Set a new DRBD state
+ * @device:	DRBD device.
+ * @ns:		new state.
+ * @flags:	Flags
+ * @done:	Optional completion, that will get completed after the after_state_ch() finished
+ *
+ * Caller needs to hold req_lock. Do not call directly.
+ */
+enum drbd_state_rv
+_drbd_set_state(struct drbd_device *device, union drbd_state ns,
+	        enum chg_state_flags flags, struct completion *done)
+{
+	return __drbd_set_state(device, ns, flags, done, NULL);
+}
+
 static int w_after_state_ch(struct drbd_work *w, int unused)
 {
 	struct after_state_chg_work *ascw =
@@ -1580,6 +1670,11 @@ static void broadcast_state_change(struct drbd_state_change *state_change)
 			  enum drbd_notification_type) = NULL;
 	void *uninitialized_var(last_arg);
 
+	/* batched into a connection wide state change,
+	 * or we failed to allocate the snapshot */
+	if (!state_change)
+		return;
+
 #define HAS_CHANGED(state) ((state)[OLD] != (state)[NEW])
 #define FINAL_STATE_CHANGE(type) \
 	({ if (last_func) \
@@ -1751,6 +1846,9 @@ static void after_state_ch(struct drbd_device *device, union drbd_state os,
 		spin_unlock_irq(&device->resource->req_lock);
 	}
 
+	if (os.conn < C_CONNECTED && ns.conn >= C_CONNECTED && resource->susp_res)
+		conn_session_resumed(connection);
+
 	/* Became sync source.  With protocol >= 96, we still need to send out
 	 * the sync uuid now. Need to do that before any drbd_send_state, or
 	 * the other side may go "paused sync" before receiving the sync uuids,
@@ -2006,6 +2104,12 @@ struct after_conn_state_chg_work {
 	enum chg_state_flags flags;
 	struct drbd_connection *connection;
 	struct drbd_state_change *state_change;
+
+	/* the per volume after_state_ch() of this state change,
+	 * in one work item instead of one each */
+	unsigned int n_volumes;
+	unsigned int n_changed;
+	struct after_state_chg_work volumes[0];
 };
 
 static int w_after_conn_state_ch(struct drbd_work *w, int unused)
@@ -2016,9 +2120,18 @@ static int w_after_conn_state_ch(struct drbd_work *w, int unused)
 	enum drbd_conns oc = acscw->oc;
 	union drbd_state ns_max = acscw->ns_max;
 	struct drbd_peer_device *peer_device;
+	unsigned int i;
 	int vnr;
 
 	broadcast_state_change(acscw->state_change);
+	for (i = 0; i < acscw->n_changed; i++) {
+		struct after_state_chg_work *ascw = &acscw->volumes[i];
+
+		after_state_ch(ascw->device, ascw->os, ascw->ns, ascw->flags, NULL);
+	}
+	/* taken in conn_set_state(), the snapshot may have failed */
+	for (i = 0; i < acscw->n_changed; i++)
+		kref_put(&acscw->volumes[i].device->kref, drbd_destroy_device);
 	forget_state_change(acscw->state_change);
 	kfree(acscw);
 
@@ -2167,7 +2280,8 @@ conn_is_valid_transition(struct drbd_connection *connection, union drbd_state ma
 
 static void
 conn_set_state(struct drbd_connection *connection, union drbd_state mask, union drbd_state val,
-	       union drbd_state *pns_min, union drbd_state *pns_max, enum chg_state_flags flags)
+	       union drbd_state *pns_min, union drbd_state *pns_max, enum chg_state_flags flags,
+	       struct after_conn_state_chg_work *acscw)
 {
 	union drbd_state ns, os, ns_max = { };
 	union drbd_state ns_min = {
@@ -2202,7 +2316,16 @@ conn_set_state(struct drbd_connection *connection, union drbd_state mask, union
 		if (flags & CS_IGN_OUTD_FAIL && ns.disk == D_OUTDATED && os.disk < D_OUTDATED)
 			ns.disk = os.disk;
 
-		rv = _drbd_set_state(device, ns, flags, NULL);
+		/* volumes added since we sized acscw get their own work */
+		if (acscw && acscw->n_changed < acscw->n_volumes) {
+			rv = __drbd_set_state(device, ns, flags, NULL,
+					      &acscw->volumes[acscw->n_changed]);
+			if (rv != SS_NOTHING_TO_DO) {
+				kref_get(&device->kref);
+				acscw->n_changed++;
+			}
+		} else
+			rv = _drbd_set_state(device, ns, flags, NULL);
 		BUG_ON(rv < SS_SUCCESS);
 		ns.i = device->state.i;
 		ns_max.role = max_role(ns.role, ns_max.role);
@@ -2265,6 +2388,9 @@ _conn_request_state(struct drbd_connection *connection, union drbd_state mask, u
 	union drbd_state ns_max, ns_min, os;
 	bool have_mutex = false;
 	struct drbd_state_change *state_change;
+	struct drbd_peer_device *peer_device;
+	unsigned int n_volumes = 0;
+	int vnr;
 
 	if (mask.conn) {
 		rv = is_valid_conn_transition(oc, val.conn);
@@ -2310,14 +2436,25 @@ _conn_request_state(struct drbd_connection *connection, union drbd_state mask, u
 			goto abort;
 	}
 
+	/* One snapshot and one after state change work for all volumes.
+	 * Without it, each volume would snapshot the whole resource. */
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr)
+		n_volumes++;
+	rcu_read_unlock();
+	acscw = kmalloc(sizeof(*acscw) + n_volumes * sizeof(acscw->volumes[0]), GFP_ATOMIC);
+	if (acscw) {
+		acscw->n_volumes = n_volumes;
+		acscw->n_changed = 0;
+	}
+
 	state_change = remember_old_state(connection->resource, GFP_ATOMIC);
 	conn_old_common_state(connection, &os, &flags);
 	flags |= CS_DC_SUSP;
-	conn_set_state(connection, mask, val, &ns_min, &ns_max, flags);
+	conn_set_state(connection, mask, val, &ns_min, &ns_max, flags, acscw);
 	conn_pr_state_change(connection, os, ns_max, flags);
 	remember_new_state(state_change);
 
-	acscw = kmalloc(sizeof(*acscw), GFP_ATOMIC);
 	if (acscw) {
 		acscw->oc = os.conn;
 		acscw->ns_min = ns_min;
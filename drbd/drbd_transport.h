@@ -0,0 +1,102 @@
+#ifndef DRBD_TRANSPORT_H
+#define DRBD_TRANSPORT_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+struct drbd_connection;
+struct drbd_socket;
+struct seq_file;
+struct page;
+struct module;
+struct kvec;
+
+enum drbd_tr_hints {
+	DRBD_HINT_CORK,
+	DRBD_HINT_UNCORK,
+	DRBD_HINT_NODELAY,
+	DRBD_HINT_QUICKACK,
+	DRBD_HINT_NOSPACE,	/* we stopped sending, because the buffer is full */
+};
+
+/*
+ * A transport carries the two byte streams of a connection, the one of the
+ * data socket and the one of the meta socket.  The protocol code does not
+ * know what is below; it only uses these operations on a struct drbd_socket.
+ * drbd_socket->stream belongs to the transport, and is NULL while the
+ * stream is not established.
+ *
+ * sendv, send_page and recv follow the conventions of kernel_sendmsg() and
+ * kernel_recvmsg(): they may transfer less than asked for, return -EAGAIN
+ * once the send or receive timeout expired, and -EINTR or -ERESTARTSYS if
+ * interrupted by a signal.  A recv of 0 means the peer closed the stream.
+ *
+ * Transports built as separate modules register themselves with
+ * drbd_register_transport(), and are found by the name in net_conf's
+ * transport_name.  DRBD tries to load "drbd_transport_<name>" for a name
+ * it does not know yet.
+ */
+struct drbd_transport_ops {
+	const char *name;
+
+	/* Establish both streams of the connection, and decide which of the
+	 * two peers resolves conflicts (RESOLVE_CONFLICTS).
+	 * Returns 1 if connected, 0 to try again, -1 to give up. */
+	int (*connect)(struct drbd_connection *connection);
+	/* Shut down and free a stream, after it was unhooked from its socket */
+	void (*free_stream)(void *stream);
+
+	/* size is the sum of the iov_len, all of iov is one message */
+	int (*sendv)(struct drbd_socket *sock, struct kvec *iov, int iovcnt,
+		     size_t size, unsigned msg_flags);
+	int (*send_page)(struct drbd_socket *sock, struct page *page,
+			 int offset, size_t size, unsigned msg_flags);
+	int (*recv)(struct drbd_socket *sock, void *buf, size_t size, int flags);
+
+	void (*set_sndtimeo)(struct drbd_socket *sock, long timeout);
+	void (*set_rcvtimeo)(struct drbd_socket *sock, long timeout);
+	void (*hint)(struct drbd_socket *sock, enum drbd_tr_hints hint);
+	/* bytes queued for sending, and how many we may queue */
+	void (*sndbuf)(struct drbd_socket *sock, int *queued, int *size);
+	/* optional: NUMA node of the device the stream goes out through,
+	 * NUMA_NO_NODE if unknown */
+	int (*numa_node)(struct drbd_socket *sock);
+	/* optional, for debugfs in_flight_summary; called under rcu_read_lock() */
+	void (*debugfs_show)(struct drbd_connection *connection, struct seq_file *m);
+	/* DRBD_FF_* flags offered in addition to the ones of the protocol */
+	u32 features;
+	/* optional: more DRBD_FF_* flags, offered depending on what connect()
+	 * established; and the notification which of them the peer agreed on.
+	 * The handshake is the last packet on the data stream before that. */
+	u32 (*offered_features)(struct drbd_connection *connection);
+	void (*features_agreed)(struct drbd_connection *connection);
+	/* optional: the peer did not answer a ping in time on the meta
+	 * stream, or a send on the data stream timed out.  Move @sock to
+	 * another network path, instead of dropping the connection.
+	 * Returns true if the connection goes on. */
+	bool (*failover)(struct drbd_connection *connection, struct drbd_socket *sock);
+
+	struct module *module;	/* NULL if built into drbd */
+	struct list_head list;	/* on the list of registered transports */
+};
+
+/* What the protocol code spends in the transport, per drbd_socket.
+ * Accounted by the callers of the send and recv ops, see drbd_send(). */
+struct drbd_transport_stats {
+	u64 send_calls;
+	u64 send_bytes;
+	u64 send_ns;
+	u64 recv_calls;
+	u64 recv_bytes;
+	u64 recv_ns;
+};
+
+extern struct drbd_transport_ops drbd_tcp_transport;
+extern struct drbd_transport_ops drbd_loop_transport;
+
+extern int drbd_register_transport(struct drbd_transport_ops *ops);
+extern void drbd_unregister_transport(struct drbd_transport_ops *ops);
+extern struct drbd_transport_ops *drbd_get_transport(const char *name);
+extern void drbd_put_transport(struct drbd_transport_ops *ops);
+
+#endif
@@ -0,0 +1,570 @@
+/*
+   drbd_transport_loop.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Copyright (C) 2001-2008, LINBIT Information Technologies GmbH.
+   Copyright (C) 1999-2008, Philipp Reisner <philipp.reisner@linbit.com>.
+   Copyright (C) 2002-2008, Lars Ellenberg <lars.ellenberg@linbit.com>.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   drbd is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with drbd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/wait.h>
+#include <linux/seq_file.h>
+#include <net/sock.h>
+#include <linux/drbd.h>
+#include "drbd_int.h"
+#include "drbd_protocol.h"
+
+/*
+ * The loop transport connects two DRBD connections within the same kernel,
+ * without any network stack in between.  Meant to replicate between two
+ * resources on one host, e.g. to measure what DRBD itself costs, apart from
+ * the network.
+ *
+ * Two connections find each other by their addresses: the my_addr of one is
+ * the peer_addr of the other.  Nothing is ever bound to these addresses.
+ *
+ * Each of the data and the meta stream is a link of two pipes, one for each
+ * direction.  A pipe is a ring of slots, each referencing part of a page,
+ * limited to sndbuf-size bytes.  send() copies into pages of the pipe's own,
+ * appending to the last one while it has room.  With DRBD_FF_PAGE_PASSING,
+ * send_page() does not copy at all, but puts a reference to the sender's page
+ * into the ring, just like sendpage() of TCP hands it to the NIC.  The
+ * receiver copies out of it, and drops the reference.
+ */
+
+#define DTL_RING_SLOTS	256	/* power of 2 */
+#define DTL_DEFAULT_LIMIT	(1 << 20)
+
+struct dtl_slot {
+	struct page *page;	/* we hold a reference */
+	unsigned int offset;	/* of the unread part within the page */
+	unsigned int len;	/* unread bytes */
+	bool owned;		/* a page of ours with copies, may be appended to */
+};
+
+struct dtl_pipe {
+	spinlock_t lock;
+	wait_queue_head_t wait;	/* the reader waits for data, the writer for room */
+	struct dtl_slot slot[DTL_RING_SLOTS];
+	unsigned int head;	/* next slot to fill */
+	unsigned int tail;	/* next slot to read from */
+	unsigned int queued;
+	unsigned int limit;
+	bool closed;
+};
+
+#define dtl_ring_slot(pipe, i) (&(pipe)->slot[(i) & (DTL_RING_SLOTS - 1)])
+
+struct dtl_link {
+	struct kref kref;	/* one for each end */
+	struct dtl_pipe pipe[2];
+};
+
+/* what drbd_socket->stream points to */
+struct dtl_stream {
+	struct drbd_connection *connection;
+	struct dtl_link *link;
+	struct dtl_pipe *tx;
+	struct dtl_pipe *rx;
+	long sndtimeo;
+	long rcvtimeo;
+};
+
+/* a connection waiting for its peer to show up */
+struct dtl_waiter {
+	struct list_head list;
+	struct drbd_connection *connection;
+	unsigned int limit;
+	struct dtl_stream *data;	/* set by the peer that found us */
+	struct dtl_stream *meta;
+	struct completion done;
+};
+
+static LIST_HEAD(dtl_waiters);
+static DEFINE_MUTEX(dtl_mutex);
+
+static void dtl_init_pipe(struct dtl_pipe *pipe, unsigned int limit)
+{
+	spin_lock_init(&pipe->lock);
+	init_waitqueue_head(&pipe->wait);
+	pipe->head = 0;
+	pipe->tail = 0;
+	pipe->queued = 0;
+	pipe->limit = limit;
+	pipe->closed = false;
+}
+
+/* caller holds pipe->lock, or is the last one to reference it */
+static void dtl_drain_pipe(struct dtl_pipe *pipe)
+{
+	for (; pipe->tail != pipe->head; pipe->tail++) {
+		struct dtl_slot *slot = dtl_ring_slot(pipe, pipe->tail);
+
+		put_page(slot->page);
+		slot->page = NULL;
+	}
+	pipe->queued = 0;
+}
+
+static void dtl_destroy_link(struct kref *kref)
+{
+	struct dtl_link *link = container_of(kref, struct dtl_link, kref);
+
+	dtl_drain_pipe(&link->pipe[0]);
+	dtl_drain_pipe(&link->pipe[1]);
+	kfree(link);
+}
+
+/* Creates a link and both of its ends.  @limit1 limits what end1 sends,
+ * @limit2 what end2 sends. */
+static int dtl_create_link(struct drbd_connection *connection1, unsigned int limit1,
+			   struct drbd_connection *connection2, unsigned int limit2,
+			   struct dtl_stream **end1, struct dtl_stream **end2)
+{
+	struct dtl_link *link;
+	struct dtl_stream *s1, *s2;
+
+	link = kmalloc(sizeof(*link), GFP_KERNEL);
+	s1 = kzalloc(sizeof(*s1), GFP_KERNEL);
+	s2 = kzalloc(sizeof(*s2), GFP_KERNEL);
+	if (!link || !s1 || !s2) {
+		kfree(link);
+		kfree(s1);
+		kfree(s2);
+		return -ENOMEM;
+	}
+
+	kref_init(&link->kref);
+	kref_get(&link->kref);
+	dtl_init_pipe(&link->pipe[0], limit1);
+	dtl_init_pipe(&link->pipe[1], limit2);
+
+	s1->connection = connection1;
+	s1->link = link;
+	s1->tx = &link->pipe[0];
+	s1->rx = &link->pipe[1];
+	s1->sndtimeo = s1->rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+	s2->connection = connection2;
+	s2->link = link;
+	s2->tx = &link->pipe[1];
+	s2->rx = &link->pipe[0];
+	s2->sndtimeo = s2->rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+
+	*end1 = s1;
+	*end2 = s2;
+	return 0;
+}
+
+static void dtl_free_stream(void *stream)
+{
+	struct dtl_stream *s = stream;
+
+	/* What we sent may still be received, like with a socket shut down
+	 * after sending.  What was sent to us is gone. */
+	spin_lock_bh(&s->tx->lock);
+	s->tx->closed = true;
+	spin_unlock_bh(&s->tx->lock);
+	wake_up(&s->tx->wait);
+
+	spin_lock_bh(&s->rx->lock);
+	s->rx->closed = true;
+	dtl_drain_pipe(s->rx);
+	spin_unlock_bh(&s->rx->lock);
+	wake_up(&s->rx->wait);
+
+	kref_put(&s->link->kref, dtl_destroy_link);
+	kfree(s);
+}
+
+static bool dtl_peer_matches(struct drbd_connection *connection, struct drbd_connection *peer)
+{
+	return connection->my_addr_len == peer->peer_addr_len &&
+		connection->peer_addr_len == peer->my_addr_len &&
+		!memcmp(&connection->my_addr, &peer->peer_addr, connection->my_addr_len) &&
+		!memcmp(&connection->peer_addr, &peer->my_addr, connection->peer_addr_len);
+}
+
+static int dtl_connect(struct drbd_connection *connection)
+{
+	struct dtl_stream *data, *meta, *peer_data, *peer_meta;
+	struct dtl_waiter *w, waiter;
+	struct net_conf *nc;
+	unsigned int limit;
+	int connect_int;
+	long timeo;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -1;
+	}
+	limit = nc->sndbuf_size ?: DTL_DEFAULT_LIMIT;
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	mutex_lock(&dtl_mutex);
+	list_for_each_entry(w, &dtl_waiters, list) {
+		if (!dtl_peer_matches(connection, w->connection))
+			continue;
+
+		if (dtl_create_link(connection, limit, w->connection, w->limit,
+				    &data, &peer_data))
+			goto out_nomem;
+		if (dtl_create_link(connection, limit, w->connection, w->limit,
+				    &meta, &peer_meta)) {
+			dtl_free_stream(data);
+			dtl_free_stream(peer_data);
+			goto out_nomem;
+		}
+		list_del(&w->list);
+		w->data = peer_data;
+		w->meta = peer_meta;
+		complete(&w->done);
+		mutex_unlock(&dtl_mutex);
+
+		/* The one who finds the other resolves conflicts,
+		 * like the one who accepts the meta socket with tcp. */
+		set_bit(RESOLVE_CONFLICTS, &connection->flags);
+		connection->data.stream = data;
+		connection->meta.stream = meta;
+		return 1;
+	}
+
+	waiter.connection = connection;
+	waiter.limit = limit;
+	waiter.data = NULL;
+	waiter.meta = NULL;
+	init_completion(&waiter.done);
+	list_add_tail(&waiter.list, &dtl_waiters);
+	mutex_unlock(&dtl_mutex);
+
+	timeo = connect_int * HZ;
+	wait_for_completion_interruptible_timeout(&waiter.done, timeo);
+
+	mutex_lock(&dtl_mutex);
+	if (!waiter.data)
+		list_del(&waiter.list);
+	mutex_unlock(&dtl_mutex);
+
+	if (waiter.data) {
+		clear_bit(RESOLVE_CONFLICTS, &connection->flags);
+		connection->data.stream = waiter.data;
+		connection->meta.stream = waiter.meta;
+		return 1;
+	}
+
+	if (connection->cstate <= C_DISCONNECTING)
+		return -1;
+	if (signal_pending(current)) {
+		flush_signals(current);
+		smp_rmb();
+		if (get_t_state(&connection->receiver) == EXITING)
+			return -1;
+	}
+	return 0;
+
+out_nomem:
+	mutex_unlock(&dtl_mutex);
+	return 0;
+}
+
+static bool dtl_writable(struct dtl_pipe *pipe)
+{
+	bool rv;
+
+	spin_lock_bh(&pipe->lock);
+	rv = (pipe->queued < pipe->limit && pipe->head - pipe->tail < DTL_RING_SLOTS) ||
+		pipe->closed;
+	spin_unlock_bh(&pipe->lock);
+	return rv;
+}
+
+static bool dtl_readable(struct dtl_pipe *pipe)
+{
+	bool rv;
+
+	spin_lock_bh(&pipe->lock);
+	rv = pipe->head != pipe->tail || pipe->closed;
+	spin_unlock_bh(&pipe->lock);
+	return rv;
+}
+
+static int dtl_wait_writable(struct dtl_stream *s, unsigned msg_flags)
+{
+	long timeo = (msg_flags & MSG_DONTWAIT) ? 0 : s->sndtimeo;
+	long t;
+
+	if (dtl_writable(s->tx))
+		return 0;
+	if (!timeo)
+		return -EAGAIN;
+	t = wait_event_interruptible_timeout(s->tx->wait, dtl_writable(s->tx), timeo);
+	if (t < 0)
+		return sock_intr_errno(timeo);
+	if (t == 0)
+		return -EAGAIN;
+	return 0;
+}
+
+/* Caller holds pipe->lock, and made sure there is a free slot. */
+static void dtl_put_slot(struct dtl_pipe *pipe, struct page *page,
+			 unsigned int offset, unsigned int len, bool owned)
+{
+	struct dtl_slot *slot = dtl_ring_slot(pipe, pipe->head);
+
+	slot->page = page;
+	slot->offset = offset;
+	slot->len = len;
+	slot->owned = owned;
+	pipe->head++;
+	pipe->queued += len;
+}
+
+static int dtl_send_buf(struct drbd_socket *sock, void *buf, size_t size, unsigned msg_flags)
+{
+	struct dtl_stream *s = sock->stream;
+	struct dtl_pipe *pipe = s->tx;
+	struct page *page;
+	size_t len;
+	int err;
+
+	err = dtl_wait_writable(s, msg_flags);
+	if (err)
+		return err;
+
+	spin_lock_bh(&pipe->lock);
+	if (pipe->closed) {
+		spin_unlock_bh(&pipe->lock);
+		return -EPIPE;
+	}
+	/* headers are small, packing them together saves pages and slots */
+	if (pipe->head != pipe->tail) {
+		struct dtl_slot *last = dtl_ring_slot(pipe, pipe->head - 1);
+		unsigned int end = last->offset + last->len;
+
+		if (last->owned && end < PAGE_SIZE) {
+			len = min_t(size_t, size, PAGE_SIZE - end);
+			memcpy(page_address(last->page) + end, buf, len);
+			last->len += len;
+			pipe->queued += len;
+			spin_unlock_bh(&pipe->lock);
+			wake_up(&pipe->wait);
+			return len;
+		}
+	}
+	spin_unlock_bh(&pipe->lock);
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+	len = min_t(size_t, size, PAGE_SIZE);
+	memcpy(page_address(page), buf, len);
+
+	spin_lock_bh(&pipe->lock);
+	if (pipe->closed) {
+		spin_unlock_bh(&pipe->lock);
+		put_page(page);
+		return -EPIPE;
+	}
+	dtl_put_slot(pipe, page, 0, len, true);
+	spin_unlock_bh(&pipe->lock);
+	wake_up(&pipe->wait);
+
+	return len;
+}
+
+static int dtl_sendv(struct drbd_socket *sock, struct kvec *iov, int iovcnt,
+		     size_t size, unsigned msg_flags)
+{
+	int i, sent = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		size_t done = 0;
+
+		while (done < iov[i].iov_len) {
+			int rv = dtl_send_buf(sock, iov[i].iov_base + done,
+					      iov[i].iov_len - done, msg_flags);
+			if (rv <= 0)
+				return sent ?: rv;
+			done += rv;
+			sent += rv;
+		}
+	}
+	return sent;
+}
+
+static int dtl_send_page(struct drbd_socket *sock, struct page *page,
+			 int offset, size_t size, unsigned msg_flags)
+{
+	struct dtl_stream *s = sock->stream;
+	struct dtl_pipe *pipe = s->tx;
+	int err;
+
+	if (!(s->connection->agreed_features & DRBD_FF_PAGE_PASSING)) {
+		int sent;
+
+		sent = dtl_send_buf(sock, kmap(page) + offset, size, msg_flags);
+		kunmap(page);
+		return sent;
+	}
+
+	err = dtl_wait_writable(s, msg_flags);
+	if (err)
+		return err;
+
+	spin_lock_bh(&pipe->lock);
+	if (pipe->closed) {
+		spin_unlock_bh(&pipe->lock);
+		return -EPIPE;
+	}
+	/* same as sendpage(): the caller must not reuse the page
+	 * while its page_count() is elevated */
+	get_page(page);
+	dtl_put_slot(pipe, page, offset, size, false);
+	spin_unlock_bh(&pipe->lock);
+	wake_up(&pipe->wait);
+
+	return size;
+}
+
+/* Copies out of the pipe what is there, up to size bytes.  Consumes it,
+ * unless peeking.  Caller holds pipe->lock. */
+static size_t dtl_copy_out(struct dtl_pipe *pipe, void *buf, size_t size, bool peek)
+{
+	unsigned int i = pipe->tail;
+	size_t copied = 0;
+
+	while (i != pipe->head && copied < size) {
+		struct dtl_slot *slot = dtl_ring_slot(pipe, i);
+		size_t n = min_t(size_t, size - copied, slot->len);
+		void *addr;
+
+		addr = kmap_atomic(slot->page);
+		memcpy(buf + copied, addr + slot->offset, n);
+		kunmap_atomic(addr);
+		copied += n;
+		i++;
+		if (peek)
+			continue;
+
+		slot->offset += n;
+		slot->len -= n;
+		pipe->queued -= n;
+		if (slot->len) /* size reached */
+			break;
+		put_page(slot->page);
+		slot->page = NULL;
+		pipe->tail = i;
+	}
+	return copied;
+}
+
+static int dtl_recv(struct drbd_socket *sock, void *buf, size_t size, int flags)
+{
+	struct dtl_stream *s = sock->stream;
+	struct dtl_pipe *pipe = s->rx;
+	long timeo = (flags & MSG_DONTWAIT) ? 0 : s->rcvtimeo;
+	size_t copied = 0;
+
+	for (;;) {
+		bool closed;
+		size_t n;
+		long t;
+
+		spin_lock_bh(&pipe->lock);
+		n = dtl_copy_out(pipe, buf + copied, size - copied, flags & MSG_PEEK);
+		closed = pipe->closed;
+		spin_unlock_bh(&pipe->lock);
+		if (n && !(flags & MSG_PEEK))
+			wake_up(&pipe->wait);
+		copied += n;
+
+		if (copied == size || (copied && !(flags & MSG_WAITALL)) || closed)
+			return copied;
+		if (flags & MSG_PEEK)
+			return copied ?: -EAGAIN;
+		if (!timeo)
+			return copied ?: -EAGAIN;
+
+		t = wait_event_interruptible_timeout(pipe->wait, dtl_readable(pipe), timeo);
+		if (t < 0)
+			return copied ?: sock_intr_errno(timeo);
+		if (t == 0)
+			return copied ?: -EAGAIN;
+		if (timeo != MAX_SCHEDULE_TIMEOUT)
+			timeo = t;
+	}
+}
+
+static void dtl_set_sndtimeo(struct drbd_socket *sock, long timeout)
+{
+	struct dtl_stream *s = sock->stream;
+
+	s->sndtimeo = timeout;
+}
+
+static void dtl_set_rcvtimeo(struct drbd_socket *sock, long timeout)
+{
+	struct dtl_stream *s = sock->stream;
+
+	s->rcvtimeo = timeout;
+}
+
+static void dtl_hint(struct drbd_socket *sock, enum drbd_tr_hints hint)
+{
+	/* nothing to cork, no acks to hurry: what is sent is there */
+}
+
+static void dtl_sndbuf(struct drbd_socket *sock, int *queued, int *size)
+{
+	struct dtl_stream *s = sock->stream;
+
+	*queued = s->tx->queued;
+	*size = s->tx->limit;
+}
+
+static void dtl_debugfs_show(struct drbd_connection *connection, struct seq_file *m)
+{
+	struct dtl_stream *s = connection->data.stream;
+
+	if (!s)
+		return;
+	seq_printf(m, "unread receive buffer: %u Byte in %u slots\n",
+		   s->rx->queued, s->rx->head - s->rx->tail);
+	seq_printf(m, "unread send buffer: %u Byte in %u slots\n",
+		   s->tx->queued, s->tx->head - s->tx->tail);
+}
+
+struct drbd_transport_ops drbd_loop_transport = {
+	.name = "loop",
+	.connect = dtl_connect,
+	.free_stream = dtl_free_stream,
+	.sendv = dtl_sendv,
+	.send_page = dtl_send_page,
+	.recv = dtl_recv,
+	.set_sndtimeo = dtl_set_sndtimeo,
+	.set_rcvtimeo = dtl_set_rcvtimeo,
+	.hint = dtl_hint,
+	.sndbuf = dtl_sndbuf,
+	.debugfs_show = dtl_debugfs_show,
+	.features = DRBD_FF_PAGE_PASSING,
+};
@@ -0,0 +1,1367 @@
+/*
+   drbd_transport_tcp.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Copyright (C) 2001-2008, LINBIT Information Technologies GmbH.
+   Copyright (C) 1999-2008, Philipp Reisner <philipp.reisner@linbit.com>.
+   Copyright (C) 2002-2008, Lars Ellenberg <lars.ellenberg@linbit.com>.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   drbd is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with drbd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/uaccess.h>
+#include <net/sock.h>
+#include <net/dst.h>
+#include <linux/drbd.h>
+#include <linux/in.h>
+#include <linux/pkt_sched.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include "drbd_int.h"
+#include "drbd_protocol.h"
+
+/* The TCP transport: one TCP connection per drbd_socket.
+ * drbd_socket->stream is a struct dtt_stream.
+ *
+ * With the multipath net option, and both address pairs configured, each
+ * stream gets a second TCP connection over the other address pair, as a
+ * standby.  Once both peers agreed on DRBD_FF_MULTIPATH, the data stream
+ * runs on the path of the data socket, and the meta stream (acks, pings)
+ * on the other one, so that both paths carry traffic, and acks do not
+ * queue up behind data.  Each sender keeps a copy of what it sent last in
+ * a ring buffer.
+ *
+ * If a send or receive fails, the peer does not answer a ping in time, or
+ * a send on the data stream times out (see dtt_conn_failover()), the
+ * stream goes on over its standby: both peers tell each other on the new
+ * path how many bytes of the stream they received, and send again what the
+ * other one did not get.  Without a disconnect; from then on the stream has
+ * only the one path left, until the next connect.  A peer that did not
+ * notice the failure itself learns about it from that message arriving on
+ * its standby (see dtt_standby_work()).
+ *
+ * What the peer did not receive is in our socket's send buffer or in the
+ * peer's receive buffer.  With multipath, those have a fixed size, and the
+ * ring buffer covers both.  If that does not hold, the failover fails, and
+ * the connection breaks as it would without multipath.
+ *
+ * The ring buffer costs one memcpy() of everything sent, also of the pages
+ * that go out with sendpage() otherwise, for as long as there is a standby.
+ */
+#define DTT_MULTIPATH_BUF	(512 << 10)	/* socket buffers, if not configured */
+#define DTT_RING_SLACK		(64 << 10)	/* a send may overshoot sk_sndbuf */
+#define DTT_RESUME_MAGIC	0x8374ac1e
+
+/* sent by both peers on the standby path, when failing over to it */
+struct dtt_resume {
+	__be32 magic;
+	__be32 pad;
+	__be64 received;	/* bytes of the stream received so far */
+} __packed;
+
+struct dtt_stream {
+	struct drbd_connection *connection;
+	struct socket *socket;		/* the path in use */
+	struct socket *standby;		/* the other path, NULL if none (left) */
+	struct socket *failed;		/* the path we failed over from */
+	int path;			/* of socket, 1 = addr, 2 = addr2 */
+	long sndtimeo;
+	long rcvtimeo;
+
+	/* a failover holds both, to stop the senders and the receiver */
+	struct mutex tx_mutex;
+	struct mutex rx_mutex;
+	u64 tx_pos;			/* bytes sent on the stream */
+	u64 rx_pos;			/* bytes received from the stream */
+
+	/* the last ring_mask + 1 bytes sent, while there is a standby */
+	char *ring;
+	unsigned long ring_mask;
+
+	/* the peer failing over to the standby; path_mutex serializes
+	 * switching paths with dtt_standby_work() */
+	struct mutex path_mutex;
+	struct work_struct standby_work;
+#ifdef COMPAT_SK_DATA_READY_HAS_BYTES_PARAMETER
+	void (*original_sk_data_ready)(struct sock *sk, int bytes);
+#else
+	void (*original_sk_data_ready)(struct sock *sk);
+#endif
+};
+
+static int dtt_recv_short(struct socket *sock, void *buf, size_t size, int flags)
+{
+	struct kvec iov = {
+		.iov_base = buf,
+		.iov_len = size,
+	};
+	struct msghdr msg = {
+		.msg_flags = flags
+	};
+	return kernel_recvmsg(sock, &msg, &iov, 1, size, msg.msg_flags);
+}
+
+/* quoting tcp(7):
+ *   On individual connections, the socket buffer size must be set prior to the
+ *   listen(2) or connect(2) calls in order to have it take effect.
+ * This is our wrapper to do so.
+ */
+static void drbd_setbufsize(struct socket *sock, unsigned int snd,
+		unsigned int rcv)
+{
+	/* open coded SO_SNDBUF, SO_RCVBUF */
+	if (snd) {
+		sock->sk->sk_sndbuf = snd;
+		sock->sk->sk_userlocks |= SOCK_SNDBUF_LOCK;
+	}
+	if (rcv) {
+		sock->sk->sk_rcvbuf = rcv;
+		sock->sk->sk_userlocks |= SOCK_RCVBUF_LOCK;
+	}
+}
+
+/* With multipath, the socket buffers have a fixed size, so that the ring
+ * buffer of the stream can cover what may be in flight */
+static void dtt_buf_sizes(struct net_conf *nc, int *sndbuf_size, int *rcvbuf_size)
+{
+	*sndbuf_size = nc->sndbuf_size;
+	*rcvbuf_size = nc->rcvbuf_size;
+	if (nc->multipath) {
+		if (!*sndbuf_size)
+			*sndbuf_size = DTT_MULTIPATH_BUF;
+		if (!*rcvbuf_size)
+			*rcvbuf_size = DTT_MULTIPATH_BUF;
+	}
+}
+
+static struct socket *drbd_try_connect(struct drbd_connection *connection, int use_addr2)
+{
+	const char *what;
+	struct socket *sock;
+	struct sockaddr_in6 src_in6;
+	struct sockaddr_in6 peer_in6;
+	struct net_conf *nc;
+	int err, peer_addr_len = 0, my_addr_len = 0;
+	int sndbuf_size, rcvbuf_size, connect_int;
+	int disconnect_on_error = 1;
+
+	if (!use_addr2) {
+		my_addr_len = min_t(int, connection->my_addr_len, sizeof(src_in6));
+		memcpy(&src_in6, &connection->my_addr, my_addr_len);
+
+		peer_addr_len = min_t(int, connection->peer_addr_len, sizeof(src_in6));
+		memcpy(&peer_in6, &connection->peer_addr, peer_addr_len);
+	}
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return NULL;
+	}
+
+	dtt_buf_sizes(nc, &sndbuf_size, &rcvbuf_size);
+	connect_int = nc->connect_int;
+	if (use_addr2) {
+		my_addr_len = min_t(int, nc->my_addr2_len, sizeof(src_in6));
+		memcpy(&src_in6, &nc->my_addr2, my_addr_len);
+
+		peer_addr_len = min_t(int, nc->peer_addr2_len, sizeof(src_in6));
+		memcpy(&peer_in6, &nc->peer_addr2, peer_addr_len);
+	}
+	rcu_read_unlock();
+
+	if (((struct sockaddr *)&connection->my_addr)->sa_family == AF_INET6)
+		src_in6.sin6_port = 0;
+	else
+		((struct sockaddr_in *)&src_in6)->sin_port = 0; /* AF_INET & AF_SCI */
+
+	what = "sock_create_kern_in_try_connect";
+	err = sock_create_kern(&init_net, ((struct sockaddr *)&src_in6)->sa_family,
+			       SOCK_STREAM, IPPROTO_TCP, &sock);
+	if (err < 0) {
+		sock = NULL;
+		goto out;
+	}
+
+	sock->sk->sk_rcvtimeo =
+	sock->sk->sk_sndtimeo = connect_int * HZ;
+	drbd_setbufsize(sock, sndbuf_size, rcvbuf_size);
+
+       /* explicitly bind to the configured IP as source IP
+	*  for the outgoing connections.
+	*  This is needed for multihomed hosts and to be
+	*  able to use lo: interfaces for drbd.
+	* Make sure to use 0 as port number, so linux selects
+	*  a free one dynamically.
+	*/
+	what = "bind before connect";
+	err = sock->ops->bind(sock, (struct sockaddr *) &src_in6, my_addr_len);
+	if (err < 0)
+		goto out;
+
+	/* connect may fail, peer not yet available.
+	 * stay C_WF_CONNECTION, don't go Disconnecting! */
+	disconnect_on_error = 0;
+	what = "connect";
+	err = sock->ops->connect(sock, (struct sockaddr *) &peer_in6, peer_addr_len, 0);
+
+out:
+	if (err < 0) {
+		if (sock) {
+			sock_release(sock);
+			sock = NULL;
+		}
+		switch (-err) {
+			/* timeout, busy, signal pending */
+		case ETIMEDOUT: case EAGAIN: case EINPROGRESS:
+		case EINTR: case ERESTARTSYS:
+			/* peer not (yet) available, network problem */
+		case ECONNREFUSED: case ENETUNREACH:
+		case EHOSTDOWN:    case EHOSTUNREACH:
+			disconnect_on_error = 0;
+			break;
+		default:
+			drbd_err(connection, "%s failed, err = %d\n", what, err);
+		}
+		if (disconnect_on_error)
+			conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
+	}
+
+	return sock;
+}
+
+struct accept_wait_data {
+	struct drbd_connection *connection;
+	struct socket *s_listen;
+	struct socket *s_listen2;
+	int using_addr; /* 0 = undecided. 1 = addr, 2 = addr 2*/
+	struct completion door_bell;
+	void (*original_sk_state_change)(struct sock *sk);
+};
+
+static void drbd_incoming_connection(struct sock *sk)
+{
+	struct accept_wait_data *ad = sk->sk_user_data;
+	void (*state_change)(struct sock *sk);
+
+	state_change = ad->original_sk_state_change;
+	if (sk->sk_state == TCP_ESTABLISHED)
+		complete(&ad->door_bell);
+	state_change(sk);
+}
+
+static struct socket *create_listen_socket(struct drbd_connection *connection,
+					   struct sockaddr *addr,
+					   int addr_len)
+{
+	int err, sndbuf_size, rcvbuf_size;
+	struct socket *s_listen;
+	struct net_conf *nc;
+	const char *what;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return NULL;
+	}
+	dtt_buf_sizes(nc, &sndbuf_size, &rcvbuf_size);
+	rcu_read_unlock();
+
+	what = "sock_create_kern";
+	err = sock_create_kern(&init_net, addr->sa_family, SOCK_STREAM, IPPROTO_TCP, &s_listen);
+	if (err) {
+		s_listen = NULL;
+		goto out;
+	}
+
+	s_listen->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
+	drbd_setbufsize(s_listen, sndbuf_size, rcvbuf_size);
+
+	what = "bind before listen";
+	err = s_listen->ops->bind(s_listen, addr, addr_len);
+	if (err < 0)
+		goto out;
+
+	return s_listen;
+out:
+	if (s_listen)
+		sock_release(s_listen);
+
+	drbd_err(connection, "%s failed, err = %d\n", what, err);
+
+	return NULL;
+}
+
+static int prepare_listen_socket(struct drbd_connection *connection, struct accept_wait_data *ad)
+{
+	int err = -EIO, my_addr_len;
+	struct sockaddr_in6 my_addr;
+	struct net_conf *nc;
+	const char *what;
+
+	my_addr_len = min_t(int, connection->my_addr_len, sizeof(struct sockaddr_in6));
+	memcpy(&my_addr, &connection->my_addr, my_addr_len);
+
+	what = "create_listen_socket";
+	ad->s_listen = create_listen_socket(connection, (struct sockaddr *)&my_addr, my_addr_len);
+	if (!ad->s_listen)
+		goto out;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		goto out;
+	}
+	my_addr_len = nc->my_addr2_len;
+	memcpy(&my_addr, nc->my_addr2, my_addr_len);
+	rcu_read_unlock();
+
+	if (my_addr_len) {
+		what = "create_listen_socket2";
+		ad->s_listen2 = create_listen_socket(connection, (struct sockaddr *)&my_addr, my_addr_len);
+		if (!ad->s_listen2)
+			goto out;
+
+		write_lock_bh(&ad->s_listen2->sk->sk_callback_lock);
+		ad->s_listen2->sk->sk_state_change = drbd_incoming_connection;
+		ad->s_listen2->sk->sk_user_data = ad;
+		write_unlock_bh(&ad->s_listen2->sk->sk_callback_lock);
+
+		what = "listen2";
+		err = ad->s_listen2->ops->listen(ad->s_listen2, 5);
+		if (err < 0)
+			goto out;
+	}
+
+	write_lock_bh(&ad->s_listen->sk->sk_callback_lock);
+	ad->original_sk_state_change = ad->s_listen->sk->sk_state_change;
+	ad->s_listen->sk->sk_state_change = drbd_incoming_connection;
+	ad->s_listen->sk->sk_user_data = ad;
+	write_unlock_bh(&ad->s_listen->sk->sk_callback_lock);
+
+	what = "listen";
+	err = ad->s_listen->ops->listen(ad->s_listen, 5);
+	if (err < 0)
+		goto out;
+
+	return 0;
+out:
+	if (ad->s_listen)
+		sock_release(ad->s_listen);
+	if (ad->s_listen2)
+		sock_release(ad->s_listen2);
+	if (err < 0) {
+		if (err != -EAGAIN && err != -EINTR && err != -ERESTARTSYS) {
+			drbd_err(connection, "%s failed, err = %d\n", what, err);
+			conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
+		}
+	}
+
+	return -EIO;
+}
+
+static void unregister_state_change(struct sock *sk, struct accept_wait_data *ad)
+{
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_state_change = ad->original_sk_state_change;
+	sk->sk_user_data = NULL;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static struct socket *drbd_wait_for_connect(struct drbd_connection *connection, struct accept_wait_data *ad)
+{
+	int timeo, connect_int, err = 0;
+	struct socket *s_estab = NULL;
+	struct net_conf *nc;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return NULL;
+	}
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	timeo = connect_int * HZ;
+	timeo += (prandom_u32() & 1) ? timeo / 7 : -timeo / 7; /* 28.5% random jitter */
+
+	err = wait_for_completion_interruptible_timeout(&ad->door_bell, timeo);
+	if (err <= 0)
+		return NULL;
+
+	err = kernel_accept(ad->s_listen, &s_estab, O_NONBLOCK);
+	if (err < 0 && err != -EAGAIN && err != -EINTR && err != -ERESTARTSYS) {
+		drbd_err(connection, "accept failed, err = %d\n", err);
+		conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
+		return NULL;
+	}
+	if (!err) {
+		ad->using_addr = 1;
+		unregister_state_change(s_estab->sk, ad);
+		return s_estab;
+	}
+	else if (!ad->s_listen2)
+		return NULL;
+
+	err = kernel_accept(ad->s_listen2, &s_estab, O_NONBLOCK);
+	if (err < 0 && err != -EAGAIN && err != -EINTR && err != -ERESTARTSYS) {
+		drbd_err(connection, "accept failed, err = %d\n", err);
+		conn_request_state(connection, NS(conn, C_DISCONNECTING), CS_HARD);
+	}
+
+	if (s_estab) {
+		ad->using_addr = 2;
+		unregister_state_change(s_estab->sk, ad);
+	}
+
+	return s_estab;
+}
+
+/**
+ * drbd_socket_okay() - Free the socket if its connection is not okay
+ * @sock:	pointer to the pointer to the socket.
+ */
+static bool drbd_socket_okay(struct socket **sock)
+{
+	int rr;
+	char tb[4];
+
+	if (!*sock)
+		return false;
+
+	rr = dtt_recv_short(*sock, tb, 4, MSG_DONTWAIT | MSG_PEEK);
+
+	if (rr > 0 || rr == -EAGAIN) {
+		return true;
+	} else {
+		sock_release(*sock);
+		*sock = NULL;
+		return false;
+	}
+}
+
+static bool connection_established(struct drbd_connection *connection,
+				   struct socket **sock1,
+				   struct socket **sock2)
+{
+	struct net_conf *nc;
+	int timeout;
+	bool ok;
+
+	if (!*sock1 || !*sock2)
+		return false;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	timeout = (nc->sock_check_timeo ?: nc->ping_timeo) * HZ / 10;
+	rcu_read_unlock();
+	schedule_timeout_interruptible(timeout);
+
+	ok = drbd_socket_okay(sock1);
+	ok = drbd_socket_okay(sock2) && ok;
+
+	return ok;
+}
+
+static void dtt_init_stream(struct dtt_stream *s, struct drbd_connection *connection,
+			    struct socket *socket, int path)
+{
+	s->connection = connection;
+	s->socket = socket;
+	s->path = path;
+	mutex_init(&s->tx_mutex);
+	mutex_init(&s->rx_mutex);
+	mutex_init(&s->path_mutex);
+}
+
+/* The first packets go through a drbd_socket that is not hooked into the
+ * connection yet, with a stream of only this one socket */
+static int dtt_send_first_packet(struct drbd_connection *connection, struct socket *socket,
+				 struct drbd_socket *like, enum drbd_packet cmd)
+{
+	struct dtt_stream stream = { };
+	struct drbd_socket sock = {
+		.sbuf = like->sbuf,
+		.rbuf = like->rbuf,
+		.stream = &stream,
+	};
+
+	dtt_init_stream(&stream, connection, socket, 0);
+	mutex_init(&sock.mutex);
+	return drbd_send_first_packet(connection, &sock, cmd);
+}
+
+static int dtt_receive_first_packet(struct drbd_connection *connection, struct socket *socket)
+{
+	struct dtt_stream stream = { };
+	struct drbd_socket sock = { .stream = &stream };
+
+	dtt_init_stream(&stream, connection, socket, 0);
+	return drbd_receive_first_packet(connection, &sock);
+}
+
+static struct socket *dtt_listen_socket(struct accept_wait_data *ad, int path)
+{
+	return path == 2 ? ad->s_listen2 : ad->s_listen;
+}
+
+/* Wait for the peer to connect a standby path */
+static void dtt_accept_standby(struct drbd_connection *connection,
+			       struct accept_wait_data *ad, struct socket *s_listen,
+			       struct socket **s_data2, struct socket **s_meta2)
+{
+	struct socket *s = NULL;
+	struct net_conf *nc;
+	int err;
+
+	if (!s_listen)
+		return;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return;
+	}
+	s_listen->sk->sk_rcvtimeo = nc->connect_int * HZ;
+	rcu_read_unlock();
+
+	err = kernel_accept(s_listen, &s, 0);
+	if (err < 0)
+		return;
+	unregister_state_change(s->sk, ad);
+	switch (dtt_receive_first_packet(connection, s)) {
+	case P_INITIAL_DATA2:
+		if (!*s_data2) {
+			*s_data2 = s;
+			return;
+		}
+		break;
+	case P_INITIAL_META2:
+		if (!*s_meta2) {
+			*s_meta2 = s;
+			return;
+		}
+		break;
+	}
+	sock_release(s);
+}
+
+static struct socket *dtt_connect_standby(struct drbd_connection *connection, int path,
+					  struct drbd_socket *like, enum drbd_packet cmd)
+{
+	struct socket *s;
+
+	s = drbd_try_connect(connection, path == 2);
+	if (s && dtt_send_first_packet(connection, s, like, cmd)) {
+		sock_release(s);
+		s = NULL;
+	}
+	return s;
+}
+
+static void dtt_setsockopt(struct socket *sock, int optname, int val)
+{
+	(void) kernel_setsockopt(sock, SOL_TCP, optname,
+			(char*)&val, sizeof(val));
+}
+
+static void dtt_standby_work(struct work_struct *work);
+
+static struct dtt_stream *dtt_alloc_stream(struct drbd_connection *connection,
+					   struct socket *socket, int path)
+{
+	struct dtt_stream *stream;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (stream) {
+		dtt_init_stream(stream, connection, socket, path);
+		INIT_WORK(&stream->standby_work, dtt_standby_work);
+	}
+	return stream;
+}
+
+static int dtt_add_standby(struct dtt_stream *s, struct socket *socket, u32 priority)
+{
+	struct sock *sk = s->socket->sk;
+	unsigned long size;
+
+	/* our send buffer, and the peer's receive buffer, which we assume
+	 * to have the same size as ours */
+	size = roundup_pow_of_two(sk->sk_sndbuf + sk->sk_rcvbuf + DTT_RING_SLACK);
+	s->ring = vmalloc(size);
+	if (!s->ring)
+		return -ENOMEM;
+	s->ring_mask = size - 1;
+
+	socket->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
+	socket->sk->sk_allocation = GFP_NOIO;
+	socket->sk->sk_priority = priority;
+	dtt_setsockopt(socket, TCP_NODELAY, 1);
+	s->standby = socket;
+	return 0;
+}
+
+static void dtt_drop_standby(struct dtt_stream *s)
+{
+	if (s->standby) {
+		kernel_sock_shutdown(s->standby, SHUT_RDWR);
+		sock_release(s->standby);
+		s->standby = NULL;
+	}
+	vfree(s->ring);
+	s->ring = NULL;
+}
+
+static int dtt_connect(struct drbd_connection *connection)
+{
+	struct socket *s_data = NULL, *s_meta = NULL;
+	struct socket *s_data2 = NULL, *s_meta2 = NULL;
+	struct dtt_stream *data_stream, *meta_stream;
+	struct net_conf *nc;
+	bool addr2_enabled, multipath, ok;
+	int data_path = 0, meta_path = 0; /* 1 = addr, 2 = addr2 */
+	struct accept_wait_data ad = {
+		.connection = connection,
+		.door_bell = COMPLETION_INITIALIZER_ONSTACK(ad.door_bell),
+		.using_addr = 0,
+	};
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	addr2_enabled = nc->my_addr2_len > 0;
+	multipath = addr2_enabled && nc->peer_addr2_len > 0 && nc->multipath;
+	rcu_read_unlock();
+
+	if (prepare_listen_socket(connection, &ad))
+		return 0;
+
+	do {
+		struct socket *s = NULL;
+		int path = ad.using_addr;
+
+		switch (ad.using_addr) {
+		case 0:
+			path = 1;
+			s = drbd_try_connect(connection, false);
+			if (!s && addr2_enabled) {
+				path = 2;
+				s = drbd_try_connect(connection, true);
+			}
+			break;
+		case 1:
+			s = drbd_try_connect(connection, false);
+			break;
+		case 2:
+			s = drbd_try_connect(connection, true);
+			break;
+		}
+
+		if (s) {
+			if (!s_data) {
+				s_data = s;
+				data_path = path;
+				dtt_send_first_packet(connection, s, &connection->data, P_INITIAL_DATA);
+			} else if (!s_meta) {
+				clear_bit(RESOLVE_CONFLICTS, &connection->flags);
+				s_meta = s;
+				meta_path = path;
+				dtt_send_first_packet(connection, s, &connection->meta, P_INITIAL_META);
+			} else {
+				drbd_err(connection, "Logic error in conn_connect()\n");
+				goto out_release_sockets;
+			}
+		}
+
+		if (connection_established(connection, &s_data, &s_meta))
+			break;
+
+retry:
+		s = drbd_wait_for_connect(connection, &ad);
+		if (s) {
+			int fp = dtt_receive_first_packet(connection, s);
+			drbd_socket_okay(&s_data);
+			drbd_socket_okay(&s_meta);
+			switch (fp) {
+			case P_INITIAL_DATA:
+				data_path = ad.using_addr;
+				if (s_data) {
+					drbd_warn(connection, "initial packet S crossed\n");
+					sock_release(s_data);
+					s_data = s;
+					goto randomize;
+				}
+				s_data = s;
+				break;
+			case P_INITIAL_META:
+				set_bit(RESOLVE_CONFLICTS, &connection->flags);
+				meta_path = ad.using_addr;
+				if (s_meta) {
+					drbd_warn(connection, "initial packet M crossed\n");
+					sock_release(s_meta);
+					s_meta = s;
+					goto randomize;
+				}
+				s_meta = s;
+				break;
+			case P_INITIAL_DATA2:
+				/* the peer is done already, and connected a standby path */
+				if (multipath && !s_data2) {
+					s_data2 = s;
+					break;
+				}
+				sock_release(s);
+				break;
+			case P_INITIAL_META2:
+				if (multipath && !s_meta2) {
+					s_meta2 = s;
+					break;
+				}
+				sock_release(s);
+				break;
+			default:
+				drbd_warn(connection, "Error receiving initial packet\n");
+				sock_release(s);
+randomize:
+				if (prandom_u32() & 1)
+					goto retry;
+			}
+		}
+
+		if (connection->cstate <= C_DISCONNECTING)
+			goto out_release_sockets;
+		if (signal_pending(current)) {
+			flush_signals(current);
+			smp_rmb();
+			if (get_t_state(&connection->receiver) == EXITING)
+				goto out_release_sockets;
+		}
+
+		ok = connection_established(connection, &s_data, &s_meta);
+	} while (!ok);
+
+	/* The standby path of each stream goes over the other address pair.
+	 * The peer that resolves conflicts connects them, the other one
+	 * accepts.  If that does not work out, we go on without; the
+	 * handshake makes sure both peers agree on having them. */
+	if (multipath && data_path && meta_path) {
+		if (test_bit(RESOLVE_CONFLICTS, &connection->flags)) {
+			if (!s_data2)
+				s_data2 = dtt_connect_standby(connection, 3 - data_path,
+							      &connection->data, P_INITIAL_DATA2);
+			if (!s_meta2)
+				s_meta2 = dtt_connect_standby(connection, 3 - meta_path,
+							      &connection->meta, P_INITIAL_META2);
+		} else {
+			if (!s_data2)
+				dtt_accept_standby(connection, &ad, dtt_listen_socket(&ad, 3 - data_path),
+						   &s_data2, &s_meta2);
+			if (!s_meta2)
+				dtt_accept_standby(connection, &ad, dtt_listen_socket(&ad, 3 - meta_path),
+						   &s_data2, &s_meta2);
+		}
+		if (!s_data2 || !s_meta2)
+			drbd_warn(connection, "Standby paths not established, using one path\n");
+	}
+
+	if (ad.s_listen)
+		sock_release(ad.s_listen);
+	if (ad.s_listen2)
+		sock_release(ad.s_listen2);
+	ad.s_listen = NULL;
+	ad.s_listen2 = NULL;
+
+	data_stream = dtt_alloc_stream(connection, s_data, data_path);
+	meta_stream = dtt_alloc_stream(connection, s_meta, meta_path);
+	if (!data_stream || !meta_stream) {
+		kfree(data_stream);
+		kfree(meta_stream);
+		goto out_release_sockets;
+	}
+
+	s_data->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
+	s_meta->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
+
+	s_data->sk->sk_allocation = GFP_NOIO;
+	s_meta->sk->sk_allocation = GFP_NOIO;
+
+	s_data->sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
+	s_meta->sk->sk_priority = TC_PRIO_INTERACTIVE;
+
+	/* both streams have a standby, or none */
+	if (s_data2 && s_meta2 &&
+	    !dtt_add_standby(data_stream, s_data2, TC_PRIO_INTERACTIVE_BULK)) {
+		s_data2 = NULL;
+		if (!dtt_add_standby(meta_stream, s_meta2, TC_PRIO_INTERACTIVE))
+			s_meta2 = NULL;
+		else
+			dtt_drop_standby(data_stream);
+	}
+	if (s_data2)
+		sock_release(s_data2);
+	if (s_meta2)
+		sock_release(s_meta2);
+
+	connection->data.stream = data_stream;
+	connection->meta.stream = meta_stream;
+	return 1;
+
+out_release_sockets:
+	if (ad.s_listen)
+		sock_release(ad.s_listen);
+	if (ad.s_listen2)
+		sock_release(ad.s_listen2);
+	if (s_data)
+		sock_release(s_data);
+	if (s_meta)
+		sock_release(s_meta);
+	if (s_data2)
+		sock_release(s_data2);
+	if (s_meta2)
+		sock_release(s_meta2);
+	return -1;
+}
+
+static void dtt_unwatch_standby(struct dtt_stream *s);
+
+static void dtt_free_stream(void *stream)
+{
+	struct dtt_stream *s = stream;
+	struct socket *sockets[] = { s->socket, s->standby, s->failed };
+	int i;
+
+	dtt_unwatch_standby(s);
+	cancel_work_sync(&s->standby_work);
+	for (i = 0; i < ARRAY_SIZE(sockets); i++) {
+		if (!sockets[i])
+			continue;
+		kernel_sock_shutdown(sockets[i], SHUT_RDWR);
+		sock_release(sockets[i]);
+	}
+	vfree(s->ring);
+	kfree(s);
+}
+
+static u32 dtt_offered_features(struct drbd_connection *connection)
+{
+	struct dtt_stream *data = connection->data.stream;
+	struct dtt_stream *meta = connection->meta.stream;
+
+	return data->standby && meta->standby ? DRBD_FF_MULTIPATH : 0;
+}
+
+/* Data arriving on a standby path is the peer failing over to it.  If
+ * we did not notice the failure ourselves (the other direction of the path
+ * may still work, or the peer only saw its sends time out), shut down the
+ * path in use, so that the stream's users fail over as well. */
+static void dtt_standby_work(struct work_struct *work)
+{
+	struct dtt_stream *s = container_of(work, struct dtt_stream, standby_work);
+	struct dtt_resume peek;
+
+	mutex_lock(&s->path_mutex);
+	if (s->standby &&
+	    dtt_recv_short(s->standby, &peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT) == sizeof(peek) &&
+	    peek.magic == cpu_to_be32(DTT_RESUME_MAGIC)) {
+		drbd_warn(s->connection, "Peer switched to path %d\n", 3 - s->path);
+		kernel_sock_shutdown(s->socket, SHUT_RDWR);
+	}
+	mutex_unlock(&s->path_mutex);
+}
+
+#ifdef COMPAT_SK_DATA_READY_HAS_BYTES_PARAMETER
+static void dtt_standby_data_ready(struct sock *sk, int bytes)
+#else
+static void dtt_standby_data_ready(struct sock *sk)
+#endif
+{
+	struct dtt_stream *s;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	s = sk->sk_user_data;
+	if (s) {
+		schedule_work(&s->standby_work);
+		/* wakes dtt_failover() waiting for the peer's dtt_resume */
+#ifdef COMPAT_SK_DATA_READY_HAS_BYTES_PARAMETER
+		s->original_sk_data_ready(sk, bytes);
+#else
+		s->original_sk_data_ready(sk);
+#endif
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void dtt_watch_standby(struct dtt_stream *s)
+{
+	struct sock *sk = s->standby->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	s->original_sk_data_ready = sk->sk_data_ready;
+	sk->sk_data_ready = dtt_standby_data_ready;
+	sk->sk_user_data = s;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/* Called before the standby becomes the path in use, or is dropped */
+static void dtt_unwatch_standby(struct dtt_stream *s)
+{
+	struct sock *sk;
+
+	if (!s->standby || !s->original_sk_data_ready)
+		return;
+	sk = s->standby->sk;
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_data_ready = s->original_sk_data_ready;
+	sk->sk_user_data = NULL;
+	write_unlock_bh(&sk->sk_callback_lock);
+	s->original_sk_data_ready = NULL;
+}
+
+static void dtt_features_agreed(struct drbd_connection *connection)
+{
+	struct dtt_stream *data = connection->data.stream;
+	struct dtt_stream *meta = connection->meta.stream;
+
+	if (!(connection->agreed_features & DRBD_FF_MULTIPATH)) {
+		dtt_drop_standby(data);
+		dtt_drop_standby(meta);
+		return;
+	}
+
+	/* Share the load: the meta stream goes over the other path than the
+	 * data stream, each with the path of the other one as standby.
+	 * Nothing went over the meta stream yet. */
+	if (meta->path == data->path) {
+		swap(meta->socket, meta->standby);
+		meta->path = 3 - data->path;
+		meta->socket->sk->sk_sndtimeo = meta->sndtimeo;
+		meta->socket->sk->sk_rcvtimeo = meta->rcvtimeo;
+	}
+	dtt_watch_standby(data);
+	dtt_watch_standby(meta);
+	drbd_info(connection, "Using path %d for data, path %d for meta data, "
+		  "each the standby of the other\n", data->path, meta->path);
+}
+
+static bool dtt_path_failed(int rv)
+{
+	/* 0 from a receive: the peer closed the stream */
+	return rv <= 0 && rv != -EAGAIN && rv != -EINTR && rv != -ERESTARTSYS;
+}
+
+/* Account for what went out, and keep a copy while there is a standby */
+static void dtt_record(struct dtt_stream *s, const char *buf, size_t size)
+{
+	if (!s->standby) {
+		s->tx_pos += size;
+		return;
+	}
+	while (size) {
+		unsigned long offset = s->tx_pos & s->ring_mask;
+		size_t n = min_t(size_t, size, s->ring_mask + 1 - offset);
+
+		memcpy(s->ring + offset, buf, n);
+		s->tx_pos += n;
+		buf += n;
+		size -= n;
+	}
+}
+
+static void dtt_record_iov(struct dtt_stream *s, struct kvec *iov, size_t sent)
+{
+	for (; sent; iov++) {
+		size_t n = min(sent, iov->iov_len);
+
+		dtt_record(s, iov->iov_base, n);
+		sent -= n;
+	}
+}
+
+static void dtt_record_page(struct dtt_stream *s, struct page *page, int offset, size_t sent)
+{
+	char *addr;
+
+	if (!s->standby) {
+		s->tx_pos += sent;
+		return;
+	}
+	addr = drbd_kmap_atomic(page, KM_USER0);
+	dtt_record(s, addr + offset, sent);
+	drbd_kunmap_atomic(addr, KM_USER0);
+}
+
+/* Send or receive all of @size, or fail.  A failover is under way, so
+ * signals only get flushed, until @deadline. */
+static int dtt_send_all(struct socket *socket, char *buf, size_t size, unsigned long deadline)
+{
+	while (size) {
+		struct kvec iov = {
+			.iov_base = buf,
+			.iov_len = size,
+		};
+		struct msghdr msg = {
+			.msg_flags = MSG_NOSIGNAL
+		};
+		int rv;
+
+		rv = kernel_sendmsg(socket, &msg, &iov, 1, size);
+		if ((rv == -EINTR || rv == -ERESTARTSYS) && time_before(jiffies, deadline)) {
+			flush_signals(current);
+			continue;
+		}
+		if (rv <= 0)
+			return rv ?: -EIO;
+		buf += rv;
+		size -= rv;
+	}
+	return 0;
+}
+
+static int dtt_recv_all(struct socket *socket, char *buf, size_t size, unsigned long deadline)
+{
+	while (size) {
+		int rv = dtt_recv_short(socket, buf, size, MSG_WAITALL);
+
+		if ((rv == -EINTR || rv == -ERESTARTSYS) && time_before(jiffies, deadline)) {
+			flush_signals(current);
+			continue;
+		}
+		if (rv <= 0)
+			return rv ?: -ECONNRESET;
+		buf += rv;
+		size -= rv;
+	}
+	return 0;
+}
+
+static int dtt_resend(struct dtt_stream *s, u64 pos, unsigned long deadline)
+{
+	while (pos < s->tx_pos) {
+		unsigned long offset = pos & s->ring_mask;
+		size_t size = min_t(u64, s->tx_pos - pos, s->ring_mask + 1 - offset);
+		int err;
+
+		err = dtt_send_all(s->socket, s->ring + offset, size, deadline);
+		if (err)
+			return err;
+		pos += size;
+	}
+	return 0;
+}
+
+/**
+ * dtt_failover() - Move a stream over to its standby path
+ * @s:		the stream.
+ * @socket:	the socket that failed.
+ *
+ * Nothing happens if the stream moved away from @socket already.  Returns 0
+ * if the stream goes on, over another path than @socket.
+ */
+static int dtt_failover(struct dtt_stream *s, struct socket *socket)
+{
+	struct drbd_connection *connection = s->connection;
+	struct dtt_resume mine, theirs;
+	unsigned long deadline;
+	struct net_conf *nc;
+	u64 received;
+	long timeo = 0;
+	int err;
+
+	/* get the senders and the receiver off the failed path */
+	if (s->socket == socket && s->standby)
+		kernel_sock_shutdown(socket, SHUT_RDWR);
+
+	mutex_lock(&s->tx_mutex);
+	mutex_lock(&s->rx_mutex);
+	err = 0;
+	if (s->socket != socket)
+		goto out_unlock;
+	err = -ENOTCONN;
+	if (!s->standby)
+		goto out_unlock;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->net_conf);
+	/* the peer notices by its own pings, at the latest */
+	if (nc)
+		timeo = (nc->ping_int * 10 + 2 * nc->ping_timeo) * HZ / 10;
+	rcu_read_unlock();
+	if (!timeo)
+		goto fail;
+
+	drbd_warn(connection, "Path %d failed, switching to path %d\n", s->path, 3 - s->path);
+	deadline = jiffies + timeo;
+	s->standby->sk->sk_sndtimeo = timeo;
+	s->standby->sk->sk_rcvtimeo = timeo;
+
+	mine.magic = cpu_to_be32(DTT_RESUME_MAGIC);
+	mine.pad = 0;
+	mine.received = cpu_to_be64(s->rx_pos);
+	err = dtt_send_all(s->standby, (char *)&mine, sizeof(mine), deadline);
+	if (!err)
+		err = dtt_recv_all(s->standby, (char *)&theirs, sizeof(theirs), deadline);
+	if (!err && theirs.magic != cpu_to_be32(DTT_RESUME_MAGIC))
+		err = -EPROTO;
+	if (err) {
+		drbd_err(connection, "Path %d failed as well, err = %d\n", 3 - s->path, err);
+		goto fail;
+	}
+	received = be64_to_cpu(theirs.received);
+	if (received > s->tx_pos || s->tx_pos - received > s->ring_mask + 1) {
+		drbd_err(connection, "Cannot resume, the peer received %llu of %llu bytes\n",
+			 (unsigned long long)received, (unsigned long long)s->tx_pos);
+		err = -EPROTO;
+		goto fail;
+	}
+
+	mutex_lock(&s->path_mutex);
+	dtt_unwatch_standby(s);
+	s->failed = s->socket;
+	s->socket = s->standby;
+	s->standby = NULL;
+	s->path = 3 - s->path;
+	mutex_unlock(&s->path_mutex);
+	s->socket->sk->sk_rcvtimeo = s->rcvtimeo;
+	mutex_unlock(&s->rx_mutex);
+
+	/* the receiver goes on already, while we send again what the peer
+	 * did not receive; the peer does the same */
+	err = dtt_resend(s, received, jiffies + timeo);
+	s->socket->sk->sk_sndtimeo = s->sndtimeo;
+	if (err) {
+		drbd_err(connection, "Resending on path %d failed, err = %d\n", s->path, err);
+		kernel_sock_shutdown(s->socket, SHUT_RDWR);
+	}
+	mutex_unlock(&s->tx_mutex);
+	return err;
+
+fail:
+	mutex_lock(&s->path_mutex);
+	dtt_unwatch_standby(s);
+	s->failed = s->standby;
+	s->standby = NULL;
+	mutex_unlock(&s->path_mutex);
+out_unlock:
+	mutex_unlock(&s->rx_mutex);
+	mutex_unlock(&s->tx_mutex);
+	return err;
+}
+
+static int dtt_sendv(struct drbd_socket *sock, struct kvec *iov, int iovcnt,
+		     size_t size, unsigned msg_flags)
+{
+	struct dtt_stream *s = sock->stream;
+	struct socket *socket;
+	int rv;
+
+	for (;;) {
+		struct msghdr msg = {
+			.msg_flags = msg_flags | MSG_NOSIGNAL
+		};
+
+		mutex_lock(&s->tx_mutex);
+		socket = s->socket;
+		rv = kernel_sendmsg(socket, &msg, iov, iovcnt, size);
+		if (rv > 0)
+			dtt_record_iov(s, iov, rv);
+		mutex_unlock(&s->tx_mutex);
+		if (!size || !dtt_path_failed(rv) || dtt_failover(s, socket))
+			return rv;
+	}
+}
+
+static int dtt_send_page(struct drbd_socket *sock, struct page *page,
+			 int offset, size_t size, unsigned msg_flags)
+{
+	struct dtt_stream *s = sock->stream;
+	struct socket *socket;
+	mm_segment_t oldfs;
+	int sent;
+
+	for (;;) {
+		mutex_lock(&s->tx_mutex);
+		socket = s->socket;
+		oldfs = get_fs();
+		set_fs(KERNEL_DS);
+		sent = socket->ops->sendpage(socket, page, offset, size, msg_flags);
+		set_fs(oldfs);
+		if (sent > 0)
+			dtt_record_page(s, page, offset, sent);
+		mutex_unlock(&s->tx_mutex);
+		if (!size || !dtt_path_failed(sent) || dtt_failover(s, socket))
+			return sent;
+	}
+}
+
+static int dtt_recv(struct drbd_socket *sock, void *buf, size_t size, int flags)
+{
+	struct dtt_stream *s = sock->stream;
+	struct socket *socket;
+	int rv;
+
+	for (;;) {
+		mutex_lock(&s->rx_mutex);
+		socket = s->socket;
+		rv = dtt_recv_short(socket, buf, size, flags);
+		if (rv > 0 && !(flags & MSG_PEEK))
+			s->rx_pos += rv;
+		mutex_unlock(&s->rx_mutex);
+		if (!size || !dtt_path_failed(rv) || dtt_failover(s, socket))
+			return rv;
+	}
+}
+
+static void dtt_set_sndtimeo(struct drbd_socket *sock, long timeout)
+{
+	struct dtt_stream *s = sock->stream;
+
+	s->sndtimeo = timeout;
+	s->socket->sk->sk_sndtimeo = timeout;
+}
+
+static void dtt_set_rcvtimeo(struct drbd_socket *sock, long timeout)
+{
+	struct dtt_stream *s = sock->stream;
+
+	s->rcvtimeo = timeout;
+	s->socket->sk->sk_rcvtimeo = timeout;
+}
+
+static void dtt_hint(struct drbd_socket *sock, enum drbd_tr_hints hint)
+{
+	struct dtt_stream *s = sock->stream;
+	struct socket *socket = s->socket;
+
+	switch (hint) {
+	case DRBD_HINT_CORK:
+		dtt_setsockopt(socket, TCP_CORK, 1);
+		break;
+	case DRBD_HINT_UNCORK:
+		dtt_setsockopt(socket, TCP_CORK, 0);
+		break;
+	case DRBD_HINT_NODELAY:
+		dtt_setsockopt(socket, TCP_NODELAY, 1);
+		break;
+	case DRBD_HINT_QUICKACK:
+		dtt_setsockopt(socket, TCP_QUICKACK, 2);
+		break;
+	case DRBD_HINT_NOSPACE:
+		/* notify TCP that we'd like to have more space */
+		if (socket->sk->sk_socket)
+			set_bit(SOCK_NOSPACE, &socket->sk->sk_socket->flags);
+		break;
+	}
+}
+
+static void dtt_sndbuf(struct drbd_socket *sock, int *queued, int *size)
+{
+	struct dtt_stream *s = sock->stream;
+
+	*queued = s->socket->sk->sk_wmem_queued;
+	*size = s->socket->sk->sk_sndbuf;
+}
+
+static int dtt_numa_node(struct drbd_socket *sock)
+{
+	struct dtt_stream *s = sock->stream;
+	struct dst_entry *dst;
+	int node = NUMA_NO_NODE;
+
+	dst = sk_dst_get(s->socket->sk);
+	if (dst) {
+		if (dst->dev && dst->dev->dev.parent)
+			node = dev_to_node(dst->dev->dev.parent);
+		dst_release(dst);
+	}
+	return node;
+}
+
+static void dtt_debugfs_show_path(struct seq_file *m, const char *name, struct dtt_stream *s)
+{
+	if (s->standby)
+		seq_printf(m, "%s: path %d, standby path %d\n", name, s->path, 3 - s->path);
+	else if (s->failed)
+		seq_printf(m, "%s: path %d, failed over from path %d\n", name, s->path, 3 - s->path);
+}
+
+static void dtt_debugfs_show(struct drbd_connection *connection, struct seq_file *m)
+{
+	struct dtt_stream *s = connection->data.stream;
+	struct tcp_sock *tp;
+	int answ;
+
+	if (!s)
+		return;
+	dtt_debugfs_show_path(m, "data", s);
+	if (connection->meta.stream)
+		dtt_debugfs_show_path(m, "meta", connection->meta.stream);
+	/* open coded SIOCINQ, the "relevant" part */
+	tp = tcp_sk(s->socket->sk);
+	answ = tp->rcv_nxt - tp->copied_seq;
+	seq_printf(m, "unread receive buffer: %u Byte\n", answ);
+	/* open coded SIOCOUTQ, the "relevant" part */
+	answ = tp->write_seq - tp->snd_una;
+	seq_printf(m, "unacked send buffer: %u Byte\n", answ);
+}
+
+/* The peer did not answer a ping in time (@sock is the meta stream), or a
+ * send on the data stream made no progress for a whole timeout.  Move that
+ * stream to its standby path, and the other stream as well, if it ran over
+ * the same path. */
+static bool dtt_conn_failover(struct drbd_connection *connection, struct drbd_socket *sock)
+{
+	struct drbd_socket *other_sock =
+		sock == &connection->data ? &connection->meta : &connection->data;
+	struct dtt_stream *s = sock->stream;
+	struct dtt_stream *other = other_sock->stream;
+	int path;
+
+	if (!s || !s->standby)
+		return false;
+	path = s->path;
+	if (dtt_failover(s, s->socket))
+		return false;
+	if (other && other->standby && other->path == path)
+		return !dtt_failover(other, other->socket);
+	return true;
+}
+
+struct drbd_transport_ops drbd_tcp_transport = {
+	.name = "tcp",
+	.connect = dtt_connect,
+	.free_stream = dtt_free_stream,
+	.sendv = dtt_sendv,
+	.send_page = dtt_send_page,
+	.recv = dtt_recv,
+	.set_sndtimeo = dtt_set_sndtimeo,
+	.set_rcvtimeo = dtt_set_rcvtimeo,
+	.hint = dtt_hint,
+	.sndbuf = dtt_sndbuf,
+	.numa_node = dtt_numa_node,
+	.debugfs_show = dtt_debugfs_show,
+	.offered_features = dtt_offered_features,
+	.features_agreed = dtt_features_agreed,
+	.failover = dtt_conn_failover,
+};
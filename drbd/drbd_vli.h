@@ -348,4 +348,113 @@ static inline int vli_encode_bits(struct bitstream *bs, u64 in)
 	return bitstream_put_bits(bs, code, bits);
 }
 
+/* number of valid bits between cursor and end of stream */
+static inline long bitstream_bits_left(struct bitstream *bs)
+{
+	return ((long)(bs->buf_len - (bs->cur.b - bs->buf)) << 3)
+		- bs->cur.bit - bs->pad_bits;
+}
+
+/*
+ * Adaptive Golomb-Rice code for the run lengths, see RLE_Rice_Bits.
+ *
+ * A run length rl is coded as v = rl - 1, split into the quotient v >> k and
+ * the k low bits of v.  Instead of unary, the quotient plus one is Elias-gamma
+ * coded (n zero bits, a one bit, then the n low bits), so a single huge run
+ * does not blow up the code.
+ *
+ * k follows the mean of the recent run lengths, separately for clear and
+ * set runs; encoder and decoder update it the same way after each run.
+ * Each packet starts with RICE_K_BITS each for the initial k of clear and
+ * set runs.
+ */
+struct rice_state {
+	u64 sum;
+	unsigned int cnt;
+};
+
+#define RICE_K_BITS 6
+#define RICE_K_MAX 48
+#define RICE_RESET 16
+
+static inline void rice_init(struct rice_state *st, unsigned int k)
+{
+	st->sum = 1ULL << k;
+	st->cnt = 1;
+}
+
+static inline unsigned int rice_k(const struct rice_state *st)
+{
+	unsigned int k = 0;
+
+	while (k < RICE_K_MAX && ((u64)st->cnt << k) < st->sum)
+		k++;
+	return k;
+}
+
+static inline void rice_update(struct rice_state *st, u64 rl)
+{
+	st->sum += rl;
+	if (++st->cnt == RICE_RESET) {
+		st->sum >>= 1;
+		st->cnt >>= 1;
+	}
+}
+
+/* encodes run length @rl into @bs;
+ * return values like vli_encode_bits() */
+static inline int rice_encode_bits(struct bitstream *bs, struct rice_state *st, u64 rl)
+{
+	unsigned int k = rice_k(st);
+	unsigned int n, bits;
+	u64 v, w;
+
+	if (rl == 0)
+		return -EINVAL;
+
+	v = rl - 1;
+	w = (v >> k) + 1;
+	n = fls64(w) - 1;
+	if (n + k > 63)
+		return -EOVERFLOW;
+
+	bits = 2 * n + 1 + k;
+	if (bits > bitstream_bits_left(bs))
+		return -ENOBUFS;
+
+	bitstream_put_bits(bs, 1ULL << n, n + 1);
+	bitstream_put_bits(bs, w, n);
+	bitstream_put_bits(bs, v, k);
+	rice_update(st, rl);
+	return bits;
+}
+
+/* decodes one run length from @bs into @rl;
+ * returns number of bits consumed, or -EIO for an invalid or truncated code */
+static inline int rice_decode_bits(struct bitstream *bs, struct rice_state *st, u64 *rl)
+{
+	unsigned int k = rice_k(st);
+	unsigned int n = 0;
+	u64 bit, w = 0, r = 0;
+
+	for (;;) {
+		if (bitstream_get_bits(bs, &bit, 1) != 1)
+			return -EIO;
+		if (bit)
+			break;
+		n++;
+	}
+	if (n + k > 63)
+		return -EIO;
+	if (n && bitstream_get_bits(bs, &w, n) != n)
+		return -EIO;
+	if (k && bitstream_get_bits(bs, &r, k) != k)
+		return -EIO;
+
+	w |= 1ULL << n;
+	*rl = (((w - 1) << k) | r) + 1;
+	rice_update(st, *rl);
+	return 2 * n + 1 + k;
+}
+
 #endif
@@ -491,6 +491,33 @@ void resync_timer_fn(unsigned long data)
 		&device->resync_work);
 }
 
+int w_resume_expired(struct drbd_work *w, int cancel)
+{
+	struct drbd_connection *connection =
+		container_of(w, struct drbd_connection, resume_work);
+	bool expired;
+
+	/* a handshake with the peer of the session may still resume it,
+	 * or give it up with conn_disconnect() */
+	spin_lock_irq(&connection->resource->req_lock);
+	expired = connection->resource->susp_res &&
+		!test_bit(SESSION_RESUMING, &connection->flags) &&
+		time_after_eq(jiffies, connection->resume_deadline);
+	spin_unlock_irq(&connection->resource->req_lock);
+
+	if (expired)
+		conn_session_lost(connection);
+	return 0;
+}
+
+void resume_timer_fn(unsigned long data)
+{
+	struct drbd_connection *connection = (struct drbd_connection *) data;
+
+	drbd_queue_work_if_unqueued(&connection->sender_work,
+				    &connection->resume_work);
+}
+
 static void fifo_set(struct fifo_buffer *fb, int value)
 {
 	int i;
@@ -666,16 +693,15 @@ static int make_resync_request(struct drbd_device *const device, int cancel)
 
 	for (i = 0; i < number; i++) {
 		/* Stop generating RS requests when half of the send buffer is filled,
-		 * but notify TCP that we'd like to have more space. */
+		 * but notify the transport that we'd like to have more space. */
 		mutex_lock(&connection->data.mutex);
-		if (connection->data.socket) {
-			struct sock *sk = connection->data.socket->sk;
-			int queued = sk->sk_wmem_queued;
-			int sndbuf = sk->sk_sndbuf;
+		if (connection->data.stream) {
+			int queued, sndbuf;
+
+			connection->transport->sndbuf(&connection->data, &queued, &sndbuf);
 			if (queued > sndbuf / 2) {
 				requeue = 1;
-				if (sk->sk_socket)
-					set_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
+				connection->transport->hint(&connection->data, DRBD_HINT_NOSPACE);
 			}
 		} else
 			requeue = 1;
@@ -1404,13 +1430,13 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
  * and to be able to wait for them.
  * See also comment in drbd_adm_attach before drbd_suspend_io.
  */
-static int drbd_send_barrier(struct drbd_connection *connection)
+static int __drbd_send_barrier(struct drbd_connection *connection)
 {
 	struct p_barrier *p;
 	struct drbd_socket *sock;
 
 	sock = &connection->data;
-	p = conn_prepare_command(connection, sock);
+	p = __conn_prepare_command(connection, sock);
 	if (!p)
 		return -EIO;
 	p->barrier = connection->send.current_epoch_nr;
@@ -1418,7 +1444,18 @@ static int drbd_send_barrier(struct drbd_connection *connection)
 	connection->send.current_epoch_writes = 0;
 	connection->send.last_sent_barrier_jif = jiffies;
 
-	return conn_send_command(connection, sock, P_BARRIER, sizeof(*p), NULL, 0);
+	return __conn_send_command(connection, sock, P_BARRIER, sizeof(*p), NULL, 0);
+}
+
+static int drbd_send_barrier(struct drbd_connection *connection)
+{
+	int err;
+
+	mutex_lock(&connection->data.mutex);
+	err = __drbd_send_barrier(connection);
+	mutex_unlock(&connection->data.mutex);
+
+	return err;
 }
 
 static int pd_send_unplug_remote(struct drbd_peer_device *pd)
@@ -1521,6 +1558,96 @@ int w_send_dblock(struct drbd_work *w, int cancel)
 	return err;
 }
 
+/* Upper bound for the number of write requests sent in one go,
+ * so that other users of data.mutex are not held off for too long. */
+#define DRBD_SEND_BATCH 32
+
+/**
+ * send_dblock_batch() - Send a run of queued write requests in one go
+ * @connection:	DRBD connection.
+ * @first:	the w_send_dblock work item just taken off @work_list.
+ * @work_list:	the sender's list of pending work.
+ *
+ * Takes the w_send_dblock items directly following @first off @work_list,
+ * and sends them, with the P_BARRIERs between their epochs, while holding
+ * data.mutex only once.  The P_UNPLUG_REMOTE hints asked for by requests of
+ * the batch are sent once per volume after the last P_DATA, instead of after
+ * each request.  The data stream stays corked from wait_for_data_work()
+ * until the sender runs out of work, so all of it goes out with one uncork.
+ * As in w_send_dblock(), req_mod() is called after data.mutex is released.
+ *
+ * On error, the requests not sent yet go back to the head of @work_list,
+ * they will be canceled once the connection is gone.
+ */
+static int send_dblock_batch(struct drbd_connection *connection,
+			     struct drbd_work *first, struct list_head *work_list)
+{
+	struct drbd_peer_device *unplug[DRBD_SEND_BATCH];
+	struct drbd_request *sent[DRBD_SEND_BATCH];
+	struct drbd_request *failed = NULL;
+	struct drbd_work *w, *tmp;
+	LIST_HEAD(batch);
+	int n = 1, n_sent = 0, n_unplug = 0;
+	int i, err = 0;
+
+	list_add(&first->list, &batch);
+	list_for_each_entry_safe(w, tmp, work_list, list) {
+		if (w->cb != w_send_dblock || n == DRBD_SEND_BATCH)
+			break;
+		list_move_tail(&w->list, &batch);
+		n++;
+	}
+
+	mutex_lock(&connection->data.mutex);
+	while (!list_empty(&batch)) {
+		struct drbd_request *req =
+			list_first_entry(&batch, struct drbd_request, w.list);
+		struct drbd_peer_device *peer_device = first_peer_device(req->device);
+
+		list_del_init(&req->w.list);
+		req->pre_send_jif = jiffies;
+
+		re_init_if_first_write(connection, req->epoch);
+		if (connection->send.current_epoch_nr != req->epoch) {
+			if (connection->send.current_epoch_writes)
+				__drbd_send_barrier(connection);
+			connection->send.current_epoch_nr = req->epoch;
+		}
+		connection->send.current_epoch_writes++;
+
+		if (req->rq_state & RQ_UNPLUG) {
+			for (i = 0; i < n_unplug; i++)
+				if (unplug[i] == peer_device)
+					break;
+			if (i == n_unplug)
+				unplug[n_unplug++] = peer_device;
+		}
+
+		err = __drbd_send_dblock(peer_device, req);
+		if (err) {
+			failed = req;
+			break;
+		}
+		sent[n_sent++] = req;
+	}
+	mutex_unlock(&connection->data.mutex);
+
+	for (i = 0; i < n_sent; i++)
+		req_mod(sent[i], HANDED_OVER_TO_NETWORK);
+	if (failed)
+		req_mod(failed, SEND_FAILED);
+
+	if (err) {
+		list_splice(&batch, work_list);
+		return err;
+	}
+
+	for (i = 0; i < n_unplug; i++)
+		pd_send_unplug_remote(unplug[i]);
+
+	return 0;
+}
+
 /**
  * w_send_read_req() - Worker callback to send a read request (P_DATA_REQUEST) packet
  * @w:		work object.
@@ -2064,6 +2191,8 @@ static void do_device_work(struct drbd_device *device, const unsigned long todo)
 		drbd_ldev_destroy(device);
 	if (test_bit(RS_START, &todo))
 		do_start_resync(device);
+	if (test_bit(STATS_BCAST, &todo))
+		drbd_bcast_perf_stats(device);
 }
 
 #define DRBD_DEVICE_WORK_MASK	\
@@ -2073,6 +2202,7 @@ static void do_device_work(struct drbd_device *device, const unsigned long todo)
 	|(1UL << RS_START)	\
 	|(1UL << RS_PROGRESS)	\
 	|(1UL << RS_DONE)	\
+	|(1UL << STATS_BCAST)	\
 	)
 
 static unsigned long get_work_bits(unsigned long *flags)
@@ -2115,12 +2245,31 @@ static bool dequeue_work_batch(struct drbd_work_queue *queue, struct list_head *
 }
 
 static void wait_for_work(struct drbd_connection *connection, struct list_head *work_list)
+{
+	DEFINE_WAIT(wait);
+
+	for (;;) {
+		prepare_to_wait(&connection->sender_work.q_wait, &wait, TASK_INTERRUPTIBLE);
+		if (dequeue_work_batch(&connection->sender_work, work_list))
+			break;
+		if (signal_pending(current))
+			break;
+		if (test_bit(DEVICE_WORK_PENDING, &connection->flags))
+			break;
+		if (get_t_state(&connection->worker) != RUNNING)
+			break;
+		schedule();
+	}
+	finish_wait(&connection->sender_work.q_wait, &wait);
+}
+
+static void wait_for_data_work(struct drbd_connection *connection, struct list_head *work_list)
 {
 	DEFINE_WAIT(wait);
 	struct net_conf *nc;
 	int uncork, cork;
 
-	dequeue_work_batch(&connection->sender_work, work_list);
+	dequeue_work_batch(&connection->data_work, work_list);
 	if (!list_empty(work_list))
 		return;
 
@@ -2136,19 +2285,18 @@ static void wait_for_work(struct drbd_connection *connection, struct list_head *
 	rcu_read_unlock();
 	if (uncork) {
 		mutex_lock(&connection->data.mutex);
-		if (connection->data.socket)
-			drbd_tcp_uncork(connection->data.socket);
+		drbd_stream_hint(connection, &connection->data, DRBD_HINT_UNCORK);
 		mutex_unlock(&connection->data.mutex);
 	}
 
 	for (;;) {
 		int send_barrier;
-		prepare_to_wait(&connection->sender_work.q_wait, &wait, TASK_INTERRUPTIBLE);
+		prepare_to_wait(&connection->data_work.q_wait, &wait, TASK_INTERRUPTIBLE);
 		spin_lock_irq(&connection->resource->req_lock);
-		spin_lock(&connection->sender_work.q_lock);	/* FIXME get rid of this one? */
-		if (!list_empty(&connection->sender_work.q))
-			list_splice_tail_init(&connection->sender_work.q, work_list);
-		spin_unlock(&connection->sender_work.q_lock);	/* FIXME get rid of this one? */
+		spin_lock(&connection->data_work.q_lock);	/* FIXME get rid of this one? */
+		if (!list_empty(&connection->data_work.q))
+			list_splice_tail_init(&connection->data_work.q, work_list);
+		spin_unlock(&connection->data_work.q_lock);	/* FIXME get rid of this one? */
 		if (!list_empty(work_list) || signal_pending(current)) {
 			spin_unlock_irq(&connection->resource->req_lock);
 			break;
@@ -2170,11 +2318,8 @@ static void wait_for_work(struct drbd_connection *connection, struct list_head *
 			maybe_send_barrier(connection,
 					connection->send.current_epoch_nr + 1);
 
-		if (test_bit(DEVICE_WORK_PENDING, &connection->flags))
-			break;
-
 		/* drbd_send() may have called flush_signals() */
-		if (get_t_state(&connection->worker) != RUNNING)
+		if (get_t_state(&connection->sender) != RUNNING)
 			break;
 
 		schedule();
@@ -2182,7 +2327,7 @@ static void wait_for_work(struct drbd_connection *connection, struct list_head *
 		 * e.g. if the current epoch got closed.
 		 * In which case we send the barrier above. */
 	}
-	finish_wait(&connection->sender_work.q_wait, &wait);
+	finish_wait(&connection->data_work.q_wait, &wait);
 
 	/* someone may have changed the config while we have been waiting above. */
 	rcu_read_lock();
@@ -2190,12 +2335,10 @@ static void wait_for_work(struct drbd_connection *connection, struct list_head *
 	cork = nc ? nc->tcp_cork : 0;
 	rcu_read_unlock();
 	mutex_lock(&connection->data.mutex);
-	if (connection->data.socket) {
-		if (cork)
-			drbd_tcp_cork(connection->data.socket);
-		else if (!uncork)
-			drbd_tcp_uncork(connection->data.socket);
-	}
+	if (cork)
+		drbd_stream_hint(connection, &connection->data, DRBD_HINT_CORK);
+	else if (!uncork)
+		drbd_stream_hint(connection, &connection->data, DRBD_HINT_UNCORK);
 	mutex_unlock(&connection->data.mutex);
 }
 
@@ -2271,3 +2414,67 @@ int drbd_worker(struct drbd_thread *thi)
 
 	return 0;
 }
+
+/*
+ * The sender thread transmits the requests of the connection: writes to be
+ * mirrored, reads to be served by the peer, out-of-sync notifications, and
+ * the barriers and unplug hints in between.  It is separate from the worker,
+ * so that bitmap IO, state changes and resync control, which may block for
+ * a long time, do not stall replication.  Both are pinned to the CPUs in
+ * resource->cpu_mask.
+ */
+int drbd_sender(struct drbd_thread *thi)
+{
+	struct drbd_connection *connection = thi->connection;
+	struct drbd_work *w;
+	LIST_HEAD(work_list);
+
+	while (get_t_state(thi) == RUNNING) {
+		drbd_thread_current_set_cpu(thi);
+
+		if (list_empty(&work_list)) {
+			update_sender_timing_details(connection, wait_for_data_work);
+			wait_for_data_work(connection, &work_list);
+		}
+
+		if (signal_pending(current)) {
+			flush_signals(current);
+			if (get_t_state(thi) == RUNNING) {
+				drbd_warn(connection, "Sender got an unexpected signal\n");
+				continue;
+			}
+			break;
+		}
+
+		if (get_t_state(thi) != RUNNING)
+			break;
+
+		if (!list_empty(&work_list)) {
+			int cancel = connection->cstate < C_WF_REPORT_PARAMS;
+			int err;
+
+			w = list_first_entry(&work_list, struct drbd_work, list);
+			list_del_init(&w->list);
+			update_sender_timing_details(connection, w->cb);
+			if (w->cb == w_send_dblock && !cancel)
+				err = send_dblock_batch(connection, w, &work_list);
+			else
+				err = w->cb(w, cancel);
+			if (err == 0)
+				continue;
+			if (connection->cstate >= C_WF_REPORT_PARAMS)
+				conn_request_state(connection, NS(conn, C_NETWORK_FAILURE), CS_HARD);
+		}
+	}
+
+	do {
+		while (!list_empty(&work_list)) {
+			w = list_first_entry(&work_list, struct drbd_work, list);
+			list_del_init(&w->list);
+			update_sender_timing_details(connection, w->cb);
+			w->cb(w, 1);
+		}
+	} while (dequeue_work_batch(&connection->data_work, &work_list));
+
+	return 0;
+}
@@ -1183,6 +1183,11 @@ extern void *idr_get_next(struct idr *idp, int *nextidp);
 	} while (0)
 #endif
 
+#ifndef srcu_dereference
+/* see c26d34a rcu: Add lockdep-enabled variants of rcu_dereference() */
+#define srcu_dereference(p, sp) rcu_dereference(p)
+#endif
+
 /* #ifndef COMPAT_HAVE_LIST_ENTRY_RCU */
 #ifndef list_entry_rcu
 #ifndef rcu_dereference_raw
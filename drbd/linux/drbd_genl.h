@@ -140,6 +140,11 @@ GENL_struct(DRBD_NLA_DISK_CONF, 3, disk_conf,
 GENL_struct(DRBD_NLA_RESOURCE_OPTS, 4, res_opts,
 	__str_field_def(1,	DRBD_GENLA_F_MANDATORY,	cpu_mask,       DRBD_CPU_MASK_SIZE)
 	__u32_field_def(2,	DRBD_GENLA_F_MANDATORY,	on_no_data, DRBD_ON_NO_DATA_DEF)
+	__u32_field_def(3,	0 /* OPTIONAL */,	stats_interval, DRBD_STATS_INTERVAL_DEF)
+	__str_field_def(4,	0 /* OPTIONAL */,	receiver_cpu_mask, DRBD_CPU_MASK_SIZE)
+	__str_field_def(5,	0 /* OPTIONAL */,	ack_receiver_cpu_mask, DRBD_CPU_MASK_SIZE)
+	__str_field_def(6,	0 /* OPTIONAL */,	worker_cpu_mask, DRBD_CPU_MASK_SIZE)
+	__str_field_def(7,	0 /* OPTIONAL */,	sender_cpu_mask, DRBD_CPU_MASK_SIZE)
 )
 
 GENL_struct(DRBD_NLA_NET_CONF, 5, net_conf,
@@ -180,6 +185,10 @@ GENL_struct(DRBD_NLA_NET_CONF, 5, net_conf,
 	__u32_field_def(34, 0 /* OPTIONAL */, sock_check_timeo, DRBD_SOCKET_CHECK_TIMEO_DEF)
 	__bin_field(35, 0 /* OPTIONAL */, my_addr2, 128)
 	__bin_field(36, 0 /* OPTIONAL */, peer_addr2, 128)
+	__u32_field_def(37, 0 /* OPTIONAL */, integrity_sample, DRBD_INTEGRITY_SAMPLE_DEF)
+	__str_field_def(38, 0 /* OPTIONAL */, transport_name, DRBD_TRANSPORT_NAME_MAX)
+	__flg_field_def(39, 0 /* OPTIONAL */,	multipath, DRBD_MULTIPATH_DEF)
+	__u32_field_def(40, 0 /* OPTIONAL */,	resume_timeout, DRBD_RESUME_TIMEOUT_DEF)
 )
 
 GENL_struct(DRBD_NLA_SET_ROLE_PARMS, 6, set_role_parms,
@@ -325,11 +334,43 @@ GENL_struct(DRBD_NLA_HELPER, 24, drbd_helper_info,
 	__u32_field(2, DRBD_GENLA_F_MANDATORY, helper_status)
 )
 
+/* Counters are deltas, accumulated since the previous broadcast,
+ * unless noted otherwise. */
+GENL_struct(DRBD_NLA_PERF_STATISTICS, 25, perf_statistics,
+	__u32_field(1, 0, perf_interval_ms)  /* time covered by this sample */
+	__u64_field(2, 0, perf_read_ios)  /* completed application reads */
+	__u64_field(3, 0, perf_write_ios)  /* completed application writes */
+	__u64_field(4, 0, perf_read_bytes)
+	__u64_field(5, 0, perf_write_bytes)
+	__u32_field(6, 0, perf_read_lat_p50)  /* (usec) */
+	__u32_field(7, 0, perf_read_lat_p90)  /* (usec) */
+	__u32_field(8, 0, perf_read_lat_p99)  /* (usec) */
+	__u32_field(9, 0, perf_write_lat_p50)  /* (usec) */
+	__u32_field(10, 0, perf_write_lat_p90)  /* (usec) */
+	__u32_field(11, 0, perf_write_lat_p99)  /* (usec) */
+	__u64_field(12, 0, perf_al_hits)
+	__u64_field(13, 0, perf_al_misses)
+	__u32_field(14, 0, perf_al_hit_ratio)  /* (permille) */
+	__u32_field(15, 0, perf_pp_in_use)  /* pages, current */
+	__u32_field(16, 0, perf_pp_in_use_by_net)  /* pages, current */
+	__u32_field(17, 0, perf_pp_vacant)  /* pages, current, global */
+	__u32_field(18, 0, perf_sndbuf_queued)  /* bytes, current */
+	__u32_field(19, 0, perf_sndbuf_size)  /* bytes, current */
+	__u32_field(20, 0, perf_resync_rate)  /* (KiB/s), current */
+	__u32_field(21, 0, perf_ap_in_flight)  /* sectors, current */
+	__u64_field(22, 0, perf_al_evicted)
+	__u32_field(23, 0, perf_al_transactions)
+)
+
 /*
  * Notifications and commands (genlmsghdr->cmd)
  */
 GENL_mc_group(events)
 
+	/* periodic statistics, see res_opts.stats_interval.
+	 * Separate group, so event listeners are not flooded. */
+GENL_mc_group(stats)
+
 	/* kernel -> userspace announcement of changes */
 GENL_notification(
 	DRBD_EVENT, 1, events,
@@ -533,3 +574,10 @@ GENL_notification(
 GENL_notification(
 	DRBD_INITIAL_STATE_DONE, 41, events,
 	GENL_tla_expected(DRBD_NLA_NOTIFICATION_HEADER, DRBD_F_REQUIRED))
+
+GENL_notification(
+	DRBD_PERF_STATISTICS, 42, stats,
+	GENL_tla_expected(DRBD_NLA_CFG_CONTEXT, DRBD_F_REQUIRED)
+	GENL_tla_expected(DRBD_NLA_DEVICE_STATISTICS, DRBD_F_REQUIRED)
+	GENL_tla_expected(DRBD_NLA_PEER_DEVICE_STATISTICS, DRBD_GENLA_F_MANDATORY)
+	GENL_tla_expected(DRBD_NLA_PERF_STATISTICS, DRBD_F_REQUIRED))
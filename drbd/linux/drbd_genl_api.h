@@ -46,6 +46,7 @@ enum drbd_state_info_bcast_reason {
 #undef linux
 
 #include <linux/drbd.h>
+#include <linux/drbd_limits.h> /* DRBD_TRANSPORT_NAME_MAX */
 #define GENL_MAGIC_VERSION	API_VERSION
 #define GENL_MAGIC_FAMILY	drbd
 #define GENL_MAGIC_FAMILY_HDRSZ	sizeof(struct drbd_genlmsghdr)
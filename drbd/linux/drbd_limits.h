@@ -220,6 +220,15 @@
 #define DRBD_ALWAYS_ASBP_DEF	0
 #define DRBD_USE_RLE_DEF	1
 #define DRBD_CSUMS_AFTER_CRASH_ONLY_DEF 0
+/* use my_addr2/peer_addr2 as second path: data and meta data each go over
+ * one path, with the other one as standby to fail over to.  Costs one
+ * memcpy() of all data sent, into a resend buffer of about sndbuf-size +
+ * rcvbuf-size (512KiB each, if not configured) per stream */
+#define DRBD_MULTIPATH_DEF	0
+
+/* the transport is loaded as module "drbd_transport_<name>",
+ * which needs to fit into MODULE_NAME_LEN */
+#define DRBD_TRANSPORT_NAME_MAX	32
 
 #define DRBD_AL_STRIPES_MIN     1
 #define DRBD_AL_STRIPES_MAX     1024
@@ -236,9 +245,28 @@
 #define DRBD_SOCKET_CHECK_TIMEO_DEF 0
 #define DRBD_SOCKET_CHECK_TIMEO_SCALE '1'
 
+/* digest only every Nth data packet, if the peer supports that */
+#define DRBD_INTEGRITY_SAMPLE_MIN 1
+#define DRBD_INTEGRITY_SAMPLE_MAX (1<<16)
+#define DRBD_INTEGRITY_SAMPLE_DEF 1
+#define DRBD_INTEGRITY_SAMPLE_SCALE '1'
+
+/* freeze IO for this long after a network failure, to resume the session
+ * on reconnect; unit deci-seconds.  Protocol C only, ignored for A and B */
+#define DRBD_RESUME_TIMEOUT_MIN 0	/* 0 = disabled */
+#define DRBD_RESUME_TIMEOUT_MAX 600	/* one minute */
+#define DRBD_RESUME_TIMEOUT_DEF 0	/* disabled */
+#define DRBD_RESUME_TIMEOUT_SCALE '1'
+
 #define DRBD_RS_DISCARD_GRANULARITY_MIN 0
 #define DRBD_RS_DISCARD_GRANULARITY_MAX (1<<20)  /* 1MiByte */
 #define DRBD_RS_DISCARD_GRANULARITY_DEF 0     /* disabled by default */
 #define DRBD_RS_DISCARD_GRANULARITY_SCALE '1' /* bytes */
 
+/* periodic performance statistics broadcast, unit deci-seconds */
+#define DRBD_STATS_INTERVAL_MIN 0	/* 0 = disabled */
+#define DRBD_STATS_INTERVAL_MAX 36000	/* one hour */
+#define DRBD_STATS_INTERVAL_DEF 0	/* disabled */
+#define DRBD_STATS_INTERVAL_SCALE '1'
+
 #endif
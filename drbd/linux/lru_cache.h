@@ -27,10 +27,13 @@
 #define LRU_CACHE_H
 
 #include <linux/list.h>
+#include <linux/rculist.h>
 #include <linux/slab.h>
 #include <linux/bitops.h>
 #include <linux/string.h> /* for memset */
 #include <linux/seq_file.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
 
 /* Compatibility code */
 #include "compat.h"
@@ -66,6 +69,34 @@ enum {
 	     pos = hlist_entry_safe((pos)->member.next, typeof(*(pos)), member))
 #define COMPAT_HLIST_FOR_EACH_ENTRY_HAS_THREE_PARAMETERS
 #endif
+#ifndef COMPAT_HLIST_FOR_EACH_ENTRY_RCU_HAS_THREE_PARAMETERS
+#ifdef hlist_for_each_entry_rcu
+#undef hlist_for_each_entry_rcu
+#endif
+#define hlist_for_each_entry_rcu(pos, head, member)			\
+	for (pos = hlist_entry_safe(rcu_dereference_raw((head)->first),	\
+			typeof(*(pos)), member);			\
+	     pos;							\
+	     pos = hlist_entry_safe(rcu_dereference_raw((pos)->member.next), \
+			typeof(*(pos)), member))
+#define COMPAT_HLIST_FOR_EACH_ENTRY_RCU_HAS_THREE_PARAMETERS
+#endif
+#ifndef COMPAT_HAVE_READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) do { ACCESS_ONCE(x) = (val); } while (0)
+#define COMPAT_HAVE_READ_ONCE
+#endif
+#ifndef __percpu
+#define __percpu
+#endif
+#ifndef COMPAT_HAVE_THIS_CPU_INC
+#define this_cpu_inc(pcp) do {				\
+	int cpu_ = get_cpu();				\
+	(*per_cpu_ptr(&(pcp), cpu_))++;			\
+	put_cpu();					\
+} while (0)
+#define COMPAT_HAVE_THIS_CPU_INC
+#endif
 /* End of Compatibility code */
 
 /*
@@ -195,7 +226,9 @@ write intent log information, three of which are mentioned here.
 struct lc_element {
 	struct hlist_node colision;
 	struct list_head list;		 /* LRU list or free list */
-	unsigned refcnt;
+	/* only ever changed under the user's lock, except by lc_try_get_rcu(),
+	 * which bumps an already non-zero refcnt without it */
+	atomic_t refcnt;
 	/* back "pointer" into lc_cache->element[index],
 	 * for paranoia, and for "lc_element_to_index" */
 	unsigned lc_index;
@@ -242,6 +275,12 @@ struct lru_cache {
 	/* statistics */
 	unsigned used; /* number of elements currently on in_use list */
 	unsigned long hits, misses, starving, locked, changed;
+	/* number of committed changes that replaced a label still in the
+	 * active set, i.e. did not come from the free list */
+	unsigned long evicted;
+	/* hits of lc_try_get_rcu(), which must not touch shared cachelines;
+	 * use lc_hits() for hits + rcu_hits */
+	unsigned long __percpu *rcu_hits;
 
 	/* see below: flag-bits for lru_cache */
 	unsigned long flags;
@@ -250,8 +289,9 @@ struct lru_cache {
 	void  *lc_private;
 	const char *name;
 
-	/* nr_elements there */
+	/* 1 << lc_slot_bits there, at least nr_elements */
 	struct hlist_head *lc_slot;
+	unsigned int lc_slot_bits;
 	struct lc_element **lc_element;
 };
 
@@ -294,11 +334,15 @@ extern void lc_del(struct lru_cache *lc, struct lc_element *element);
 
 extern struct lc_element *lc_get_cumulative(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr);
+extern struct lc_element *lc_try_get_rcu(struct lru_cache *lc, unsigned int enr,
+		spinlock_t *lock);
 extern struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr);
 extern unsigned int lc_put(struct lru_cache *lc, struct lc_element *e);
 extern void lc_committed(struct lru_cache *lc);
 
+extern unsigned long lc_hits(struct lru_cache *lc);
+
 struct seq_file;
 extern void lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc);
 
@@ -26,6 +26,9 @@
 #include <linux/module.h>
 #include <linux/bitops.h>
 #include <linux/slab.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/string.h> /* for memset */
 #include <linux/seq_file.h> /* for seq_printf */
 #include <linux/lru_cache.h>
@@ -97,9 +100,11 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 {
 	struct hlist_head *slot = NULL;
 	struct lc_element **element = NULL;
+	unsigned long __percpu *rcu_hits = NULL;
 	struct lru_cache *lc;
 	struct lc_element *e;
 	unsigned cache_obj_size = kmem_cache_size(cache);
+	unsigned slot_bits;
 	unsigned i;
 
 	WARN_ON(cache_obj_size < e_size);
@@ -111,12 +116,17 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	if (e_count > LC_MAX_ACTIVE)
 		return NULL;
 
-	slot = kcalloc(e_count, sizeof(struct hlist_head), GFP_KERNEL);
+	/* power of two, so lc_hash_slot() does not need a division */
+	slot_bits = max(1, order_base_2(e_count));
+	slot = kcalloc(1U << slot_bits, sizeof(struct hlist_head), GFP_KERNEL);
 	if (!slot)
 		goto out_fail;
 	element = kzalloc(e_count * sizeof(struct lc_element *), GFP_KERNEL);
 	if (!element)
 		goto out_fail;
+	rcu_hits = alloc_percpu(unsigned long);
+	if (!rcu_hits)
+		goto out_fail;
 
 	lc = kzalloc(sizeof(*lc), GFP_KERNEL);
 	if (!lc)
@@ -135,6 +145,8 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	lc->lc_cache = cache;
 	lc->lc_element = element;
 	lc->lc_slot = slot;
+	lc->lc_slot_bits = slot_bits;
+	lc->rcu_hits = rcu_hits;
 
 	/* preallocate all objects */
 	for (i = 0; i < e_count; i++) {
@@ -159,6 +171,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	}
 	kfree(lc);
 out_fail:
+	free_percpu(rcu_hits);
 	kfree(element);
 	kfree(slot);
 	return NULL;
@@ -185,6 +198,7 @@ void lc_destroy(struct lru_cache *lc)
 		return;
 	for (i = 0; i < lc->nr_elements; i++)
 		lc_free_by_index(lc, i);
+	free_percpu(lc->rcu_hits);
 	kfree(lc->lc_element);
 	kfree(lc->lc_slot);
 	kfree(lc);
@@ -200,6 +214,7 @@ void lc_destroy(struct lru_cache *lc)
 void lc_reset(struct lru_cache *lc)
 {
 	unsigned i;
+	int cpu;
 
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
@@ -207,13 +222,16 @@ void lc_reset(struct lru_cache *lc)
 	INIT_LIST_HEAD(&lc->to_be_changed);
 	lc->used = 0;
 	lc->hits = 0;
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(lc->rcu_hits, cpu) = 0;
 	lc->misses = 0;
 	lc->starving = 0;
 	lc->locked = 0;
 	lc->changed = 0;
+	lc->evicted = 0;
 	lc->pending_changes = 0;
 	lc->flags = 0;
-	memset(lc->lc_slot, 0, sizeof(struct hlist_head) * lc->nr_elements);
+	memset(lc->lc_slot, 0, sizeof(struct hlist_head) << lc->lc_slot_bits);
 
 	for (i = 0; i < lc->nr_elements; i++) {
 		struct lc_element *e = lc->lc_element[i];
@@ -228,6 +246,22 @@ void lc_reset(struct lru_cache *lc)
 	}
 }
 
+/**
+ * lc_hits - number of lookups that found the element in the active set
+ * @lc: the lru cache to operate on
+ *
+ * Includes the hits of lc_try_get_rcu().
+ */
+unsigned long lc_hits(struct lru_cache *lc)
+{
+	unsigned long hits = lc->hits;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hits += *per_cpu_ptr(lc->rcu_hits, cpu);
+	return hits;
+}
+
 /**
  * lc_seq_printf_stats - print stats about @lc into @seq
  * @seq: the seq_file to print into
@@ -244,12 +278,12 @@ void lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc)
 	 */
 	seq_printf(seq, "\t%s: used:%u/%u hits:%lu misses:%lu starving:%lu locked:%lu changed:%lu\n",
 		   lc->name, lc->used, lc->nr_elements,
-		   lc->hits, lc->misses, lc->starving, lc->locked, lc->changed);
+		   lc_hits(lc), lc->misses, lc->starving, lc->locked, lc->changed);
 }
 
 static struct hlist_head *lc_hash_slot(struct lru_cache *lc, unsigned int enr)
 {
-	return  lc->lc_slot + (enr % lc->nr_elements);
+	return  lc->lc_slot + hash_32(enr, lc->lc_slot_bits);
 }
 
 
@@ -302,7 +336,7 @@ struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr)
 bool lc_is_used(struct lru_cache *lc, unsigned int enr)
 {
 	struct lc_element *e = __lc_find(lc, enr, 1);
-	return e && e->refcnt;
+	return e && atomic_read(&e->refcnt);
 }
 
 /**
@@ -317,10 +351,10 @@ void lc_del(struct lru_cache *lc, struct lc_element *e)
 {
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt);
+	BUG_ON(atomic_read(&e->refcnt));
 
 	e->lc_number = e->lc_new_number = LC_FREE;
-	hlist_del_init(&e->colision);
+	hlist_del_init_rcu(&e->colision);
 	list_move(&e->list, &lc->free);
 	RETURN();
 }
@@ -340,10 +374,13 @@ static struct lc_element *lc_prepare_for_change(struct lru_cache *lc, unsigned n
 	e = list_entry(n, struct lc_element, list);
 	PARANOIA_LC_ELEMENT(lc, e);
 
+	/* lc_try_get_rcu() may still walk this element, possibly ending up
+	 * on the "wrong" hash chain.  That is only a missed fast path hit,
+	 * it will check the label after taking the reference anyways. */
 	e->lc_new_number = new_number;
 	if (!hlist_unhashed(&e->colision))
-		__hlist_del(&e->colision);
-	hlist_add_head(&e->colision, lc_hash_slot(lc, new_number));
+		hlist_del_rcu(&e->colision);
+	hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, new_number));
 	list_move(&e->list, &lc->to_be_changed);
 
 	return e;
@@ -390,13 +427,13 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 				RETURN(NULL);
 			/* ... unless the caller is aware of the implications,
 			 * probably preparing a cumulative transaction. */
-			++e->refcnt;
+			atomic_inc(&e->refcnt);
 			++lc->hits;
 			RETURN(e);
 		}
 		/* else: lc_new_number == lc_number; a real hit. */
 		++lc->hits;
-		if (e->refcnt++ == 0)
+		if (atomic_inc_return(&e->refcnt) == 1)
 			lc->used++;
 		list_move(&e->list, &lc->in_use); /* Not evictable... */
 		RETURN(e);
@@ -437,7 +474,7 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 	BUG_ON(!e);
 
 	clear_bit(__LC_STARVING, &lc->flags);
-	BUG_ON(++e->refcnt != 1);
+	BUG_ON(atomic_inc_return(&e->refcnt) != 1);
 	lc->used++;
 	lc->pending_changes++;
 
@@ -530,6 +567,61 @@ struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr)
 	return __lc_get(lc, enr, 0);
 }
 
+/**
+ * lc_try_get_rcu - lockless lc_try_get() for elements already in use
+ * @lc: the lru cache to operate on
+ * @enr: the label to look up
+ * @lock: the lock the user serializes all other operations on @lc with
+ *
+ * Like lc_try_get(), but to be called under rcu_read_lock() instead of the
+ * user's lock.  Only succeeds if @enr is in the committed active set and
+ * already referenced (refcnt > 0): then the element neither changes lists
+ * nor can it be evicted, and taking one more reference is a single atomic
+ * operation.  Everything else returns NULL, and the caller should fall back
+ * to lc_try_get() or lc_get() with @lock held.
+ *
+ * @lock is only taken to back out of the (rare) race with the element being
+ * recycled for a different label while we looked at it.
+ */
+struct lc_element *lc_try_get_rcu(struct lru_cache *lc, unsigned int enr,
+		spinlock_t *lock)
+{
+	struct lc_element *e;
+	unsigned long flags;
+
+	if (READ_ONCE(lc->flags) & LC_STARVING)
+		return NULL;
+
+	hlist_for_each_entry_rcu(e, lc_hash_slot(lc, enr), colision) {
+		if (READ_ONCE(e->lc_new_number) == enr)
+			break;
+	}
+	if (!e)
+		return NULL;
+
+	/* implies a full memory barrier if successful */
+	if (!atomic_inc_not_zero(&e->refcnt))
+		return NULL;
+
+	/* The label can only change while refcnt is zero,
+	 * or from "pending" to "committed". */
+	if (likely(READ_ONCE(e->lc_number) == enr &&
+		   READ_ONCE(e->lc_new_number) == enr)) {
+		this_cpu_inc(*lc->rcu_hits);
+		return e;
+	}
+
+	/* Not the element we were looking for, or still pending.
+	 * If ours was the last reference, lc_put() needs to move it to
+	 * the lru list, which we may only do under the user's lock. */
+	if (!atomic_add_unless(&e->refcnt, -1, 1)) {
+		spin_lock_irqsave(lock, flags);
+		lc_put(lc, e);
+		spin_unlock_irqrestore(lock, flags);
+	}
+	return NULL;
+}
+
 /**
  * lc_committed - tell @lc that pending changes have been recorded
  * @lc: the lru cache to operate on
@@ -546,7 +638,9 @@ void lc_committed(struct lru_cache *lc)
 	list_for_each_entry_safe(e, tmp, &lc->to_be_changed, list) {
 		/* count number of changes, not number of transactions */
 		++lc->changed;
-		e->lc_number = e->lc_new_number;
+		if (e->lc_number != LC_FREE)
+			++lc->evicted;
+		WRITE_ONCE(e->lc_number, e->lc_new_number);
 		list_move(&e->list, &lc->in_use);
 	}
 	lc->pending_changes = 0;
@@ -565,17 +659,20 @@ void lc_committed(struct lru_cache *lc)
  */
 unsigned int lc_put(struct lru_cache *lc, struct lc_element *e)
 {
+	unsigned int refcnt;
+
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt == 0);
+	BUG_ON(atomic_read(&e->refcnt) == 0);
 	BUG_ON(e->lc_number != e->lc_new_number);
-	if (--e->refcnt == 0) {
+	refcnt = atomic_dec_return(&e->refcnt);
+	if (refcnt == 0) {
 		/* move it to the front of LRU. */
 		list_move(&e->list, &lc->lru);
 		lc->used--;
 		clear_bit_unlock(__LC_STARVING, &lc->flags);
 	}
-	RETURN(e->refcnt);
+	RETURN(refcnt);
 }
 
 /**
@@ -620,14 +717,14 @@ void lc_set(struct lru_cache *lc, unsigned int enr, int index)
 
 	e = lc_element_by_index(lc, index);
 	BUG_ON(e->lc_number != e->lc_new_number);
-	BUG_ON(e->refcnt != 0);
+	BUG_ON(atomic_read(&e->refcnt) != 0);
 
 	e->lc_number = e->lc_new_number = enr;
-	hlist_del_init(&e->colision);
+	hlist_del_init_rcu(&e->colision);
 	if (enr == LC_FREE)
 		lh = &lc->free;
 	else {
-		hlist_add_head(&e->colision, lc_hash_slot(lc, enr));
+		hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, enr));
 		lh = &lc->lru;
 	}
 	list_move(&e->list, lh);
@@ -654,10 +751,10 @@ void lc_seq_dump_details(struct seq_file *seq, struct lru_cache *lc, char *utext
 		e = lc_element_by_index(lc, i);
 		if (e->lc_number != e->lc_new_number)
 			seq_printf(seq, "\t%5d: %6d %8d %6d ",
-				i, e->lc_number, e->lc_new_number, e->refcnt);
+				i, e->lc_number, e->lc_new_number, atomic_read(&e->refcnt));
 		else
 			seq_printf(seq, "\t%5d: %6d %-8s %6d ",
-				i, e->lc_number, "-\"-", e->refcnt);
+				i, e->lc_number, "-\"-", atomic_read(&e->refcnt));
 		if (detail)
 			detail(seq, e);
 		seq_putc(seq, '\n');
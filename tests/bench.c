@@ -0,0 +1,110 @@
+/*
+   bench.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bench.h"
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rand_state = 0x2545f4914f6cdd1dULL;
+
+void bench_srand(uint64_t seed)
+{
+	rand_state = seed ? seed : 0x2545f4914f6cdd1dULL;
+}
+
+uint64_t bench_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+uint64_t bench_rand_below(uint64_t n)
+{
+	return bench_rand() % n;
+}
+
+void bench_trace_add(struct bench_trace *t, uint32_t ref)
+{
+	if (t->n == t->alloc) {
+		t->alloc = t->alloc ? 2 * t->alloc : 4096;
+		t->ref = realloc(t->ref, t->alloc * sizeof(*t->ref));
+		if (!t->ref) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	t->ref[t->n++] = ref;
+}
+
+void bench_trace_free(struct bench_trace *t)
+{
+	free(t->ref);
+	t->ref = NULL;
+	t->n = t->alloc = 0;
+}
+
+void bench_trace_uniform(struct bench_trace *t, size_t n, uint32_t range)
+{
+	t->name = "random";
+	while (n--)
+		bench_trace_add(t, bench_rand_below(range));
+}
+
+/* Gray et al., "Quickly generating billion-record synthetic databases" */
+void bench_trace_zipf(struct bench_trace *t, size_t n, uint32_t range, double theta)
+{
+	double zetan = 0, zeta2, alpha, eta, u, uz;
+	uint64_t rank;
+	uint32_t i;
+
+	for (i = 1; i <= range; i++)
+		zetan += 1.0 / pow(i, theta);
+	zeta2 = 1.0 + 1.0 / pow(2, theta);
+	alpha = 1.0 / (1.0 - theta);
+	eta = (1.0 - pow(2.0 / range, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+
+	t->name = "zipf";
+	while (n--) {
+		u = (double)bench_rand() / (double)UINT64_MAX;
+		uz = u * zetan;
+		if (uz < 1.0)
+			rank = 0;
+		else if (uz < zeta2)
+			rank = 1;
+		else
+			rank = (uint64_t)(range * pow(eta * u - eta + 1.0, alpha));
+		if (rank >= range)
+			rank = range - 1;
+		/* scatter: the popular ones are not next to each other */
+		bench_trace_add(t, (rank * 2654435761ULL) % range);
+	}
+}
+
+void bench_trace_seq(struct bench_trace *t, size_t n, uint32_t range, unsigned repeat)
+{
+	uint64_t i;
+
+	t->name = "sequential";
+	for (i = 0; i < n; i++)
+		bench_trace_add(t, (i / repeat) % range);
+}
@@ -0,0 +1,57 @@
+/*
+   bench.h
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Shared parts of the userspace benchmarks in this directory: timing,
+   a reproducible random number generator, and synthetic reference traces
+   (random, zipfian, sequential).
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* monotonic clock, in nanoseconds */
+extern uint64_t bench_now_ns(void);
+
+/* xorshift64*, reproducible for a given seed */
+extern void bench_srand(uint64_t seed);
+extern uint64_t bench_rand(void);
+/* uniform in [0, n) */
+extern uint64_t bench_rand_below(uint64_t n);
+
+struct bench_trace {
+	const char *name;
+	uint32_t *ref;
+	size_t n;
+	size_t alloc;
+};
+
+extern void bench_trace_add(struct bench_trace *t, uint32_t ref);
+extern void bench_trace_free(struct bench_trace *t);
+
+/* @n references, uniformly distributed over [0, @range) */
+extern void bench_trace_uniform(struct bench_trace *t, size_t n, uint32_t range);
+/* @n references over [0, @range), zipf distributed with exponent @theta
+ * (0 < theta < 1; 0.99 is the usual "skewed" setting); the popular
+ * ones are scattered over the range, not clustered at its start */
+extern void bench_trace_zipf(struct bench_trace *t, size_t n, uint32_t range, double theta);
+/* @n references, each value @repeat times in a row, ascending, wrapping
+ * around at @range: a sequential writer */
+extern void bench_trace_seq(struct bench_trace *t, size_t n, uint32_t range, unsigned repeat);
+
+/* operations per second */
+static inline double bench_ops_per_sec(uint64_t ops, uint64_t ns)
+{
+	return ns ? ops * 1e9 / ns : 0;
+}
+
+#endif
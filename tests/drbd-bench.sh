@@ -0,0 +1,181 @@
+#!/bin/bash
+#
+# drbd-bench.sh - single host DRBD benchmarks over the loop transport
+#
+# Two resources on this host replicate to each other over the in-kernel
+# loop transport (net option transport-name=loop), so no network stack is
+# involved, and the numbers show what DRBD itself costs.  Every volume is
+# backed by a loop device on a file in $BENCH_DIR.
+#
+# Needs root, the drbd module of this tree loaded, and a drbdsetup/drbdmeta
+# built against its linux/drbd_genl.h (for --transport-name).
+#
+#   drbd-bench.sh replicate [volumes] [MiB]
+#	write MiB to each volume of the primary, report MiB/s and IOPS
+#   drbd-bench.sh failover [volume counts...]
+#	for each volume count, time moving the primary role of all volumes
+#	to the other resource, and a disconnect/reconnect until all volumes
+#	are UpToDate again; report milliseconds, averaged over BENCH_ROUNDS
+#
+# Environment:
+#   BENCH_DIR		backing files, default /dev/shm/drbd-bench
+#   BENCH_VOL_MB	backing device size per volume, default 64
+#   BENCH_PROTOCOL	replication protocol, default C
+#   BENCH_ROUNDS	repetitions per failover measurement, default 5
+
+set -e
+
+BENCH_DIR=${BENCH_DIR:-/dev/shm/drbd-bench}
+BENCH_VOL_MB=${BENCH_VOL_MB:-64}
+BENCH_PROTOCOL=${BENCH_PROTOCOL:-C}
+BENCH_ROUNDS=${BENCH_ROUNDS:-5}
+
+RES_A=bench_a
+RES_B=bench_b
+MINOR_A=200
+MINOR_B=400
+ADDR_A=ipv4:127.0.0.1:7788
+ADDR_B=ipv4:127.0.0.1:7789
+
+die() { echo "$*" >&2; exit 1; }
+
+now_ms() { echo $(( $(date +%s%N) / 1000000 )); }
+
+# wait_for <timeout s> <command...>: until the command succeeds
+wait_for()
+{
+	local deadline=$(( $(date +%s) + $1 ))
+	shift
+	until "$@"; do
+		[ $(date +%s) -lt $deadline ] || die "timeout waiting for: $*"
+		sleep 0.01
+	done
+}
+
+# all_minors <first minor> <volumes> <drbdsetup command> <expected output>
+all_minors()
+{
+	local first=$1 n=$2 cmd=$3 want=$4 v
+	for (( v = 0; v < n; v++ )); do
+		[ "$(drbdsetup $cmd $((first + v)) 2>/dev/null)" = "$want" ] || return 1
+	done
+}
+
+backing_dev()
+{
+	local f=$BENCH_DIR/$1
+	[ -e $f ] || truncate -s ${BENCH_VOL_MB}M $f
+	losetup -f --show $f
+}
+
+setup_resource()
+{
+	local res=$1 first=$2 n=$3 v dev
+	drbdsetup new-resource $res
+	for (( v = 0; v < n; v++ )); do
+		dev=$(backing_dev $res.$v)
+		echo $dev >> $BENCH_DIR/loopdevs
+		drbdmeta --force $((first + v)) v08 $dev internal create-md > /dev/null
+		drbdsetup new-minor $res $((first + v)) $v
+		drbdsetup attach $((first + v)) $dev $dev internal
+	done
+}
+
+# setup_pair <volumes>: two connected resources, all volumes UpToDate
+setup_pair()
+{
+	local n=$1 v
+	mkdir -p $BENCH_DIR
+	: > $BENCH_DIR/loopdevs
+	setup_resource $RES_A $MINOR_A $n
+	setup_resource $RES_B $MINOR_B $n
+	connect_pair
+	wait_for 30 all_minors $MINOR_A $n cstate Connected
+	# skip the initial sync, both sides are zero anyways
+	for (( v = 0; v < n; v++ )); do
+		drbdsetup new-current-uuid --clear-bitmap $((MINOR_A + v))
+	done
+	wait_for 30 all_minors $MINOR_B $n dstate UpToDate/UpToDate
+}
+
+connect_pair()
+{
+	drbdsetup connect $RES_A $ADDR_A $ADDR_B --protocol=$BENCH_PROTOCOL --transport-name=loop
+	drbdsetup connect $RES_B $ADDR_B $ADDR_A --protocol=$BENCH_PROTOCOL --transport-name=loop
+}
+
+teardown_pair()
+{
+	drbdsetup down $RES_A 2>/dev/null || true
+	drbdsetup down $RES_B 2>/dev/null || true
+	if [ -e $BENCH_DIR/loopdevs ]; then
+		xargs -r -n1 losetup -d < $BENCH_DIR/loopdevs || true
+	fi
+	rm -rf $BENCH_DIR
+}
+
+cmd_replicate()
+{
+	local n=${1:-1} mb=${2:-32} v t0 t1 ms
+	setup_pair $n
+	drbdsetup primary $MINOR_A
+	t0=$(now_ms)
+	for (( v = 0; v < n; v++ )); do
+		dd if=/dev/zero of=/dev/drbd$((MINOR_A + v)) bs=4k count=$((mb * 256)) \
+			oflag=direct status=none &
+	done
+	wait
+	t1=$(now_ms)
+	ms=$(( t1 - t0 > 0 ? t1 - t0 : 1 ))
+	echo "protocol $BENCH_PROTOCOL volumes $n: $((n * mb)) MiB in $ms ms," \
+		"$((n * mb * 1000 / ms)) MiB/s, $((n * mb * 256 * 1000 / ms)) IOPS (4k, direct)"
+}
+
+# set_role <role> <first minor> <volumes>
+set_role()
+{
+	local v
+	for (( v = 0; v < $3; v++ )); do
+		drbdsetup $1 $(($2 + v))
+	done
+}
+
+cmd_failover()
+{
+	local counts="${*:-1 8 16 32 64}" n r t0 t_role t_conn
+	printf "%8s %14s %14s\n" volumes "switchover ms" "reconnect ms"
+	for n in $counts; do
+		setup_pair $n
+		t_role=0 t_conn=0
+		for (( r = 0; r < BENCH_ROUNDS; r++ )); do
+			set_role primary $MINOR_A $n
+			t0=$(now_ms)
+			set_role secondary $MINOR_A $n
+			set_role primary $MINOR_B $n
+			t_role=$(( t_role + $(now_ms) - t0 ))
+			set_role secondary $MINOR_B $n
+
+			# connection wide state changes, one per direction
+			t0=$(now_ms)
+			drbdsetup disconnect $ADDR_A $ADDR_B
+			drbdsetup disconnect $ADDR_B $ADDR_A
+			connect_pair
+			wait_for 30 all_minors $MINOR_A $n dstate UpToDate/UpToDate
+			t_conn=$(( t_conn + $(now_ms) - t0 ))
+		done
+		printf "%8d %14d %14d\n" $n $(( t_role / BENCH_ROUNDS )) $(( t_conn / BENCH_ROUNDS ))
+		teardown_pair
+	done
+}
+
+[ $(id -u) = 0 ] || die "need to be root"
+[ -e /proc/drbd ] || die "drbd module not loaded"
+trap teardown_pair EXIT
+
+cmd=$1
+shift || true
+case $cmd in
+replicate)	cmd_replicate "$@" ;;
+failover)	cmd_failover "$@" ;;
+*)		die "usage: $0 {replicate [volumes] [MiB] | failover [volume counts...]}" ;;
+esac
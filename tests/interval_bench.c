@@ -0,0 +1,230 @@
+/*
+   interval_bench.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Conflict detection against the requests in flight, the way
+   drbd_req.c uses device->write_requests: for each new request, look for
+   an overlapping one, insert the new one, and remove the oldest once
+   "depth" requests are in flight.
+
+   Compares drbd_find_overlap() of drbd/drbd_interval.c (built on top of
+   kshim/) with the same walk without pruning subtrees that end below the
+   request (what drbd_find_overlap() did before), and with per-extent
+   buckets: a hash table of 4MiB extents, each request linked into the
+   bucket of every extent it touches.  All three must find the same
+   number of conflicts.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+ */
+
+#include <linux/rbtree.h>
+#include <unistd.h>
+#include "drbd_interval.h"
+#include "bench.h"
+
+#define EXTENT_SHIFT	13	/* 4MiB in sectors, like the activity log */
+
+struct bucket_link {
+	struct hlist_node node;
+	struct request *req;
+};
+
+struct request {
+	struct drbd_interval i;
+	/* a request of at most 4MiB touches at most two extents */
+	struct bucket_link link[2];
+};
+
+struct structure {
+	const char *name;
+	void (*insert)(struct request *);
+	void (*remove)(struct request *);
+	bool (*overlaps)(sector_t sector, unsigned int size);
+};
+
+/* the red-black interval tree of drbd_interval.c */
+static struct rb_root root = RB_ROOT;
+
+static void tree_insert(struct request *r)
+{
+	drbd_insert_interval(&root, &r->i);
+}
+
+static void tree_remove(struct request *r)
+{
+	drbd_remove_interval(&root, &r->i);
+}
+
+static bool tree_overlaps(sector_t sector, unsigned int size)
+{
+	return drbd_find_overlap(&root, sector, size) != NULL;
+}
+
+/* drbd_find_overlap() without the "sector >= here->end" pruning */
+static bool tree_noprune_overlaps(sector_t sector, unsigned int size)
+{
+	struct rb_node *node = root.rb_node;
+	sector_t end = sector + (size >> 9);
+
+	while (node) {
+		struct drbd_interval *here = rb_entry(node, struct drbd_interval, rb);
+
+		if (node->rb_left &&
+		    sector < rb_entry(node->rb_left, struct drbd_interval, rb)->end)
+			node = node->rb_left;
+		else if (here->sector < end &&
+			 sector < here->sector + (here->size >> 9))
+			return true;
+		else if (sector >= here->sector)
+			node = node->rb_right;
+		else
+			break;
+	}
+	return false;
+}
+
+/* per-extent buckets */
+static struct hlist_head *buckets;
+static unsigned int bucket_bits;
+
+static struct hlist_head *bucket(sector_t sector)
+{
+	return &buckets[hash_32(sector >> EXTENT_SHIFT, bucket_bits)];
+}
+
+static void buckets_insert(struct request *r)
+{
+	sector_t first = r->i.sector >> EXTENT_SHIFT;
+	sector_t last = (r->i.sector + (r->i.size >> 9) - 1) >> EXTENT_SHIFT;
+	int k;
+
+	for (k = 0; k <= last - first; k++) {
+		r->link[k].req = r;
+		hlist_add_head_rcu(&r->link[k].node, bucket((first + k) << EXTENT_SHIFT));
+	}
+}
+
+static void buckets_remove(struct request *r)
+{
+	sector_t first = r->i.sector >> EXTENT_SHIFT;
+	sector_t last = (r->i.sector + (r->i.size >> 9) - 1) >> EXTENT_SHIFT;
+	int k;
+
+	for (k = 0; k <= last - first; k++)
+		hlist_del_rcu(&r->link[k].node);
+}
+
+static bool buckets_overlaps(sector_t sector, unsigned int size)
+{
+	sector_t end = sector + (size >> 9);
+	sector_t enr;
+	struct bucket_link *l;
+
+	for (enr = sector >> EXTENT_SHIFT; enr <= (end - 1) >> EXTENT_SHIFT; enr++) {
+		hlist_for_each_entry(l, bucket(enr << EXTENT_SHIFT), node) {
+			struct drbd_interval *i = &l->req->i;
+
+			if (i->sector < end && sector < i->sector + (i->size >> 9))
+				return true;
+		}
+	}
+	return false;
+}
+
+static struct structure structures[] = {
+	{ "rbtree", tree_insert, tree_remove, tree_overlaps },
+	{ "rbtree-noprune", tree_insert, tree_remove, tree_noprune_overlaps },
+	{ "buckets", buckets_insert, buckets_remove, buckets_overlaps },
+};
+
+/* trace entries are in units of @size */
+static void run(struct structure *s, struct bench_trace *t, unsigned int size,
+		unsigned int depth)
+{
+	struct request *reqs = calloc(depth, sizeof(*reqs));
+	unsigned long conflicts = 0;
+	uint64_t t0, ns;
+	size_t n;
+
+	if (!reqs) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	t0 = bench_now_ns();
+	for (n = 0; n < t->n; n++) {
+		struct request *r = &reqs[n % depth];
+		sector_t sector = (sector_t)t->ref[n] * (size >> 9);
+
+		if (n >= depth)
+			s->remove(r);
+		if (s->overlaps(sector, size))
+			conflicts++;
+		r->i.sector = sector;
+		r->i.size = size;
+		s->insert(r);
+	}
+	for (n = 0; n < depth && n < t->n; n++)
+		s->remove(&reqs[n]);
+	ns = bench_now_ns() - t0;
+
+	printf("%-12s %-15s %9.2f %9.1f %10lu\n", t->name, s->name,
+	       bench_ops_per_sec(t->n, ns) / 1e6, (double)ns / t->n, conflicts);
+	free(reqs);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d depth] [-b request size in KiB] [-r device size in GiB]\n"
+		"	[-n requests] [-z theta] [-s seed]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int depth = 1024, size_kb = 32, dev_gb = 64;
+	size_t n = 2000000;
+	double theta = 0.99;
+	struct bench_trace t[3] = { };
+	unsigned int range;
+	int c, i, k;
+
+	while ((c = getopt(argc, argv, "d:b:r:n:z:s:")) != -1) {
+		switch (c) {
+		case 'd': depth = strtoul(optarg, NULL, 0); break;
+		case 'b': size_kb = strtoul(optarg, NULL, 0); break;
+		case 'r': dev_gb = strtoul(optarg, NULL, 0); break;
+		case 'n': n = strtoul(optarg, NULL, 0); break;
+		case 'z': theta = strtod(optarg, NULL); break;
+		case 's': bench_srand(strtoull(optarg, NULL, 0)); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (!depth || !size_kb || size_kb > 4096 || !dev_gb || theta <= 0 || theta >= 1)
+		usage(argv[0]);
+
+	bucket_bits = order_base_2(2 * depth);
+	buckets = calloc(1U << bucket_bits, sizeof(*buckets));
+	if (!buckets) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	range = (uint64_t)dev_gb * 1024 * 1024 / size_kb;
+	bench_trace_uniform(&t[0], n, range);
+	bench_trace_zipf(&t[1], n, range, theta);
+	bench_trace_seq(&t[2], n, range, 1);
+
+	printf("# %u requests of %u KiB in flight, %u GiB device\n", depth, size_kb, dev_gb);
+	printf("%-12s %-15s %9s %9s %10s\n", "trace", "structure", "Mreqs/s", "ns/req", "conflicts");
+	for (i = 0; i < 3; i++) {
+		for (k = 0; k < sizeof(structures) / sizeof(structures[0]); k++)
+			run(&structures[k], &t[i], size_kb << 10, depth);
+		bench_trace_free(&t[i]);
+	}
+	return 0;
+}
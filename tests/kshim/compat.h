@@ -0,0 +1,7 @@
+/* what compat/tests/ would find on a current kernel, see kshim.h */
+#define COMPAT_HAVE_BOOL_TYPE
+#define COMPAT_HAVE_CLEAR_BIT_UNLOCK
+#define COMPAT_HAVE_READ_ONCE
+#define COMPAT_HAVE_THIS_CPU_INC
+#define COMPAT_HLIST_FOR_EACH_ENTRY_HAS_THREE_PARAMETERS
+#define COMPAT_HLIST_FOR_EACH_ENTRY_RCU_HAS_THREE_PARAMETERS
@@ -0,0 +1,204 @@
+/*
+   kshim.h
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Just enough of the kernel API to build some of the self contained
+   parts of drbd (lru_cache.c, drbd_interval.c) as userspace programs,
+   for the benchmarks in this directory.  Single threaded: locks and RCU
+   are no-ops, there is exactly one "possible cpu".
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+/* keep drbd_wrappers.h out, the few helpers needed from it are below */
+#define _DRBD_WRAPPERS_H
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef u64 sector_t;
+typedef unsigned gfp_t;
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(4, 9, 0)
+
+#define __percpu
+#define __force
+#define __user
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#define barrier()	__asm__ __volatile__("" : : : "memory")
+#define smp_mb()	__sync_synchronize()
+#define smp_rmb()	__sync_synchronize()
+#define smp_wmb()	__sync_synchronize()
+#define READ_ONCE(x)	(*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val) do { *(volatile typeof(x) *)&(x) = (val); } while (0)
+
+#define BUG() do {							\
+	fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__);		\
+	abort();							\
+} while (0)
+#define BUG_ON(c) do { if (unlikely(c)) BUG(); } while (0)
+#define WARN_ON(c) ({							\
+	int __c = !!(c);						\
+	if (unlikely(__c))						\
+		fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); \
+	__c;								\
+})
+
+#define EXPORT_SYMBOL(x)
+#define MODULE_LICENSE(x)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b)	({ typeof(a) __a = (a); typeof(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a, b)	({ typeof(a) __a = (a); typeof(b) __b = (b); __a > __b ? __a : __b; })
+#define min_t(t, a, b)	min((t)(a), (t)(b))
+#define max_t(t, a, b)	max((t)(a), (t)(b))
+#define IS_ALIGNED(x, a) (((x) & ((typeof(x))(a) - 1)) == 0)
+
+/* bitops, atomic like the kernel's */
+#define BITS_PER_LONG	(8 * sizeof(long))
+#define BIT_WORD(nr)	((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)	(1UL << ((nr) % BITS_PER_LONG))
+
+static inline int test_and_set_bit(unsigned nr, volatile unsigned long *addr)
+{
+	unsigned long mask = BIT_MASK(nr);
+	return !!(__atomic_fetch_or(addr + BIT_WORD(nr), mask, __ATOMIC_SEQ_CST) & mask);
+}
+static inline void set_bit(unsigned nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+static inline void clear_bit(unsigned nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+static inline void clear_bit_unlock(unsigned nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_RELEASE);
+}
+static inline void __set_bit(unsigned nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+static inline int test_bit(unsigned nr, const volatile unsigned long *addr)
+{
+	return !!(addr[BIT_WORD(nr)] & BIT_MASK(nr));
+}
+#define cmpxchg(ptr, old, new) __sync_val_compare_and_swap(ptr, old, new)
+
+typedef struct { int counter; } atomic_t;
+#define atomic_read(v)		READ_ONCE((v)->counter)
+#define atomic_set(v, i)	WRITE_ONCE((v)->counter, i)
+#define atomic_inc(v)		((void)__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(v)		((void)__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_inc_return(v)	__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_return(v)	__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+static inline int atomic_add_unless(atomic_t *v, int a, int u)
+{
+	int c = atomic_read(v);
+
+	while (c != u) {
+		if (__atomic_compare_exchange_n(&v->counter, &c, c + a, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return 1;
+	}
+	return 0;
+}
+#define atomic_inc_not_zero(v)	atomic_add_unless((v), 1, 0)
+
+/* log2, hash */
+static inline int ilog2(unsigned long n)
+{
+	return BITS_PER_LONG - 1 - __builtin_clzl(n);
+}
+#define order_base_2(n) ((n) > 1 ? ilog2((n) - 1) + 1 : 0)
+#define GOLDEN_RATIO_32 0x61C88647
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+/* memory */
+#define GFP_KERNEL	0
+#define GFP_NOIO	0
+struct kmem_cache {
+	size_t size;
+};
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		size_t align, unsigned long flags, void *ctor)
+{
+	struct kmem_cache *c = malloc(sizeof(*c));
+
+	if (c)
+		c->size = size;
+	return c;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *c) { free(c); }
+static inline unsigned kmem_cache_size(struct kmem_cache *c) { return c->size; }
+static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp) { return malloc(c->size); }
+static inline void kmem_cache_free(struct kmem_cache *c, void *p) { free(p); }
+#define kmalloc(size, gfp)	malloc(size)
+#define kzalloc(size, gfp)	calloc(1, size)
+#define kcalloc(n, size, gfp)	calloc(n, size)
+#define kfree(p)		free(p)
+
+/* one possible cpu */
+#define alloc_percpu(type)	((type *)calloc(1, sizeof(type)))
+#define free_percpu(p)		free(p)
+#define per_cpu_ptr(p, cpu)	((void)(cpu), (p))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define get_cpu()		0
+#define put_cpu()		do { } while (0)
+#define this_cpu_inc(pcp)	((pcp)++)
+
+/* no concurrency */
+typedef struct { int locked; } spinlock_t;
+#define spin_lock_init(l)		((l)->locked = 0)
+#define spin_lock_irqsave(l, f)		do { (f) = 0; (l)->locked = 1; } while (0)
+#define spin_unlock_irqrestore(l, f)	do { (void)(f); (l)->locked = 0; } while (0)
+#define rcu_read_lock()			do { } while (0)
+#define rcu_read_unlock()		do { } while (0)
+#define rcu_dereference(p)		READ_ONCE(p)
+#define rcu_dereference_raw(p)		READ_ONCE(p)
+#define rcu_assign_pointer(p, v)	WRITE_ONCE(p, v)
+
+/* seq_file on top of stdio */
+struct seq_file {
+	FILE *f;
+};
+static inline void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(m->f, fmt, ap);
+	va_end(ap);
+}
+#define seq_putc(m, c)	fputc(c, (m)->f)
+#define seq_puts(m, s)	fputs(s, (m)->f)
+
+#include "kshim_list.h"
+#include "kshim_rbtree.h"
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Red-black trees as in <linux/rbtree.h>, with the augmented tree helpers
+ * of older kernels (rb_augment_*), which drbd_interval.c uses.  Part of
+ * kshim.h, implemented in rbtree.c.
+ */
+
+#ifndef KSHIM_RBTREE_H
+#define KSHIM_RBTREE_H
+
+#define RB_RED		0
+#define RB_BLACK	1
+
+struct rb_node {
+	struct rb_node *__rb_parent;
+	int __rb_color;
+	struct rb_node *rb_right;
+	struct rb_node *rb_left;
+};
+
+struct rb_root {
+	struct rb_node *rb_node;
+};
+
+#define RB_ROOT		(struct rb_root) { NULL, }
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define rb_parent(r)	((r)->__rb_parent)
+
+#define RB_EMPTY_ROOT(root)	((root)->rb_node == NULL)
+#define RB_EMPTY_NODE(node)	(rb_parent(node) == (node))
+#define RB_CLEAR_NODE(node)	((node)->__rb_parent = (node))
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **rb_link)
+{
+	node->__rb_parent = parent;
+	node->__rb_color = RB_RED;
+	node->rb_left = node->rb_right = NULL;
+	*rb_link = node;
+}
+
+extern void rb_insert_color(struct rb_node *, struct rb_root *);
+extern void rb_erase(struct rb_node *, struct rb_root *);
+extern struct rb_node *rb_next(const struct rb_node *);
+extern struct rb_node *rb_first(const struct rb_root *);
+
+typedef void (*rb_augment_f)(struct rb_node *node, void *data);
+extern void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data);
+extern struct rb_node *rb_augment_erase_begin(struct rb_node *node);
+extern void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data);
+
+#endif
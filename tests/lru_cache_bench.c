@@ -0,0 +1,213 @@
+/*
+   lru_cache_bench.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Replays activity log reference traces against drbd/lru_cache.c, built
+   in userspace on top of kshim/.  Used the way drbd uses its act_log:
+   every reference takes an element with lc_get() (or first tries
+   lc_try_get_rcu(), as drbd_al_begin_io_fastpath() does), pending changes
+   are committed as one transaction when lc_get() cannot make progress,
+   and up to "depth" references are in flight before the oldest one is
+   put again.
+
+   Traces are random, zipfian or sequential, or read from a file in the
+   format of the act_log_trace debugfs file (see al_trace_entries).
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+ */
+
+#include <linux/lru_cache.h>
+#include <unistd.h>
+#include "bench.h"
+
+struct bench_extent {
+	struct lc_element lce;
+};
+
+struct run {
+	struct lru_cache *lc;
+	spinlock_t lock;
+	bool rcu;
+	unsigned depth;
+	struct lc_element **in_flight;
+	unsigned head, cnt;
+	unsigned long transactions;
+};
+
+static void commit(struct run *r)
+{
+	if (!r->lc->pending_changes)
+		return;
+	BUG_ON(!lc_try_lock_for_transaction(r->lc));
+	lc_committed(r->lc);
+	lc_unlock(r->lc);
+	r->transactions++;
+}
+
+static void complete_oldest(struct run *r)
+{
+	unsigned tail = (r->head + r->depth - r->cnt) % r->depth;
+	struct lc_element *e = r->in_flight[tail];
+
+	BUG_ON(!r->cnt);
+	/* a request is submitted only after its transaction */
+	if (e->lc_number != e->lc_new_number)
+		commit(r);
+	lc_put(r->lc, e);
+	r->cnt--;
+}
+
+static void reference(struct run *r, unsigned int enr)
+{
+	struct lc_element *e = NULL;
+
+	if (r->rcu)
+		e = lc_try_get_rcu(r->lc, enr, &r->lock);
+	while (!e) {
+		e = lc_get(r->lc, enr);
+		if (e)
+			break;
+		/* starving, too many pending changes, or enr itself is
+		 * pending: write the transaction, or wait for completions */
+		if (r->lc->pending_changes)
+			commit(r);
+		else
+			complete_oldest(r);
+	}
+	if (r->cnt == r->depth)
+		complete_oldest(r);
+	r->in_flight[r->head] = e;
+	r->head = (r->head + 1) % r->depth;
+	r->cnt++;
+}
+
+static void replay(struct bench_trace *t, unsigned elements, unsigned pending,
+		   unsigned depth, bool rcu)
+{
+	struct kmem_cache *cache = kmem_cache_create("bench_al", sizeof(struct bench_extent), 0, 0, NULL);
+	struct run r = { .rcu = rcu, .depth = depth };
+	uint64_t t0, ns;
+	unsigned long hits;
+	size_t i;
+
+	r.lc = lc_create("act_log", cache, pending, elements, sizeof(struct bench_extent), 0);
+	r.in_flight = calloc(depth, sizeof(*r.in_flight));
+	if (!r.lc || !r.in_flight) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	spin_lock_init(&r.lock);
+
+	t0 = bench_now_ns();
+	for (i = 0; i < t->n; i++)
+		reference(&r, t->ref[i]);
+	while (r.cnt)
+		complete_oldest(&r);
+	ns = bench_now_ns() - t0;
+
+	hits = lc_hits(r.lc);
+	printf("%-12s %-6s %9.2f %7.2f %12lu %10lu %10lu %9lu\n",
+	       t->name, rcu ? "rcu" : "lc_get",
+	       bench_ops_per_sec(t->n, ns) / 1e6,
+	       hits + r.lc->misses ? 100.0 * hits / (hits + r.lc->misses) : 0,
+	       r.transactions, r.lc->changed, r.lc->evicted, r.lc->starving);
+
+	lc_destroy(r.lc);
+	free(r.in_flight);
+	kmem_cache_destroy(cache);
+}
+
+/* The act_log_trace debugfs file: one extent number per line for each
+ * granted reference, "M <enr>" / "S <enr>" for references that were not
+ * granted (not in the active set, or starving), "T" for transactions.
+ * Only granted references are replayed; those that were not show up again
+ * when they are retried. */
+static void read_trace(struct bench_trace *t, const char *fn)
+{
+	unsigned long commits = 0, misses = 0, starving = 0;
+	char line[128];
+	unsigned int enr;
+	FILE *f;
+
+	f = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+	if (!f) {
+		perror(fn);
+		exit(1);
+	}
+	t->name = "file";
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == 'T')
+			commits++;
+		else if (sscanf(line, "M %u", &enr) == 1)
+			misses++;
+		else if (sscanf(line, "S %u", &enr) == 1)
+			starving++;
+		else if (sscanf(line, "%u", &enr) == 1)
+			bench_trace_add(t, enr);
+	}
+	if (f != stdin)
+		fclose(f);
+	printf("# %s: %zu references, recorded: %lu transactions, %lu not granted, %lu starving\n",
+	       fn, t->n, commits, misses, starving);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-e elements] [-p max pending] [-d depth] [-r extents]\n"
+		"	[-n references] [-z theta] [-s seed] [-f trace file]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned elements = 1237, pending = 64, depth = 128, range = 65536;
+	size_t n = 2000000;
+	double theta = 0.99;
+	const char *file = NULL;
+	struct bench_trace t[3] = { };
+	int c, i, nr_traces;
+
+	while ((c = getopt(argc, argv, "e:p:d:r:n:z:s:f:")) != -1) {
+		switch (c) {
+		case 'e': elements = strtoul(optarg, NULL, 0); break;
+		case 'p': pending = strtoul(optarg, NULL, 0); break;
+		case 'd': depth = strtoul(optarg, NULL, 0); break;
+		case 'r': range = strtoul(optarg, NULL, 0); break;
+		case 'n': n = strtoul(optarg, NULL, 0); break;
+		case 'z': theta = strtod(optarg, NULL); break;
+		case 's': bench_srand(strtoull(optarg, NULL, 0)); break;
+		case 'f': file = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (!depth || depth >= elements || !pending || !range || theta <= 0 || theta >= 1)
+		usage(argv[0]);
+
+	if (file) {
+		read_trace(&t[0], file);
+		nr_traces = 1;
+	} else {
+		bench_trace_uniform(&t[0], n, range);
+		bench_trace_zipf(&t[1], n, range, theta);
+		/* 128KiB requests to 4MiB extents */
+		bench_trace_seq(&t[2], n, range, 32);
+		nr_traces = 3;
+	}
+
+	printf("# %u elements, %u changes per transaction, %u in flight, %u extents\n",
+	       elements, pending, depth, range);
+	printf("%-12s %-6s %9s %7s %12s %10s %10s %9s\n",
+	       "trace", "mode", "Mrefs/s", "hit%", "transactions", "changed", "evicted", "starving");
+	for (i = 0; i < nr_traces; i++) {
+		replay(&t[i], elements, pending, depth, false);
+		replay(&t[i], elements, pending, depth, true);
+		bench_trace_free(&t[i]);
+	}
+	return 0;
+}